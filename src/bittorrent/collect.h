@@ -1,73 +1,140 @@
 #pragma once
 
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/optional.hpp>
+
+#include <memory>
+#include <set>
+
+#include "contact.h"
+#include "../util/condition_variable.h"
+#include "../util/wait_condition.h"
+
 namespace ouinet { namespace bittorrent {
 
+struct CollectConfig {
+    /*
+     * Maximum number of candidates being evaluated at the same time
+     * (the "alpha" of Kademlia lookups).
+     */
+    size_t parallelism = 64;
+    /*
+     * Maximum number of not yet evaluated candidates to keep around. When
+     * there are more, the ones furthest away from the target are dropped.
+     */
+    size_t max_candidates = 256;
+    /*
+     * If set, no more candidates are evaluated once it becomes true.
+     * Evaluations already in progress are left to finish.
+     */
+    std::shared_ptr<const bool> stop;
+};
+
+/*
+ * Evaluate candidates in order of increasing distance to the target (as
+ * determined by the ordering of CandidateSet), adding new candidates returned
+ * by each evaluation, until there are no more candidates left.
+ *
+ * When evaluate returns boost::none for a candidate, all candidates further
+ * away from the target than that one are discarded.
+ */
 template<class CandidateSet, class Evaluate>
 void collect( asio::io_service& ios
             , CandidateSet candidates_
             , Evaluate&& evaluate
+            , const CollectConfig& config
             , asio::yield_context yield)
 {
-    enum Progress { unused, used };
-
-    using Candidates = std::map< Contact
-                               , Progress
-                               , typename CandidateSet::key_compare>;
+    using Candidates = std::set<Contact, typename CandidateSet::key_compare>;
 
     auto comp = candidates_.key_comp();
-    Candidates candidates(comp);
 
-    int in_progress_endpoints = 0;
+    /*
+     * Candidates not yet evaluated, closest first.
+     */
+    Candidates frontier(comp);
+    /*
+     * Candidates already added, so that none is evaluated twice. Those
+     * which could not make it into the frontier again are forgotten.
+     */
+    Candidates seen(comp);
+
+    // If set, every contact higher than *end will be ignored.
+    boost::optional<Contact> end;
+
+    auto prune = [&] {
+        if (end) {
+            frontier.erase(frontier.upper_bound(*end), frontier.end());
+            seen.erase(seen.upper_bound(*end), seen.end());
+        }
+        while (frontier.size() > config.max_candidates) {
+            frontier.erase(std::prev(frontier.end()));
+        }
+        if (!frontier.empty() && frontier.size() == config.max_candidates) {
+            // Further candidates would be dropped right away.
+            seen.erase(seen.upper_bound(*frontier.rbegin()), seen.end());
+        }
+    };
 
     for (auto& c : candidates_) {
-        candidates.insert(candidates.end(), { c, unused });
+        if (seen.insert(c).second) {
+            frontier.insert(frontier.end(), c);
+        }
     }
+    prune();
+
+    size_t in_progress_endpoints = 0;
 
-    const int THREADS = 64;
     WaitCondition all_done(ios);
     ConditionVariable candidate_available(ios);
 
-    // If set, every contact higher than *end will be ignored.
-    boost::optional<Contact> end;
-
-    for (int thread = 0; thread < THREADS; thread++) {
+    for (size_t thread = 0; thread < config.parallelism; thread++) {
         asio::spawn(ios, [&, lock = all_done.lock()] (asio::yield_context yield) {
             while (true) {
-                typename Candidates::iterator candidate_i = candidates.end();
-
-                /*
-                 * Try the closest untried candidate...
-                 */
-                for (auto it = candidates.begin(); it != candidates.end(); ++it) {
-                    if (end && comp(*end, it->first)) break;
-                    if (it->second != unused) continue;
-                    it->second = used;
-                    candidate_i = it;
-                    break;
+                if (config.stop && *config.stop) {
+                    candidate_available.notify();
+                    return;
                 }
 
-                if (candidate_i == candidates.end()) {
+                if (frontier.empty()) {
                     if (in_progress_endpoints == 0) {
+                        /*
+                         * Nothing left to do, let the others know as well.
+                         */
+                        candidate_available.notify();
                         return;
                     }
                     candidate_available.wait(yield);
                     continue;
                 }
 
+                /*
+                 * Take the closest untried candidate...
+                 */
+                Contact candidate = *frontier.begin();
+                frontier.erase(frontier.begin());
+
                 in_progress_endpoints++;
-                auto opt_new_candidates = evaluate(candidate_i->first, yield);
+                auto opt_new_candidates = evaluate(candidate, yield);
                 in_progress_endpoints--;
 
                 if (!opt_new_candidates) {
-                    if (!end || comp(candidate_i->first, *end)) {
-                        end = candidate_i->first;
+                    if (!end || comp(candidate, *end)) {
+                        end = candidate;
+                        prune();
                     }
+                    candidate_available.notify();
                     continue;
                 }
 
-                for (auto c : *opt_new_candidates) {
-                    candidates.insert({ c, unused });
+                for (auto& c : *opt_new_candidates) {
+                    Contact contact(c);
+                    if (end && comp(*end, contact)) continue;
+                    if (!seen.insert(contact).second) continue;
+                    frontier.insert(std::move(contact));
                 }
+                prune();
 
                 candidate_available.notify();
             }
@@ -77,4 +144,17 @@ void collect( asio::io_service& ios
     all_done.wait(yield);
 }
 
+template<class CandidateSet, class Evaluate>
+void collect( asio::io_service& ios
+            , CandidateSet candidates
+            , Evaluate&& evaluate
+            , asio::yield_context yield)
+{
+    collect( ios
+           , std::move(candidates)
+           , std::forward<Evaluate>(evaluate)
+           , CollectConfig()
+           , yield);
+}
+
 }} // namespaces
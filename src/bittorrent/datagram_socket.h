@@ -0,0 +1,72 @@
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/spawn.hpp>
+#include "../namespaces.h"
+#include "../or_throw.h"
+
+namespace ouinet { namespace bittorrent {
+
+/*
+ * What a UdpMultiplexer needs from the socket under it. Besides actual UDP
+ * sockets, this lets DHT nodes run on the SimulatedNetwork of the tests.
+ */
+class DatagramSocket {
+protected:
+    using udp = asio::ip::udp;
+
+public:
+    virtual asio::io_service& get_io_service() = 0;
+
+    virtual void send_to( asio::const_buffer
+                        , const udp::endpoint&
+                        , asio::yield_context) = 0;
+
+    virtual size_t receive_from( asio::mutable_buffer
+                               , udp::endpoint&
+                               , asio::yield_context) = 0;
+
+    // Pending and further receive_from calls fail with operation_aborted.
+    virtual void close() = 0;
+
+    virtual ~DatagramSocket() {}
+};
+
+class UdpSocket : public DatagramSocket {
+public:
+    UdpSocket(asio::io_service& ios, udp::socket socket)
+        : _ios(ios)
+        , _socket(std::move(socket))
+    {}
+
+    asio::io_service& get_io_service() override
+    {
+        return _ios;
+    }
+
+    void send_to( asio::const_buffer buffer
+                , const udp::endpoint& to
+                , asio::yield_context yield) override
+    {
+        _socket.async_send_to(asio::buffer(buffer), to, yield);
+    }
+
+    size_t receive_from( asio::mutable_buffer buffer
+                       , udp::endpoint& from
+                       , asio::yield_context yield) override
+    {
+        return _socket.async_receive_from(asio::buffer(buffer), from, yield);
+    }
+
+    void close() override
+    {
+        sys::error_code ec; // Ignored
+        _socket.close(ec);
+    }
+
+private:
+    asio::io_service& _ios;
+    udp::socket _socket;
+};
+
+}} // namespaces
@@ -15,7 +15,11 @@
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/steady_timer.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
 #include <set>
 
 #include <iostream>
@@ -39,13 +43,25 @@ std::string dht::NodeContact::to_string() const
 }
 
 
-dht::DhtNode::DhtNode(asio::io_service& ios, ip::address interface_address):
+dht::DhtNode::DhtNode( asio::io_service& ios
+                     , ip::address interface_address
+                     , boost::optional<fs::path> storage_dir
+                     , std::shared_ptr<MutableDataVerifier> verifier):
     _ios(ios),
     _interface_address(interface_address),
     _initialized(false),
     _tracker(std::make_unique<Tracker>(_ios)),
-    _data_store(std::make_unique<DataStore>(_ios))
+    _data_store(std::make_unique<DataStore>(_ios)),
+    _verifier(std::move(verifier)),
+    _query_available(_ios),
+    _query_rate_limiter(QUERY_RATE, QUERY_BURST, QUERY_RATE_LIMITER_MAX_ADDRESSES),
+    _lookup_cache(LOOKUP_CACHE_SIZE),
+    _storage_dir(std::move(storage_dir)),
+    _was_destroyed(std::make_shared<bool>(false))
 {
+    if (!_verifier) {
+        _verifier = std::make_shared<MutableDataVerifier>(_ios);
+    }
 }
 
 void dht::DhtNode::start(asio::yield_context yield)
@@ -69,20 +85,78 @@ void dht::DhtNode::start(asio::yield_context yield)
         return or_throw(yield, ec);
     }
 
+    start_on(std::make_unique<UdpSocket>(_ios, std::move(socket)), yield);
+}
+
+void dht::DhtNode::start( std::unique_ptr<DatagramSocket> socket
+                        , udp::endpoint bootstrap_endpoint
+                        , asio::yield_context yield)
+{
+    _bootstrap_server = bootstrap_endpoint;
+    start_on(std::move(socket), yield);
+}
+
+void dht::DhtNode::start_on( std::unique_ptr<DatagramSocket> socket
+                           , asio::yield_context yield)
+{
     _multiplexer = std::make_unique<UdpMultiplexer>(std::move(socket));
 
     _node_id = NodeID::zero();
     _next_transaction_id = 1;
 
+    bool restored = load_routing_table();
+
     asio::spawn(_ios, [this] (asio::yield_context yield) {
         receive_loop(yield);
     });
 
-    bootstrap(yield);
+    asio::spawn(_ios, [this] (asio::yield_context yield) {
+        query_loop(yield);
+    });
+
+    if (restored) {
+        /*
+         * The restored routing table is good enough to start working with.
+         * Check which of its nodes are still alive, and complete the
+         * bootstrap in the background.
+         */
+        _initialized = true;
+
+        _routing_table->for_each_bucket(
+            [&] (const NodeID::Range&, RoutingBucket& bucket) {
+                for (auto& node : bucket.nodes) {
+                    send_ping(node.contact);
+                }
+            });
+
+        asio::spawn(_ios, [this] (asio::yield_context yield) {
+            sys::error_code ec;
+            bootstrap(yield[ec]);
+        });
+    } else {
+        bootstrap(yield);
+    }
+
+    if (_storage_dir) {
+        asio::spawn(_ios, [this] (asio::yield_context yield) {
+            while (true) {
+                auto interval = std::chrono::seconds(ROUTING_TABLE_SNAPSHOT_INTERVAL_SECONDS);
+                if (!async_sleep(_ios, interval, _terminate_signal, yield)) {
+                    break;
+                }
+                save_routing_table();
+            }
+        });
+    }
 }
 
 void dht::DhtNode::stop()
 {
+    if (!_stopped) {
+        save_routing_table();
+        _terminate_signal();
+        _query_available.notify(asio::error::operation_aborted);
+    }
     _stopped = true;
     _tracker = nullptr;
     _data_store = nullptr;
@@ -91,6 +165,7 @@ void dht::DhtNode::stop()
 
 dht::DhtNode::~DhtNode()
 {
+    *_was_destroyed = true;
     stop();
 }
 
@@ -133,10 +208,7 @@ std::set<tcp::endpoint> dht::DhtNode::tracker_announce(NodeID infohash, boost::o
 
 boost::optional<BencodedValue> dht::DhtNode::data_get_immutable(const NodeID& key, asio::yield_context yield)
 {
-    /*
-     * This is a ProximitySet, really.
-     */
-    ProximityMap<boost::none_t> responsible_nodes(key, RESPONSIBLE_TRACKERS_PER_SWARM);
+    ProximityMap<CachedLookup::Node> responsible_nodes(key, RESPONSIBLE_TRACKERS_PER_SWARM);
     boost::optional<BencodedValue> data;
 
     collect(key, [&](const Contact& candidate , asio::yield_context yield)
@@ -169,7 +241,11 @@ boost::optional<BencodedValue> dht::DhtNode::data_get_immutable(const NodeID& ke
             BencodedMap& response = *response_;
 
             if (candidate.id) {
-                responsible_nodes.insert({ *candidate.id, boost::none });
+                auto put_token = response["token"].as_string();
+                responsible_nodes.insert({
+                    *candidate.id,
+                    { candidate.endpoint, put_token ? *put_token : "" }
+                });
             }
 
             if (response.count("v")) {
@@ -184,6 +260,8 @@ boost::optional<BencodedValue> dht::DhtNode::data_get_immutable(const NodeID& ke
         }
         , yield);
 
+    cache_lookup(key, { responsible_nodes.begin(), responsible_nodes.end() });
+
     return data;
 }
 
@@ -191,11 +269,16 @@ NodeID dht::DhtNode::data_put_immutable(const BencodedValue& data, asio::yield_c
 {
     NodeID key = _data_store->immutable_get_id(data);
 
-    struct ResponsibleNode {
-        asio::ip::udp::endpoint node_endpoint;
-        std::string put_token;
+    BencodedMap put_message {
+        { "id", _node_id.to_bytestring() },
+        { "v", data }
     };
-    ProximityMap<ResponsibleNode> responsible_nodes(key, RESPONSIBLE_TRACKERS_PER_SWARM);
+
+    if (put_to_cached_nodes(key, put_message, yield)) {
+        return key;
+    }
+
+    ProximityMap<CachedLookup::Node> responsible_nodes(key, RESPONSIBLE_TRACKERS_PER_SWARM);
 
     collect(key, [&](const Contact& candidate, asio::yield_context yield)
                  -> boost::optional<Candidates>
@@ -235,18 +318,19 @@ NodeID dht::DhtNode::data_put_immutable(const BencodedValue& data, asio::yield_c
         }
         , yield);
 
+    cache_lookup(key, { responsible_nodes.begin(), responsible_nodes.end() });
+
     WaitCondition wc(_ios);
     for (auto& i : responsible_nodes) {
         asio::spawn(_ios, [=, lock = wc.lock()] (asio::yield_context yield) {
+            BencodedMap message = put_message;
+            message["token"] = i.second.put_token;
+
             send_write_query(
-                i.second.node_endpoint,
+                i.second.endpoint,
                 i.first,
                 "put",
-                {
-                    { "id", _node_id.to_bytestring() },
-                    { "v", data },
-                    { "token", i.second.put_token }
-                },
+                message,
                 yield
             );
         });
@@ -260,85 +344,207 @@ boost::optional<MutableDataItem> dht::DhtNode::data_get_mutable(
     const util::Ed25519PublicKey& public_key,
     boost::string_view salt,
     asio::yield_context yield
+) {
+    return data_get_mutable(public_key, salt, MutableGetPolicy(), yield);
+}
+
+boost::optional<MutableDataItem> dht::DhtNode::data_get_mutable(
+    const util::Ed25519PublicKey& public_key,
+    boost::string_view salt,
+    const MutableGetPolicy& policy,
+    asio::yield_context yield
 ) {
     NodeID target_id = _data_store->mutable_get_id(public_key, salt);
 
     /*
-     * This is a ProximitySet, really.
+     * The search may be abandoned before it finishes, in which case the
+     * remaining queries complete in the background. Everything they touch
+     * must therefore outlive this function, and since this node may be
+     * destroyed meanwhile, they must check `_was_destroyed` after every
+     * wait before touching it again. collect() itself stops evaluating
+     * candidates once the node is gone.
      */
-    ProximityMap<boost::none_t> responsible_nodes(target_id, RESPONSIBLE_TRACKERS_PER_SWARM);
-    boost::optional<MutableDataItem> data;
+    struct SearchState {
+        ProximityMap<CachedLookup::Node> responsible_nodes;
+        boost::optional<MutableDataItem> data;
+        size_t agreeing_nodes = 0;
+        bool done = false;
+        sys::error_code ec;
+        ConditionVariable finished;
+
+        SearchState(asio::io_service& ios, const NodeID& target, size_t size)
+            : responsible_nodes(target, size)
+            , finished(ios)
+        {}
+
+        void finish(const sys::error_code& ec_ = sys::error_code()) {
+            if (done) return;
+            done = true;
+            ec = ec_;
+            finished.notify();
+        }
+    };
 
-    collect(target_id, [&](const Contact& candidate, asio::yield_context yield)
-                       -> boost::optional<Candidates>
-        {
-            if (!candidate.id && responsible_nodes.full()) {
-                return boost::none;
-            }
-            if (candidate.id && !responsible_nodes.would_insert(*candidate.id)) {
-                return boost::none;
-            }
+    auto state = std::make_shared<SearchState>( _ios
+                                              , target_id
+                                              , RESPONSIBLE_TRACKERS_PER_SWARM);
 
-            /*
-             * We want to find the latest version of the data, so don't stop early.
-             */
+    asio::steady_timer deadline_timer(_ios);
+    if (policy.deadline) {
+        deadline_timer.expires_from_now(*policy.deadline);
+        deadline_timer.async_wait([state] (const sys::error_code& ec) {
+            if (ec) return;
+            state->finish();
+        });
+    }
 
-            std::vector<NodeContact> closer_nodes;
-            boost::optional<BencodedMap> response_ = query_get_data(
-                target_id,
-                candidate,
-                closer_nodes,
-                yield
-            );
-            if (!response_) {
-                return closer_nodes;
-            }
-            BencodedMap& response = *response_;
+    asio::spawn(_ios, [ this
+                      , wd = _was_destroyed
+                      , verifier = _verifier
+                      , state
+                      , target_id
+                      , policy
+                      , public_key
+                      , salt = salt.to_string()
+                      ] (asio::yield_context yield) {
+        if (*wd) {
+            return state->finish(asio::error::operation_aborted);
+        }
 
-            if (candidate.id) {
-                responsible_nodes.insert({ *candidate.id, boost::none });
-            }
+        sys::error_code ec;
 
-            if (response["k"] != util::bytes::to_string(public_key.serialize())) {
-                return closer_nodes;
-            }
-            boost::optional<int64_t> sequence_number = response["seq"].as_int();
-            if (!sequence_number) {
-                return closer_nodes;
-            }
-            boost::optional<std::string> signature = response["sig"].as_string();
-            if (!signature || signature->size() != 64) {
-                return closer_nodes;
-            }
+        collect(target_id, [&](const Contact& candidate, asio::yield_context yield)
+                           -> boost::optional<Candidates>
+            {
+                /*
+                 * Once the policy is satisfied, don't bother with any
+                 * further candidates.
+                 */
+                if (state->done) {
+                    return boost::none;
+                }
+
+                auto& responsible_nodes = state->responsible_nodes;
+
+                if (!candidate.id && responsible_nodes.full()) {
+                    return boost::none;
+                }
+                if (candidate.id && !responsible_nodes.would_insert(*candidate.id)) {
+                    return boost::none;
+                }
+
+                std::vector<NodeContact> closer_nodes;
+                boost::optional<BencodedMap> response_ = query_get_data(
+                    target_id,
+                    candidate,
+                    closer_nodes,
+                    yield
+                );
+                if (*wd) {
+                    return boost::none;
+                }
+                if (!response_ || state->done) {
+                    return closer_nodes;
+                }
+                BencodedMap& response = *response_;
+
+                if (candidate.id) {
+                    auto put_token = response["token"].as_string();
+                    responsible_nodes.insert({
+                        *candidate.id,
+                        { candidate.endpoint, put_token ? *put_token : "" }
+                    });
+                }
+
+                if (response["k"] != util::bytes::to_string(public_key.serialize())) {
+                    return closer_nodes;
+                }
+                boost::optional<int64_t> sequence_number = response["seq"].as_int();
+                if (!sequence_number) {
+                    return closer_nodes;
+                }
+                if ( policy.min_sequence_number
+                  && *sequence_number < *policy.min_sequence_number) {
+                    return closer_nodes;
+                }
+                boost::optional<std::string> signature = response["sig"].as_string();
+                if (!signature || signature->size() != 64) {
+                    return closer_nodes;
+                }
+
+                MutableDataItem item {
+                    public_key,
+                    salt,
+                    response["v"],
+                    *sequence_number,
+                    util::bytes::to_array<uint8_t, 64>(*signature)
+                };
+                bool verified = verifier->verify(item, yield);
+                if (*wd) {
+                    return boost::none;
+                }
+                if (!verified || state->done) {
+                    return closer_nodes;
+                }
+
+                auto& data = state->data;
 
-            MutableDataItem item {
-                public_key,
-                salt.to_string(),
-                response["v"],
-                *sequence_number,
-                util::bytes::to_array<uint8_t, 64>(*signature)
-            };
-            if (item.verify()) {
                 if (!data || *sequence_number > data->sequence_number) {
                     data = item;
+                    state->agreeing_nodes = 1;
+                } else if ( *sequence_number == data->sequence_number
+                         && item.signature == data->signature) {
+                    state->agreeing_nodes++;
+                }
+
+                if (policy.quorum && state->agreeing_nodes >= policy.quorum) {
+                    state->finish();
                 }
+
+                return closer_nodes;
             }
+            , yield[ec]);
 
-            return closer_nodes;
+        if (*wd) {
+            return state->finish(asio::error::operation_aborted);
         }
-        , yield);
 
-    return data;
+        cache_lookup( target_id
+                    , { state->responsible_nodes.begin()
+                      , state->responsible_nodes.end() });
+
+        state->finish(ec);
+    });
+
+    if (!state->done) {
+        sys::error_code ec;
+        state->finished.wait(yield[ec]);
+    }
+
+    return or_throw(yield, state->ec, std::move(state->data));
 }
 
 NodeID dht::DhtNode::data_put_mutable(MutableDataItem data, asio::yield_context yield)
 {
     NodeID target_id = _data_store->mutable_get_id(data.public_key, data.salt);
 
-    struct ResponsibleNode {
-        asio::ip::udp::endpoint node_endpoint;
-        std::string put_token;
+    BencodedMap put_message {
+        { "id", _node_id.to_bytestring() },
+        { "k", util::bytes::to_string(data.public_key.serialize()) },
+        { "seq", data.sequence_number },
+        { "sig", util::bytes::to_string(data.signature) },
+        { "v", data.value }
     };
+
+    if (!data.salt.empty()) {
+        put_message["salt"] = data.salt;
+    }
+
+    if (put_to_cached_nodes(target_id, put_message, yield)) {
+        return target_id;
+    }
+
+    using ResponsibleNode = CachedLookup::Node;
     ProximityMap<ResponsibleNode> responsible_nodes(target_id, RESPONSIBLE_TRACKERS_PER_SWARM);
     std::map<NodeID, ResponsibleNode> outdated_nodes;
 
@@ -394,7 +600,12 @@ NodeID dht::DhtNode::data_put_mutable(MutableDataItem data, asio::yield_context
                 *existing_sequence_number,
                 util::bytes::to_array<uint8_t, 64>(*existing_signature)
             };
-            if (item.verify()) {
+            auto wd = _was_destroyed;
+            bool verified = _verifier->verify(item, yield);
+            if (*wd) {
+                return boost::none;
+            }
+            if (verified) {
                 if (*existing_sequence_number < data.sequence_number) {
                     /*
                      * This node has an old version of this data entry.
@@ -410,6 +621,8 @@ NodeID dht::DhtNode::data_put_mutable(MutableDataItem data, asio::yield_context
         }
         , yield);
 
+    cache_lookup(target_id, { responsible_nodes.begin(), responsible_nodes.end() });
+
     std::map<NodeID, ResponsibleNode*> all_nodes;
 
     for (auto& i : responsible_nodes) { all_nodes.insert({i.first, &i.second}); }
@@ -418,24 +631,14 @@ NodeID dht::DhtNode::data_put_mutable(MutableDataItem data, asio::yield_context
     WaitCondition wc(_ios);
     for (auto& i : all_nodes) {
         asio::spawn(_ios, [=, lock = wc.lock()] (asio::yield_context yield) {
-            BencodedMap put_message {
-                { "id", _node_id.to_bytestring() },
-                { "k", util::bytes::to_string(data.public_key.serialize()) },
-                { "seq", data.sequence_number },
-                { "sig", util::bytes::to_string(data.signature) },
-                { "v", data.value },
-                { "token", i.second->put_token }
-            };
-
-            if (!data.salt.empty()) {
-                put_message["salt"] = data.salt;
-            }
+            BencodedMap message = put_message;
+            message["token"] = i.second->put_token;
 
             send_write_query(
-                i.second->node_endpoint,
+                i.second->endpoint,
                 i.first,
                 "put",
-                put_message,
+                message,
                 yield
             );
         });
@@ -512,7 +715,7 @@ void dht::DhtNode::receive_loop(asio::yield_context yield)
         }
 
         if (*message_type == "q") {
-            handle_query(sender, *message_map, yield);
+            enqueue_query(sender, std::move(*message_map));
         } else if (*message_type == "r" || *message_type == "e") {
             auto it = _active_requests.find(*transaction_id);
             if (it != _active_requests.end() && it->second.destination == sender) {
@@ -522,6 +725,74 @@ void dht::DhtNode::receive_loop(asio::yield_context yield)
     }
 }
 
+void dht::DhtNode::enqueue_query(udp::endpoint sender, BencodedMap query)
+{
+    boost::optional<std::string> query_type = query["q"].as_string();
+    if (!query_type) {
+        return;
+    }
+
+    size_t priority;
+    double cost = 1;
+
+    if (*query_type == "ping" || *query_type == "find_node") {
+        priority = 0;
+    } else if (*query_type == "announce_peer" || *query_type == "put") {
+        priority = 2;
+        cost = WRITE_QUERY_COST;
+    } else {
+        priority = 1;
+    }
+
+    if (!_query_rate_limiter.consume(sender.address(), cost)) {
+        return;
+    }
+
+    auto& queue = _query_queues[priority];
+    if (queue.size() >= QUERY_QUEUE_SIZE) {
+        return;
+    }
+
+    queue.push_back(IncomingQuery{ sender, std::move(query) });
+    _query_available.notify();
+}
+
+void dht::DhtNode::query_loop(asio::yield_context yield)
+{
+    while (true) {
+        auto queue = std::find_if(_query_queues.begin(), _query_queues.end(),
+            [] (const std::deque<IncomingQuery>& q) { return !q.empty(); });
+
+        if (queue == _query_queues.end()) {
+            sys::error_code ec;
+            _query_available.wait(yield[ec]);
+            if (ec || _stopped) break;
+            continue;
+        }
+
+        IncomingQuery query = std::move(queue->front());
+        queue->pop_front();
+
+        if (_verifier->is_threaded() && query.query["q"] == "put") {
+            /*
+             * Handling a put may wait for its signature to be verified
+             * on another thread, keep handling queries in the meantime.
+             */
+            asio::spawn(_ios, [ this
+                              , wd = _was_destroyed
+                              , query = std::move(query)
+                              ] (asio::yield_context yield) {
+                if (*wd || _stopped) return;
+                handle_query(query.sender, query.query, yield);
+            });
+        } else {
+            handle_query(query.sender, std::move(query.query), yield);
+        }
+
+        if (_stopped) break;
+    }
+}
+
 std::string dht::DhtNode::new_transaction_string()
 {
 #if 0 // Useful for debugging
@@ -554,6 +825,10 @@ void dht::DhtNode::send( udp::endpoint destination
 #   if DEBUG_SHOW_MESSAGES
     std::cerr << "send: " << destination << " " << message << std::endl;
 #   endif
+    // Lookups still running when the node is stopped end up here.
+    if (_stopped) {
+        return or_throw(yield, asio::error::operation_aborted);
+    }
     _multiplexer->send(buffer(bencoding_encode(message)), destination, yield);
 }
 
@@ -627,7 +902,14 @@ BencodedMap dht::DhtNode::send_query_await_reply(
         timeout_timer.cancel();
     }
 
+    auto wd = _was_destroyed;
     reply_and_timeout_condition.wait(yield);
+
+    // Detached lookups may still be waiting for replies when this is gone.
+    if (*wd) {
+        return or_throw(yield, asio::error::operation_aborted, std::move(response));
+    }
+
     _active_requests.erase(transaction);
 
     if (dst.id) {
@@ -678,9 +960,11 @@ void dht::DhtNode::handle_query( udp::endpoint sender
 
         sys::error_code ec; // Ignored
 
+        // BEP 42: tell the sender what its address looks like to us.
         send( sender
             , BencodedMap { { "y", "r" }
                           , { "t", transaction }
+                          , { "ip", encode_endpoint(sender) }
                           , { "r", std::move(reply) } }
             , yield[ec]);
     };
@@ -715,7 +999,7 @@ void dht::DhtNode::handle_query( udp::endpoint sender
      * sender for any routing purposes.
      */
     boost::optional<int64_t> read_only_flag = arguments["ro"].as_int();
-    if (!read_only_flag || *read_only_flag != 1) {
+    if (_routing_table && (!read_only_flag || *read_only_flag != 1)) {
         /*
         * Add the sender to the routing table.
         */
@@ -727,7 +1011,15 @@ void dht::DhtNode::handle_query( udp::endpoint sender
         BencodedMap reply;
         send_reply(reply);
         return;
-    } else if (query_type == "find_node") {
+    }
+
+    if (!_routing_table) {
+        // Still bootstrapping, there is nothing useful to tell.
+        send_error(202, "Server Error");
+        return;
+    }
+
+    if (query_type == "find_node") {
         boost::optional<std::string> target_id_ = arguments["target"].as_string();
         if (!target_id_) {
             send_error(203, "Missing argument 'target'");
@@ -1023,7 +1315,13 @@ void dht::DhtNode::handle_query( udp::endpoint sender
                 sequence_number,
                 signature
             };
-            if (!item.verify()) {
+            auto wd = _was_destroyed;
+            bool valid = _verifier->verify(item, yield);
+
+            // The node may be gone once a worker thread is done with it.
+            if (*wd || _stopped) return;
+
+            if (!valid) {
                 send_error(206, "Invalid signature");
                 return;
             }
@@ -1129,12 +1427,18 @@ void dht::DhtNode::bootstrap(asio::yield_context yield)
 {
     sys::error_code ec;
 
-    // Other servers include router.utorrent.com:6881 and dht.transmissionbt.com:6881
-    auto bootstrap_ep = resolve(_ios, "router.bittorrent.com", "6881", yield[ec]);
+    udp::endpoint bootstrap_ep;
 
-    if (ec) {
-        std::cout << "Unable to resolve bootstrap server, giving up\n";
-        return;
+    if (_bootstrap_server) {
+        bootstrap_ep = *_bootstrap_server;
+    } else {
+        // Other servers include router.utorrent.com:6881 and dht.transmissionbt.com:6881
+        bootstrap_ep = resolve(_ios, "router.bittorrent.com", "6881", yield[ec]);
+
+        if (ec) {
+            std::cout << "Unable to resolve bootstrap server, giving up\n";
+            return;
+        }
     }
 
     BencodedMap initial_ping_message;
@@ -1163,9 +1467,33 @@ void dht::DhtNode::bootstrap(asio::yield_context yield)
         return;
     }
 
-    _node_id = NodeID::generate(my_endpoint->address());
+    if (!_routing_table || my_endpoint->address() != _wan_endpoint.address()) {
+        /*
+         * Either there is no restored routing table, or our address changed
+         * since it was saved and so must our ID. In the latter case the old
+         * contacts are still good starting points, so ping them into the new
+         * routing table.
+         */
+        std::vector<NodeContact> old_contacts;
+        if (_routing_table) {
+            _routing_table->for_each_bucket(
+                [&] (const NodeID::Range&, RoutingBucket& bucket) {
+                    for (auto& node : bucket.nodes) {
+                        old_contacts.push_back(node.contact);
+                    }
+                });
+        }
+
+        _node_id = NodeID::generate(my_endpoint->address());
+        _routing_table = std::make_unique<RoutingTable>(_node_id);
+
+        for (auto& contact : old_contacts) {
+            routing_bucket_try_add_node( _routing_table->find_bucket(contact.id, true)
+                                       , contact
+                                       , false);
+        }
+    }
     _wan_endpoint = *my_endpoint;
-    _routing_table = std::make_unique<RoutingTable>(_node_id);
 
     /*
      * TODO: Make bootstrap node handling and ID determination more reliable.
@@ -1209,10 +1537,262 @@ void dht::DhtNode::refresh_routing_table(asio::yield_context yield)
     wc.wait(yield);
 }
 
+fs::path dht::DhtNode::routing_table_snapshot_path() const
+{
+    assert(_storage_dir);
+    return *_storage_dir / ("routing-table-" + _interface_address.to_string());
+}
+
+/*
+ * The snapshot is a text file. The first line holds our node ID, our WAN
+ * endpoint and the (system clock) time the snapshot was taken at; every
+ * following line holds a routing node ID, its endpoint, and the number of
+ * seconds since we last heard from it at the time of the snapshot.
+ */
+void dht::DhtNode::save_routing_table() const
+{
+    if (!_storage_dir || !_routing_table) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto system_now = std::chrono::system_clock::now();
+
+    sys::error_code ec;
+    fs::create_directories(*_storage_dir, ec);
+
+    fs::path path = routing_table_snapshot_path();
+    fs::path temp_path = path;
+    temp_path += ".tmp";
+
+    std::ofstream file(temp_path.native(), std::ofstream::trunc);
+
+    if (!file.is_open()) {
+        std::cerr << "ERROR: Saving " << path << std::endl;
+        return;
+    }
+
+    file << _node_id.to_hex() << " "
+         << _wan_endpoint.address() << " "
+         << _wan_endpoint.port() << " "
+         << std::chrono::system_clock::to_time_t(system_now) << "\n";
+
+    _routing_table->for_each_bucket(
+        [&] (const NodeID::Range&, RoutingBucket& bucket) {
+            for (auto& node : bucket.nodes) {
+                if (node.is_bad()) continue;
+
+                auto age = std::chrono::duration_cast<std::chrono::seconds>
+                    (now - node.last_activity);
+
+                file << node.contact.id.to_hex() << " "
+                     << node.contact.endpoint.address() << " "
+                     << node.contact.endpoint.port() << " "
+                     << age.count() << "\n";
+            }
+        });
+
+    file.close();
+
+    if (!file) {
+        std::cerr << "ERROR: Saving " << path << std::endl;
+        return;
+    }
+
+    fs::rename(temp_path, path, ec);
+}
+
+/*
+ * Rebuild the routing table from the last snapshot, if there is a recent
+ * enough one. Returns whether the routing table was restored.
+ */
+bool dht::DhtNode::load_routing_table()
+{
+    if (!_storage_dir) {
+        return false;
+    }
+
+    fs::path path = routing_table_snapshot_path();
+
+    std::ifstream file(path.native());
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    auto parse_endpoint = [] (const std::string& addr, int port)
+                              -> boost::optional<udp::endpoint> {
+        sys::error_code ec;
+        auto address = ip::make_address(addr, ec);
+        if (ec || port <= 0 || port > 0xffff) return boost::none;
+        return udp::endpoint(address, port);
+    };
+
+    std::string node_id_hex, wan_address;
+    int wan_port;
+    std::time_t saved_at;
+
+    if (!(file >> node_id_hex >> wan_address >> wan_port >> saved_at)
+        || node_id_hex.size() != NodeID::size * 2
+        || !util::bytes::is_hex(node_id_hex)) {
+        std::cerr << "Warning: Ignoring malformed " << path << std::endl;
+        return false;
+    }
+
+    auto wan_endpoint = parse_endpoint(wan_address, wan_port);
+    if (!wan_endpoint || wan_endpoint->address().is_v4() != is_v4()) {
+        std::cerr << "Warning: Ignoring malformed " << path << std::endl;
+        return false;
+    }
+
+    /*
+     * The node ID must be the one for the saved address, otherwise other
+     * nodes would not keep us in their routing tables.
+     */
+    if (!NodeID::from_hex(node_id_hex).is_bep42_compliant(wan_endpoint->address())) {
+        std::cerr << "Warning: Ignoring " << path
+                  << ", its node ID does not match its address" << std::endl;
+        return false;
+    }
+
+    auto snapshot_age = std::chrono::system_clock::now()
+                      - std::chrono::system_clock::from_time_t(saved_at);
+    if (snapshot_age < std::chrono::seconds(0)) {
+        snapshot_age = std::chrono::seconds(0);
+    }
+
+    struct SavedNode {
+        NodeContact contact;
+        std::chrono::seconds age;
+    };
+    std::vector<SavedNode> saved_nodes;
+
+    std::string id_hex, address;
+    int port;
+    int64_t age_seconds;
+
+    while (file >> id_hex >> address >> port >> age_seconds) {
+        if (id_hex.size() != NodeID::size * 2 || !util::bytes::is_hex(id_hex)) {
+            continue;
+        }
+        auto endpoint = parse_endpoint(address, port);
+        if (!endpoint) continue;
+
+        auto age = std::chrono::duration_cast<std::chrono::seconds>(snapshot_age)
+                 + std::chrono::seconds(age_seconds);
+        if (age > std::chrono::seconds(ROUTING_TABLE_SNAPSHOT_MAX_AGE_SECONDS)) {
+            continue;
+        }
+
+        saved_nodes.push_back({ { NodeID::from_hex(id_hex), *endpoint }, age });
+    }
+
+    if (saved_nodes.empty()) {
+        return false;
+    }
+
+    _node_id = NodeID::from_hex(node_id_hex);
+    _wan_endpoint = *wan_endpoint;
+    _routing_table = std::make_unique<RoutingTable>(_node_id);
+
+    /*
+     * Buckets list their nodes oldest first.
+     */
+    std::sort(saved_nodes.begin(), saved_nodes.end(),
+        [] (const SavedNode& l, const SavedNode& r) { return l.age > r.age; });
+
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto& saved : saved_nodes) {
+        RoutingBucket* bucket = _routing_table->find_bucket(saved.contact.id, true);
+        if (bucket->nodes.size() >= RoutingBucket::BUCKET_SIZE) {
+            continue;
+        }
+
+        RoutingNode node;
+        node.contact = saved.contact;
+        node.last_activity = now - saved.age;
+        /*
+         * Restored nodes are on probation: a single failed query marks them
+         * as bad, while a successful one resets the counter.
+         */
+        node.queries_failed = 3;
+        node.questionable_ping_ongoing = false;
+        bucket->nodes.push_back(node);
+    }
+
+    return true;
+}
+
+void dht::DhtNode::cache_lookup( const NodeID& target
+                               , std::map<NodeID, CachedLookup::Node> nodes)
+{
+    if (nodes.empty()) {
+        return;
+    }
+
+    _lookup_cache.put(target, { std::move(nodes), std::chrono::steady_clock::now() });
+}
+
+/*
+ * If a recent lookup of $target left us with write tokens for its closest
+ * nodes, send $put_message to them straight away. Returns whether most of
+ * them accepted it; otherwise, the caller should perform a regular lookup.
+ */
+bool dht::DhtNode::put_to_cached_nodes( const NodeID& target
+                                      , const BencodedMap& put_message
+                                      , asio::yield_context yield)
+{
+    auto cached = _lookup_cache.get(target);
+
+    if (!cached) {
+        return false;
+    }
+
+    auto validity = std::chrono::seconds(LOOKUP_CACHE_TOKEN_VALIDITY_SECONDS);
+
+    if (cached->updated + validity < std::chrono::steady_clock::now()) {
+        return false;
+    }
+
+    if (cached->nodes.size() < RESPONSIBLE_TRACKERS_PER_SWARM / 2) {
+        return false;
+    }
+
+    for (auto& i : cached->nodes) {
+        if (i.second.put_token.empty()) return false;
+    }
+
+    /*
+     * Copy, the cache may change while we wait for replies.
+     */
+    auto nodes = cached->nodes;
+    size_t accepted = 0;
+
+    WaitCondition wc(_ios);
+    for (auto& i : nodes) {
+        asio::spawn(_ios, [&, lock = wc.lock()] (asio::yield_context yield) {
+            BencodedMap message = put_message;
+            message["token"] = i.second.put_token;
+
+            if (send_write_query( i.second.endpoint
+                                , i.first
+                                , "put"
+                                , message
+                                , yield)) {
+                accepted++;
+            }
+        });
+    }
+    wc.wait(yield);
+
+    return accepted * 2 > nodes.size();
+}
+
 template<class Evaluate>
 void dht::DhtNode::collect( const NodeID& target_id
                           , Evaluate&& evaluate
-                          , asio::yield_context yield) const
+                          , asio::yield_context yield)
 {
     if (!_routing_table) {
         // We're not yet bootstrapped.
@@ -1248,14 +1828,63 @@ void dht::DhtNode::collect( const NodeID& target_id
         added_endpoints.insert(contact.endpoint);
     }
 
+    auto now = std::chrono::steady_clock::now();
+    auto validity = std::chrono::seconds(LOOKUP_CACHE_VALIDITY_SECONDS);
+
+    /*
+     * If we looked up this target recently, the nodes found then are most
+     * likely still the closest ones, and the lookup can finish in a single
+     * round.
+     */
+    if (auto cached = _lookup_cache.get(target_id)) {
+        if (cached->updated + validity > now) {
+            for (auto& i : cached->nodes) {
+                if (!added_endpoints.insert(i.second.endpoint).second) continue;
+                seed_candidates.insert({ i.second.endpoint, i.first });
+            }
+        }
+    } else {
+        /*
+         * Otherwise, a recent lookup of a nearby target (e.g. the previous
+         * key in a batch of republished ones) may know of nodes closer to
+         * this target than any in the routing table.
+         */
+        const std::pair<NodeID, CachedLookup>* nearest = nullptr;
+
+        for (auto& i : _lookup_cache) {
+            if (i.second.updated + validity <= now) continue;
+            if (!nearest || target_id.closer_to(i.first, nearest->first)) {
+                nearest = &i;
+            }
+        }
+
+        if (nearest) {
+            for (auto& i : nearest->second.nodes) {
+                if ( !table_contacts.empty()
+                  && !target_id.closer_to(i.first, table_contacts.front().id)) {
+                    continue;
+                }
+                if (!added_endpoints.insert(i.second.endpoint).second) continue;
+                seed_candidates.insert({ i.second.endpoint, i.first });
+            }
+        }
+    }
+
     for (auto ep : _bootstrap_endpoints) {
         if (added_endpoints.count(ep) != 0) continue;
         seed_candidates.insert({ ep, boost::none });
     }
 
+    CollectConfig config;
+    config.parallelism = LOOKUP_PARALLELISM;
+    config.max_candidates = LOOKUP_MAX_CANDIDATES;
+    // Searches may outlive this node (see data_get_mutable).
+    config.stop = _was_destroyed;
+
     ::ouinet::bittorrent::collect( _ios
                                  , std::move(seed_candidates)
                                  , std::forward<Evaluate>(evaluate)
+                                 , config
                                  , yield);
 }
 
@@ -1293,11 +1922,15 @@ std::vector<dht::NodeContact> dht::DhtNode::find_closest_nodes(
         , yield);
 
     std::vector<NodeContact> output_set;
+    std::map<NodeID, CachedLookup::Node> lookup;
 
     for (auto& c : out) {
         output_set.push_back({ c.first, c.second });
+        lookup[c.first] = { c.second, "" };
     }
 
+    cache_lookup(target_id, std::move(lookup));
+
     return output_set;
 }
 
@@ -1323,9 +1956,9 @@ void dht::DhtNode::send_ping(NodeContact contact)
 
 /*
  * Send a query that writes data to the DHT. Repeat up to 5 times until we
- * get a positive response.
+ * get a response. Returns whether the write was accepted.
  */
-void dht::DhtNode::send_write_query(
+bool dht::DhtNode::send_write_query(
     udp::endpoint destination,
     NodeID destination_id,
     const std::string& query_type,
@@ -1348,9 +1981,11 @@ void dht::DhtNode::send_write_query(
         );
 
         if (!ec) {
-            break;
+            return write_reply["y"] == "r";
         }
     }
+
+    return false;
 }
 
 /**
@@ -1482,6 +2117,10 @@ boost::optional<BencodedMap> dht::DhtNode::query_get_data(
         yield[ec]
     );
 
+    if (ec == asio::error::operation_aborted) {
+        return boost::none;
+    }
+
     if (ec) {
         /*
          * Ideally, nodes that do not implement BEP 44 would reply to this
@@ -1607,10 +2246,16 @@ void dht::DhtNode::tracker_do_search_peers(
 
     peers.clear();
     responsible_nodes.clear();
+    /*
+     * Announce tokens are not valid for puts, so only cache the nodes.
+     */
+    std::map<NodeID, CachedLookup::Node> lookup;
     for (auto& i : responsible_nodes_full) {
         peers.insert(i.second.peers.begin(), i.second.peers.end());
         responsible_nodes[i.first] = { i.second.node_endpoint, i.second.put_token };
+        lookup[i.first] = { i.second.node_endpoint, "" };
     }
+    cache_lookup(infohash, std::move(lookup));
 }
 
 
@@ -1842,66 +2487,181 @@ void dht::DhtNode::routing_bucket_fail_node( RoutingBucket* bucket
 
 
 
-MainlineDht::MainlineDht(asio::io_service& ios)
+MainlineDht::MainlineDht( asio::io_service& ios
+                        , boost::optional<fs::path> storage_dir
+                        , size_t verification_threads)
     : _ios(ios)
+    , _storage_dir(std::move(storage_dir))
+    , _verifier(std::make_shared<MutableDataVerifier>(ios, verification_threads))
     , _was_destroyed(std::make_shared<bool>(false))
 {
     /*
      * Refresh publications periodically.
      */
-    asio::spawn(_ios, [this] (asio::yield_context yield) {
-        while (true) {
-            if (!async_sleep(_ios, std::chrono::seconds(60), _terminate_signal, yield)) {
-                break;
-            }
+    asio::spawn(_ios, [this, wd = _was_destroyed] (asio::yield_context yield) {
+        if (*wd) return;
+        republish_loop(yield);
+    });
+}
 
-            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+MainlineDht::~MainlineDht()
+{
+    *_was_destroyed = true;
+    _terminate_signal();
+}
 
-            /*
-             * TODO: This needs proper cancellation support, as soon as DhtNode supports that.
-             */
+/*
+ * This and its workers may resume after this object is destroyed, so they
+ * check `_was_destroyed` after every wait before touching any member.
+ */
+void MainlineDht::republish_loop(asio::yield_context yield)
+{
+    using Clock = std::chrono::steady_clock;
+    using Kind = dht::DhtPublications::Kind;
 
-            for (auto& i : _publications.tracker_publications) {
-                if (i.second.last_sent + std::chrono::seconds(_publications.ANNOUNCE_INTERVAL_SECONDS) < now) {
-                    i.second.last_sent = now;
-                    for (auto& j : _nodes) {
-                        asio::spawn(_ios, [&] (asio::yield_context yield) {
-                            j.second->tracker_announce(i.first, i.second.port, yield);
-                        });
-                    }
-                }
-            }
+    auto wd = _was_destroyed;
+    auto& publications = _publications;
+    auto tick = std::chrono::seconds(publications.REPUBLISH_TICK_SECONDS);
 
-            for (auto& i : _publications.immutable_publications) {
-                if (i.second.last_sent + std::chrono::seconds(_publications.PUT_INTERVAL_SECONDS) < now) {
-                    i.second.last_sent = now;
-                    for (auto& j : _nodes) {
-                        asio::spawn(_ios, [&] (asio::yield_context yield) {
-                            j.second->data_put_immutable(i.second.data, yield);
-                        });
-                    }
+    struct Due {
+        Clock::time_point last_sent;
+        Kind kind;
+        NodeID key;
+    };
+
+    while (true) {
+        if (!async_sleep(_ios, tick, _terminate_signal, yield) || *wd) {
+            break;
+        }
+
+        auto now = Clock::now();
+        std::vector<Due> due;
+
+        auto add_due = [&] (const auto& map, Kind kind, int interval) {
+            for (auto& i : map) {
+                if (i.second.last_sent + std::chrono::seconds(interval) < now) {
+                    due.push_back({ i.second.last_sent, kind, i.first });
                 }
             }
+        };
 
-            for (auto& i : _publications.mutable_publications) {
-                if (i.second.last_sent + std::chrono::seconds(_publications.PUT_INTERVAL_SECONDS) < now) {
-                    i.second.last_sent = now;
-                    for (auto& j : _nodes) {
-                        asio::spawn(_ios, [&] (asio::yield_context yield) {
-                            j.second->data_put_mutable(i.second.data, yield);
-                        });
-                    }
+        add_due( publications.tracker_publications, Kind::tracker_announce
+               , publications.ANNOUNCE_INTERVAL_SECONDS);
+        add_due( publications.immutable_publications, Kind::immutable_put
+               , publications.PUT_INTERVAL_SECONDS);
+        add_due( publications.mutable_publications, Kind::mutable_put
+               , publications.PUT_INTERVAL_SECONDS);
+
+        if (due.empty()) continue;
+
+        /*
+         * Enough to republish everything in half its interval, which leaves
+         * room before the entries expire on other nodes.
+         */
+        double rate
+            = double(publications.tracker_publications.size())
+                / publications.ANNOUNCE_INTERVAL_SECONDS
+            + double( publications.immutable_publications.size()
+                    + publications.mutable_publications.size())
+                / publications.PUT_INTERVAL_SECONDS;
+
+        size_t budget = std::ceil(rate * 2 * publications.REPUBLISH_TICK_SECONDS);
+
+        if (due.size() > budget) {
+            // The most overdue ones first.
+            std::nth_element(due.begin(), due.begin() + budget, due.end(),
+                [] (const Due& l, const Due& r) { return l.last_sent < r.last_sent; });
+            due.resize(budget);
+        }
+
+        /*
+         * Give each worker a run of neighbouring keys, so that each lookup
+         * can start from the nodes found by the one before it.
+         */
+        std::sort(due.begin(), due.end(),
+            [] (const Due& l, const Due& r) { return l.key < r.key; });
+
+        size_t workers = std::min(publications.MAX_CONCURRENT_REPUBLISHES, due.size());
+        size_t chunk = (due.size() + workers - 1) / workers;
+
+        WaitCondition wc(_ios);
+
+        for (size_t begin = 0; begin < due.size(); begin += chunk) {
+            size_t end = std::min(begin + chunk, due.size());
+
+            asio::spawn(_ios, [&, begin, end, wd, lock = wc.lock()]
+                              (asio::yield_context yield) {
+                for (size_t i = begin; i < end; i++) {
+                    if (*wd) return;
+                    republish(due[i].kind, due[i].key, yield);
                 }
-            }
+            });
         }
-    });
 
+        wc.wait(yield);
+
+        if (*wd) break;
+    }
 }
 
-MainlineDht::~MainlineDht()
+/*
+ * Republish one publication from every DHT node, if it was not stopped in
+ * the meantime.
+ *
+ * Each put holds its node, so that it stays alive even if it is removed
+ * (e.g. by `set_interfaces`) before the put is done. Nothing else of this
+ * object is touched after the first wait.
+ */
+void MainlineDht::republish( dht::DhtPublications::Kind kind
+                           , NodeID key
+                           , asio::yield_context yield)
 {
-    *_was_destroyed = true;
-    _terminate_signal();
+    using Kind = dht::DhtPublications::Kind;
+
+    auto now = std::chrono::steady_clock::now();
+    std::function<void(dht::DhtNode&, asio::yield_context)> publish;
+
+    switch (kind) {
+        case Kind::tracker_announce: {
+            auto it = _publications.tracker_publications.find(key);
+            if (it == _publications.tracker_publications.end()) return;
+            it->second.last_sent = now;
+            publish = [key, port = it->second.port] (dht::DhtNode& node, asio::yield_context yield) {
+                node.tracker_announce(key, port, yield);
+            };
+            break;
+        }
+        case Kind::immutable_put: {
+            auto it = _publications.immutable_publications.find(key);
+            if (it == _publications.immutable_publications.end()) return;
+            it->second.last_sent = now;
+            publish = [data = it->second.data] (dht::DhtNode& node, asio::yield_context yield) {
+                node.data_put_immutable(data, yield);
+            };
+            break;
+        }
+        case Kind::mutable_put: {
+            auto it = _publications.mutable_publications.find(key);
+            if (it == _publications.mutable_publications.end()) return;
+            it->second.last_sent = now;
+            publish = [data = it->second.data] (dht::DhtNode& node, asio::yield_context yield) {
+                node.data_put_mutable(data, yield);
+            };
+            break;
+        }
+    }
+
+    WaitCondition wc(_ios);
+
+    for (auto& i : _nodes) {
+        asio::spawn(_ios, [&, node = i.second, lock = wc.lock()]
+                          (asio::yield_context yield) {
+            sys::error_code ec;
+            publish(*node, yield[ec]);
+        });
+    }
+
+    wc.wait(yield);
 }
 
 void MainlineDht::set_interfaces( const std::vector<asio::ip::address>& addresses
@@ -1915,7 +2675,7 @@ void MainlineDht::set_interfaces( const std::vector<asio::ip::address>& addresse
         addresses_used.insert(address);
 
         if (!_nodes.count(address)) {
-            auto node = std::make_unique<dht::DhtNode>(_ios, address);
+            auto node = std::make_unique<dht::DhtNode>(_ios, address, _storage_dir, _verifier);
 
             asio::spawn(_ios, [&, n = std::move(node), lock = wc.lock()]
                               (asio::yield_context yield) mutable {
@@ -2078,13 +2838,22 @@ boost::optional<MutableDataItem> MainlineDht::mutable_get(
     const util::Ed25519PublicKey& public_key,
     boost::string_view salt,
     asio::yield_context yield
+) {
+    return mutable_get(public_key, salt, MutableGetPolicy(), yield);
+}
+
+boost::optional<MutableDataItem> MainlineDht::mutable_get(
+    const util::Ed25519PublicKey& public_key,
+    boost::string_view salt,
+    const MutableGetPolicy& policy,
+    asio::yield_context yield
 ) {
     boost::optional<MutableDataItem> output;
 
     SuccessCondition condition(_ios);
     for (auto& i : _nodes) {
         asio::spawn(_ios, [&, lock = condition.lock()] (asio::yield_context yield) {
-            boost::optional<MutableDataItem> data = i.second->data_get_mutable(public_key, salt, yield);
+            boost::optional<MutableDataItem> data = i.second->data_get_mutable(public_key, salt, policy, yield);
 
             if (data) {
                 output = data;
@@ -4,44 +4,155 @@
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/filesystem.hpp>
 
+#include <array>
 #include <chrono>
+#include <deque>
+#include <set>
 #include <vector>
 
 #include "bencoding.h"
 #include "dht_storage.h"
 #include "mutable_data.h"
 #include "node_id.h"
+#include "rate_limiter.h"
 #include "routing_table.h"
 #include "contact.h"
 
 #include "../namespaces.h"
+#include "../util/condition_variable.h"
 #include "../util/crypto.h"
+#include "../util/lru_cache.h"
 #include "../util/signal.h"
 #include "../util/wait_condition.h"
 
 namespace ouinet {
 namespace bittorrent {
 
+class DatagramSocket;
 class UdpMultiplexer;
 
 namespace ip = asio::ip;
 using ip::tcp;
 using ip::udp;
 
+/*
+ * Determines when a search for a BEP-44 mutable data item may stop before
+ * the whole neighbourhood of the target has been queried.
+ *
+ * The default constructed policy searches exhaustively, and returns the item
+ * with the highest sequence number found.
+ */
+struct MutableGetPolicy {
+    /*
+     * Stop as soon as this many nodes returned the same (most recent) version
+     * of the item. Zero means never stop early.
+     */
+    size_t quorum = 0;
+    /*
+     * Ignore any version of the item older than this.
+     */
+    boost::optional<int64_t> min_sequence_number;
+    /*
+     * Stop searching after this amount of time, returning the most recent
+     * version found so far, if any.
+     */
+    boost::optional<asio::steady_timer::duration> deadline;
+};
+
 
 namespace dht {
 
 class DhtNode {
     public:
     const size_t RESPONSIBLE_TRACKERS_PER_SWARM = 8;
+    /*
+     * Number of nodes queried in parallel during a lookup.
+     */
+    const size_t LOOKUP_PARALLELISM = 16;
+    /*
+     * Number of not yet queried nodes a lookup keeps around. Besides the
+     * closest nodes, it needs some spares for when those don't reply.
+     */
+    const size_t LOOKUP_MAX_CANDIDATES = RESPONSIBLE_TRACKERS_PER_SWARM * 4;
+
+    /*
+     * How often the routing table is saved to disk, if a storage directory
+     * has been given.
+     */
+    const int ROUTING_TABLE_SNAPSHOT_INTERVAL_SECONDS = 60 * 5;
+    /*
+     * Contacts not heard from in this long are not worth restoring.
+     */
+    const int ROUTING_TABLE_SNAPSHOT_MAX_AGE_SECONDS = 3600 * 24;
+    /*
+     * Number of targets whose closest nodes are remembered between lookups.
+     */
+    const size_t LOOKUP_CACHE_SIZE = 256;
+    /*
+     * Cached lookups older than this are not used to seed new lookups.
+     */
+    const int LOOKUP_CACHE_VALIDITY_SECONDS = 3600;
+    /*
+     * Write tokens are usually valid for at least 10 minutes; only use
+     * cached ones well within that.
+     */
+    const int LOOKUP_CACHE_TOKEN_VALIDITY_SECONDS = 60 * 5;
+    /*
+     * Incoming queries are rate limited per source address, with a token
+     * bucket of QUERY_BURST tokens refilled at QUERY_RATE tokens per second.
+     * Write queries (announce_peer, put) cost more, as they are more
+     * expensive to handle.
+     */
+    const double QUERY_RATE = 10;
+    const double QUERY_BURST = 50;
+    const double WRITE_QUERY_COST = 5;
+    const size_t QUERY_RATE_LIMITER_MAX_ADDRESSES = 10000;
+    /*
+     * Maximum number of incoming queries waiting to be handled, per
+     * priority level. Further queries are dropped.
+     */
+    const size_t QUERY_QUEUE_SIZE = 256;
 
     public:
-    DhtNode(asio::io_service& ios, ip::address interface_address);
+    /*
+     * If $storage_dir is set, the routing table is periodically saved to it,
+     * and restored from it by start(). A node with a restored routing table
+     * is usable right away, while the bootstrap happens in the background.
+     *
+     * The $verifier checks the signature of mutable data items; if unset,
+     * they are checked in the io_service thread.
+     */
+    DhtNode( asio::io_service& ios
+           , ip::address interface_address
+           , boost::optional<fs::path> storage_dir = boost::none
+           , std::shared_ptr<MutableDataVerifier> verifier = nullptr);
     void start(asio::yield_context);
+    /*
+     * Start on an already set up $socket, and bootstrap off the node at
+     * $bootstrap_endpoint rather than the public bootstrap servers. This is
+     * how nodes run on a SimulatedNetwork.
+     */
+    void start( std::unique_ptr<DatagramSocket> socket
+              , udp::endpoint bootstrap_endpoint
+              , asio::yield_context);
     void stop();
     bool initialized() const { return _initialized; }
 
+    /*
+     * Counters about what other nodes store in this one, for monitoring.
+     */
+    Tracker::Stats tracker_stats() const
+    {
+        return _tracker ? _tracker->stats() : Tracker::Stats();
+    }
+
+    DataStore::Stats data_store_stats() const
+    {
+        return _data_store ? _data_store->stats() : DataStore::Stats();
+    }
+
     /**
      * Query peers for a bittorrent swarm surrounding a particular infohash.
      * This returns a randomized subset of all such peers, not the entire swarm.
@@ -80,8 +191,6 @@ class DhtNode {
      * combination.
      * @return The data stored in the DHT under ($public_key, $salt), or
      *         boost::none if no such data was found.
-     *
-     * TODO: Implement minimum sequence number if we ever need it.
      */
     boost::optional<MutableDataItem> data_get_mutable(
         const util::Ed25519PublicKey& public_key,
@@ -89,6 +198,16 @@ class DhtNode {
         asio::yield_context yield
     );
 
+    /**
+     * As above, but stop searching as soon as $policy is satisfied.
+     */
+    boost::optional<MutableDataItem> data_get_mutable(
+        const util::Ed25519PublicKey& public_key,
+        boost::string_view salt,
+        const MutableGetPolicy& policy,
+        asio::yield_context yield
+    );
+
     /**
      * Store a pre-signed BEP-44 mutable data item in the DHT. The data item
      * can be found when searching for the combination of (public key, salt).
@@ -123,11 +242,25 @@ class DhtNode {
     bool is_v6() const { return _interface_address.is_v6(); }
 
     udp::endpoint wan_endpoint() const { return _wan_endpoint; }
+    const NodeID& node_id() const { return _node_id; }
+
+    /*
+     * Find the nodes closest to $target_id, i.e. those responsible for
+     * storing data under it.
+     */
+    std::vector<NodeContact> find_closest_nodes(
+        NodeID target_id,
+        asio::yield_context yield
+    );
 
     ~DhtNode();
 
     private:
+    void start_on(std::unique_ptr<DatagramSocket>, asio::yield_context);
+
     void receive_loop(asio::yield_context yield);
+    void enqueue_query(udp::endpoint sender, BencodedMap query);
+    void query_loop(asio::yield_context yield);
 
     void send( udp::endpoint destination
              , const BencodedMap& query_arguments
@@ -153,17 +286,16 @@ class DhtNode {
 
     void refresh_routing_table(asio::yield_context yield);
 
-    std::vector<NodeContact> find_closest_nodes(
-        NodeID target_id,
-        asio::yield_context yield
-    );
+    fs::path routing_table_snapshot_path() const;
+    bool load_routing_table();
+    void save_routing_table() const;
 
     std::string new_transaction_string();
 
     // http://bittorrent.org/beps/bep_0005.html#ping
     void send_ping(NodeContact contact);
 
-    void send_write_query(
+    bool send_write_query(
         udp::endpoint destination,
         NodeID destination_id,
         const std::string& query_type,
@@ -215,8 +347,29 @@ class DhtNode {
 
     static bool closer_to(const NodeID& reference, const NodeID& left, const NodeID& right);
 
+    /*
+     * The closest nodes found by the last lookup of some target, along with
+     * the write tokens they handed out (if any). These are used to seed
+     * later lookups of the same target, and to skip the lookup altogether
+     * when writing while the tokens are still fresh.
+     */
+    struct CachedLookup {
+        struct Node {
+            udp::endpoint endpoint;
+            std::string put_token;
+        };
+        std::map<NodeID, Node> nodes;
+        std::chrono::steady_clock::time_point updated;
+    };
+
+    void cache_lookup(const NodeID& target, std::map<NodeID, CachedLookup::Node>);
+
+    bool put_to_cached_nodes( const NodeID& target
+                            , const BencodedMap& put_message
+                            , asio::yield_context);
+
     template<class Evaluate>
-    void collect(const NodeID& target, Evaluate&&, asio::yield_context) const;
+    void collect(const NodeID& target, Evaluate&&, asio::yield_context);
 
     private:
     asio::io_service& _ios;
@@ -229,6 +382,7 @@ class DhtNode {
     std::unique_ptr<RoutingTable> _routing_table;
     std::unique_ptr<Tracker> _tracker;
     std::unique_ptr<DataStore> _data_store;
+    std::shared_ptr<MutableDataVerifier> _verifier;
 
     struct ActiveRequest {
         udp::endpoint destination;
@@ -237,7 +391,28 @@ class DhtNode {
     uint32_t _next_transaction_id;
     std::map<std::string, ActiveRequest> _active_requests;
 
+    boost::optional<udp::endpoint> _bootstrap_server;
     std::vector<udp::endpoint> _bootstrap_endpoints;
+
+    /*
+     * Replies to our own queries are handled as soon as they arrive.
+     * Incoming queries are queued by priority: pings and find_node first,
+     * then other reads, then writes. That way our own lookups keep working
+     * when the node is flooded with queries.
+     */
+    struct IncomingQuery {
+        udp::endpoint sender;
+        BencodedMap query;
+    };
+    std::array<std::deque<IncomingQuery>, 3> _query_queues;
+    ConditionVariable _query_available;
+    RateLimiter _query_rate_limiter;
+
+    util::LruCache<NodeID, CachedLookup> _lookup_cache;
+
+    boost::optional<fs::path> _storage_dir;
+    Signal<void()> _terminate_signal;
+    std::shared_ptr<bool> _was_destroyed;
 };
 
 struct DhtPublications
@@ -253,6 +428,16 @@ struct DhtPublications
      * slightly faster, to avoid unfortunate rounding errors.
      */
     const int PUT_INTERVAL_SECONDS = 60 * 50;
+    /*
+     * Republishing is spread over time instead of done all at once: every
+     * REPUBLISH_TICK_SECONDS, only as many of the due publications are
+     * refreshed as it takes to get through all of them in half their
+     * interval, at most MAX_CONCURRENT_REPUBLISHES at a time.
+     */
+    const int REPUBLISH_TICK_SECONDS = 10;
+    const size_t MAX_CONCURRENT_REPUBLISHES = 8;
+
+    enum class Kind { tracker_announce, immutable_put, mutable_put };
 
     struct TrackerPublication {
         boost::optional<int> port;
@@ -277,7 +462,17 @@ struct DhtPublications
 
 class MainlineDht {
     public:
-    MainlineDht(asio::io_service& ios);
+    /*
+     * If $storage_dir is set, the state of each DHT node (e.g. its routing
+     * table) is kept there so that it survives restarts.
+     *
+     * If $verification_threads is not zero, signatures of mutable data items
+     * are verified on that many worker threads, so that floods of puts do
+     * not block the io_service thread.
+     */
+    MainlineDht( asio::io_service& ios
+               , boost::optional<fs::path> storage_dir = boost::none
+               , size_t verification_threads = 0);
 
     MainlineDht(const MainlineDht&) = delete;
     MainlineDht& operator=(const MainlineDht&) = delete;
@@ -307,25 +502,35 @@ class MainlineDht {
      */
     std::set<tcp::endpoint> tracker_get_peers(NodeID infohash, asio::yield_context yield);
     boost::optional<BencodedValue> immutable_get(NodeID key, asio::yield_context yield);
+    boost::optional<MutableDataItem> mutable_get(
+        const util::Ed25519PublicKey& public_key,
+        boost::string_view salt,
+        asio::yield_context yield
+    );
     /*
-     * TODO:
-     *
-     * Ideally, this interface should provide some way for the user to signal
-     * when the best result found so far is good (that is, recent) enough, and
-     * when to keep searching in the hopes of finding a more recent entry.
-     * The current version is a quick-and-dirty good-enough-for-now.
+     * The policy lets the caller signal when the best result found so far is
+     * good (that is, recent and replicated) enough, instead of waiting for
+     * the full search to finish in the hopes of finding a more recent entry.
      */
     boost::optional<MutableDataItem> mutable_get(
         const util::Ed25519PublicKey& public_key,
         boost::string_view salt,
+        const MutableGetPolicy& policy,
         asio::yield_context yield
     );
 
     asio::io_service& get_io_service() { return _ios; }
 
+    private:
+    void republish_loop(asio::yield_context);
+    void republish(dht::DhtPublications::Kind, NodeID key, asio::yield_context);
+
     private:
     asio::io_service& _ios;
-    std::map<asio::ip::address, std::unique_ptr<dht::DhtNode>> _nodes;
+    boost::optional<fs::path> _storage_dir;
+    std::shared_ptr<MutableDataVerifier> _verifier;
+    // Shared with republishing puts still running on them.
+    std::map<asio::ip::address, std::shared_ptr<dht::DhtNode>> _nodes;
     dht::DhtPublications _publications;
     Signal<void()> _terminate_signal;
     std::shared_ptr<bool> _was_destroyed;
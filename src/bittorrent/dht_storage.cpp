@@ -5,14 +5,47 @@
 #include "../util/crypto.h"
 
 #include <cstdlib>
+#include <cstring>
 
 namespace ouinet {
 namespace bittorrent {
 namespace dht {
 
-detail::DhtWriteTokenStorage::DhtWriteTokenStorage():
-    _salt(util::random(32))
-{}
+/*
+ * Compare without bailing out at the first difference, so that the time
+ * taken does not tell how much of a forged token is right.
+ */
+static bool equal_in_constant_time(const uint8_t* a, const uint8_t* b, size_t size)
+{
+    uint8_t diff = 0;
+    for (size_t i = 0; i < size; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+std::array<uint8_t, 20>
+detail::DhtWriteTokenStorage::token_hash( const Secret& secret
+                                        , const asio::ip::address& address
+                                        , const NodeID& id)
+{
+    /*
+     * IPv4 addresses are hashed in their IPv6 mapped form, so that every
+     * input has the same layout.
+     */
+    asio::ip::address_v6 address_v6 = address.is_v4()
+        ? asio::ip::address_v6::v4_mapped(address.to_v4())
+        : address.to_v6();
+
+    auto address_bytes = address_v6.to_bytes();
+
+    uint8_t buffer[sizeof(secret.key) + sizeof(address_bytes) + NodeID::size];
+    uint8_t* p = buffer;
+
+    memcpy(p, secret.key.data(), secret.key.size());  p += secret.key.size();
+    memcpy(p, address_bytes.data(), address_bytes.size()); p += address_bytes.size();
+    memcpy(p, id.buffer.data(), id.buffer.size());
+
+    return util::sha1_buffer(buffer, sizeof(buffer));
+}
 
 std::string detail::DhtWriteTokenStorage::generate_token(asio::ip::address address, NodeID id)
 {
@@ -21,26 +54,39 @@ std::string detail::DhtWriteTokenStorage::generate_token(asio::ip::address addre
 
     if (_secrets.empty() || now > _last_generated + std::chrono::seconds(SECRET_REFRESH_TIME_SECONDS)) {
         Secret secret;
-        secret.secret = std::to_string(now.time_since_epoch().count()) + _salt;
+        secret.key = util::bytes::to_array<uint8_t, 20>(util::random(20));
+        secret.generation = _next_generation++;
         secret.expires = now + std::chrono::seconds(TOKEN_VALIDITY_SECONDS);
         _secrets.push_back(secret);
+        _last_generated = now;
     }
 
-    std::string secret = _secrets.back().secret;
-    auto hash = util::sha1(secret + address.to_string() + id.to_bytestring());
-    return std::string((char *)hash.data(), hash.size());
+    const Secret& secret = _secrets.back();
+    auto hash = token_hash(secret, address, id);
+
+    std::string token(hash.size(), '\0');
+    token[0] = secret.generation;
+    memcpy(&token[1], hash.data(), hash.size() - 1);
+    return token;
 }
 
 bool detail::DhtWriteTokenStorage::verify_token(asio::ip::address address, NodeID id, const std::string& token)
 {
     expire();
 
-    for (auto& i : _secrets) {
-        auto hash = util::sha1(i.secret + address.to_string() + id.to_bytestring());
+    if (token.size() != 20) {
+        return false;
+    }
 
-        if (boost::string_view((char *)hash.data(), hash.size()) == token) {
-            return true;
-        }
+    uint8_t generation = token[0];
+
+    for (auto& secret : _secrets) {
+        if (secret.generation != generation) continue;
+
+        auto hash = token_hash(secret, address, id);
+        return equal_in_constant_time( reinterpret_cast<const uint8_t*>(token.data()) + 1
+                                     , hash.data()
+                                     , hash.size() - 1);
     }
 
     return false;
@@ -56,22 +102,34 @@ void detail::DhtWriteTokenStorage::expire()
 
 
 
-void detail::Swarm::add(tcp::endpoint endpoint)
+boost::optional<detail::AnnounceList::iterator>
+detail::Swarm::find(const tcp::endpoint& endpoint) const
 {
-    auto now = std::chrono::steady_clock::now();
     auto it = _peer_indices.find(endpoint);
+    if (it == _peer_indices.end()) return boost::none;
+    return _peers[it->second];
+}
 
-    if (it == _peer_indices.end()) {
-        Peer peer;
-        peer.endpoint = endpoint;
-        peer.last_seen = now;
-        _peer_indices[endpoint] = _peers.size();
-        _peers.push_back(peer);
-    } else {
-        size_t index = it->second;
-        assert(_peers[index].endpoint == endpoint);
-        _peers[index].last_seen = now;
+void detail::Swarm::add(AnnounceList::iterator announce)
+{
+    assert(!_peer_indices.count(announce->endpoint));
+    _peer_indices[announce->endpoint] = _peers.size();
+    _peers.push_back(announce);
+}
+
+void detail::Swarm::remove(const tcp::endpoint& endpoint)
+{
+    auto it = _peer_indices.find(endpoint);
+    if (it == _peer_indices.end()) return;
+
+    size_t index = it->second;
+    size_t replacement = _peers.size() - 1;
+    if (replacement != index) {
+        _peer_indices[_peers[replacement]->endpoint] = index;
+        std::swap(_peers[replacement], _peers[index]);
     }
+    _peer_indices.erase(it);
+    _peers.pop_back();
 }
 
 /*
@@ -88,39 +146,20 @@ std::vector<tcp::endpoint> detail::Swarm::list(unsigned int count)
          * (3) update the peer index accordingly.
          */
         size_t target = i + std::rand() % (_peers.size() - i);
-        output.push_back(_peers[target].endpoint);
+        output.push_back(_peers[target]->endpoint);
         if (target != i) {
-            std::swap(_peer_indices[_peers[target].endpoint], _peer_indices[_peers[i].endpoint]);
+            std::swap(_peer_indices[_peers[target]->endpoint], _peer_indices[_peers[i]->endpoint]);
             std::swap(_peers[target], _peers[i]);
         }
     }
     return output;
 }
 
-void detail::Swarm::expire()
-{
-    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-
-    size_t i = 0;
-    while (i < _peers.size()) {
-        if (_peers[i].last_seen + std::chrono::seconds(ANNOUNCE_VALIDITY_SECONDS) < now) {
-            size_t replacement = _peers.size() - 1;
-            if (replacement != i) {
-                std::swap(_peer_indices[_peers[replacement].endpoint], _peer_indices[_peers[i].endpoint]);
-                std::swap(_peers[replacement], _peers[i]);
-            }
-            _peer_indices.erase(_peers[replacement].endpoint);
-            _peers.pop_back();
-        } else {
-            i++;
-        }
-    }
-}
-
 
 
-Tracker::Tracker(asio::io_service& ios):
-    _ios(ios)
+Tracker::Tracker(asio::io_service& ios, size_t max_peers):
+    _ios(ios),
+    _max_peers(max_peers)
 {
     /*
      * Every so often, remove expired peers from swarms.
@@ -131,15 +170,7 @@ Tracker::Tracker(asio::io_service& ios):
                 break;
             }
 
-            auto it = _swarms.begin();
-            while (it != _swarms.end()) {
-                it->second->expire();
-                if (it->second->empty()) {
-                    it = _swarms.erase(it);
-                } else {
-                    ++it;
-                }
-            }
+            expire();
         }
     });
 }
@@ -151,25 +182,77 @@ Tracker::~Tracker()
 
 void Tracker::add_peer(NodeID swarm, tcp::endpoint endpoint)
 {
-    if (!_swarms.count(swarm)) {
-        _swarms[swarm] = std::make_unique<detail::Swarm>();
+    expire();
+
+    auto now = std::chrono::steady_clock::now();
+    detail::Swarm& s = _swarms[swarm];
+
+    if (auto announce = s.find(endpoint)) {
+        (*announce)->last_seen = now;
+        _announces.splice(_announces.end(), _announces, *announce);
+        return;
+    }
+
+    if (s.empty()) _stats.swarms++;
+
+    _announces.push_back(detail::Announce{ swarm, endpoint, now });
+    s.add(std::prev(_announces.end()));
+    _stats.peers++;
+
+    while (_announces.size() > _max_peers) {
+        remove_oldest();
+        _stats.evicted_peers++;
     }
-    _swarms[swarm]->add(endpoint);
 }
 
 std::vector<tcp::endpoint> Tracker::list_peers(NodeID swarm, unsigned int count)
 {
-    if (_swarms.count(swarm)) {
-        return _swarms[swarm]->list(count);
-    } else {
+    auto it = _swarms.find(swarm);
+    if (it == _swarms.end()) {
         return std::vector<tcp::endpoint>();
     }
+    return it->second.list(count);
+}
+
+void Tracker::expire()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto validity = std::chrono::seconds(ANNOUNCE_VALIDITY_SECONDS);
+
+    while (!_announces.empty() && _announces.front().last_seen + validity < now) {
+        remove_oldest();
+        _stats.expired_peers++;
+    }
+}
+
+void Tracker::remove_oldest()
+{
+    assert(!_announces.empty());
+    const detail::Announce& announce = _announces.front();
+
+    auto it = _swarms.find(announce.swarm);
+    assert(it != _swarms.end());
+
+    it->second.remove(announce.endpoint);
+    if (it->second.empty()) {
+        _swarms.erase(it);
+        _stats.swarms--;
+    }
+
+    _announces.pop_front();
+    _stats.peers--;
 }
 
 
 
-DataStore::DataStore(asio::io_service& ios):
-    _ios(ios)
+/*
+ * Rough per item overhead of the containers holding it.
+ */
+static const size_t STORED_ITEM_OVERHEAD = 128;
+
+DataStore::DataStore(asio::io_service& ios, size_t max_bytes):
+    _ios(ios),
+    _max_bytes(max_bytes)
 {
     /*
      * Every so often, remove expired data items.
@@ -180,25 +263,7 @@ DataStore::DataStore(asio::io_service& ios):
                 break;
             }
 
-            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-
-            auto it = _immutable_data.begin();
-            while (it != _immutable_data.end()) {
-                if (it->second.last_seen + std::chrono::seconds(PUT_VALIDITY_SECONDS) < now) {
-                    it = _immutable_data.erase(it);
-                } else {
-                    ++it;
-                }
-            }
-
-            auto i = _mutable_data.begin();
-            while (i != _mutable_data.end()) {
-                if (i->second.last_seen + std::chrono::seconds(PUT_VALIDITY_SECONDS) < now) {
-                    i = _mutable_data.erase(i);
-                } else {
-                    ++i;
-                }
-            }
+            expire();
         }
     });
 }
@@ -208,6 +273,95 @@ DataStore::~DataStore()
     _terminate_signal();
 }
 
+void DataStore::insert( Items& items
+                      , std::list<NodeID>& order
+                      , NodeID id
+                      , StoredItem item)
+{
+    auto existing = items.find(id);
+    if (existing != items.end()) {
+        erase(items, order, existing);
+    }
+
+    item.last_seen = std::chrono::steady_clock::now();
+    item.size = STORED_ITEM_OVERHEAD
+              + item.encoded_value.size()
+              + item.salt.size();
+    item.order = order.insert(order.end(), id);
+
+    _stats.bytes += item.size;
+    items.emplace(id, std::move(item));
+
+    if (&items == &_immutable_data) {
+        _stats.immutable_items++;
+    } else {
+        _stats.mutable_items++;
+    }
+
+    while (_stats.bytes > _max_bytes && remove_oldest()) {
+        _stats.evicted_items++;
+    }
+}
+
+void DataStore::erase(Items& items, std::list<NodeID>& order, Items::iterator it)
+{
+    _stats.bytes -= it->second.size;
+
+    if (&items == &_immutable_data) {
+        _stats.immutable_items--;
+    } else {
+        _stats.mutable_items--;
+    }
+
+    order.erase(it->second.order);
+    items.erase(it);
+}
+
+void DataStore::expire()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto validity = std::chrono::seconds(PUT_VALIDITY_SECONDS);
+
+    auto expire_ = [&] (Items& items, std::list<NodeID>& order) {
+        while (!order.empty()) {
+            auto it = items.find(order.front());
+            assert(it != items.end());
+            if (now <= it->second.last_seen + validity) break;
+            erase(items, order, it);
+            _stats.expired_items++;
+        }
+    };
+
+    expire_(_immutable_data, _immutable_order);
+    expire_(_mutable_data, _mutable_order);
+}
+
+/*
+ * Remove the least recently put item, be it mutable or immutable.
+ */
+bool DataStore::remove_oldest()
+{
+    auto oldest = [] (Items& items, std::list<NodeID>& order) {
+        return order.empty() ? items.end() : items.find(order.front());
+    };
+
+    auto i = oldest(_immutable_data, _immutable_order);
+    auto m = oldest(_mutable_data, _mutable_order);
+
+    if (i == _immutable_data.end() && m == _mutable_data.end()) {
+        return false;
+    }
+
+    if (m == _mutable_data.end()
+        || (i != _immutable_data.end() && i->second.last_seen <= m->second.last_seen)) {
+        erase(_immutable_data, _immutable_order, i);
+    } else {
+        erase(_mutable_data, _mutable_order, m);
+    }
+
+    return true;
+}
+
 NodeID DataStore::immutable_get_id(BencodedValue value)
 {
     return util::sha1(bencoding_encode(value));
@@ -215,10 +369,11 @@ NodeID DataStore::immutable_get_id(BencodedValue value)
 
 void DataStore::put_immutable(BencodedValue value)
 {
-    _immutable_data[immutable_get_id(value)] = ImmutableStoredItem {
-        value,
-        std::chrono::steady_clock::now()
-    };
+    StoredItem item;
+    item.encoded_value = bencoding_encode(value);
+
+    NodeID id = util::sha1(item.encoded_value);
+    insert(_immutable_data, _immutable_order, id, std::move(item));
 }
 
 boost::optional<BencodedValue> DataStore::get_immutable(NodeID id)
@@ -227,7 +382,7 @@ boost::optional<BencodedValue> DataStore::get_immutable(NodeID id)
     if (it == _immutable_data.end()) {
         return boost::none;
     }
-    return it->second.value;
+    return bencoding_decode(it->second.encoded_value);
 }
 
 NodeID DataStore::mutable_get_id( util::Ed25519PublicKey public_key
@@ -238,10 +393,15 @@ NodeID DataStore::mutable_get_id( util::Ed25519PublicKey public_key
 
 void DataStore::put_mutable(MutableDataItem item)
 {
-    _mutable_data[mutable_get_id(item.public_key, item.salt)] = MutableStoredItem {
-        item,
-        std::chrono::steady_clock::now()
-    };
+    StoredItem stored;
+    stored.encoded_value = bencoding_encode(item.value);
+    stored.public_key = item.public_key;
+    stored.salt = std::move(item.salt);
+    stored.sequence_number = item.sequence_number;
+    stored.signature = item.signature;
+
+    NodeID id = mutable_get_id(stored.public_key, stored.salt);
+    insert(_mutable_data, _mutable_order, id, std::move(stored));
 }
 
 boost::optional<MutableDataItem> DataStore::get_mutable(NodeID id)
@@ -250,7 +410,21 @@ boost::optional<MutableDataItem> DataStore::get_mutable(NodeID id)
     if (it == _mutable_data.end()) {
         return boost::none;
     }
-    return it->second.item;
+
+    const StoredItem& stored = it->second;
+
+    boost::optional<BencodedValue> value = bencoding_decode(stored.encoded_value);
+    if (!value) {
+        return boost::none;
+    }
+
+    return MutableDataItem {
+        stored.public_key,
+        stored.salt,
+        std::move(*value),
+        stored.sequence_number,
+        stored.signature
+    };
 }
 
 } // dht namespace
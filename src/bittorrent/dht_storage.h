@@ -6,6 +6,7 @@
 
 #include <chrono>
 #include <deque>
+#include <list>
 #include <string>
 
 #include "bencoding.h"
@@ -24,58 +25,92 @@ using ip::tcp;
 
 namespace detail {
 
+/*
+ * Write tokens are a keyed hash of the address and target ID the token is
+ * handed out for, keyed with a secret that is replaced every
+ * SECRET_REFRESH_TIME_SECONDS. The first byte of a token tells which secret
+ * it was made with, so verifying it takes a single hash.
+ */
 class DhtWriteTokenStorage {
     public:
     const int TOKEN_VALIDITY_SECONDS = 60 * 15;
     const int SECRET_REFRESH_TIME_SECONDS = 60 * 5;
 
     public:
-    DhtWriteTokenStorage();
     std::string generate_token(asio::ip::address address, NodeID id);
     bool verify_token(asio::ip::address address, NodeID id, const std::string& token);
 
     private:
-    void expire();
-
-    private:
-    std::string _salt;
     struct Secret {
-        std::string secret;
+        std::array<uint8_t, 20> key;
+        uint8_t generation;
         std::chrono::steady_clock::time_point expires;
     };
+
+    void expire();
+    static std::array<uint8_t, 20> token_hash( const Secret&
+                                             , const asio::ip::address&
+                                             , const NodeID&);
+
+    private:
     std::deque<Secret> _secrets;
+    uint8_t _next_generation = 0;
     std::chrono::steady_clock::time_point _last_generated;
 };
 
-class Swarm {
-    public:
-    /*
-     * This number based on vague hints. I could not find any proper
-     * specification on recommended validity times, and this could be
-     * completely wrong.
-     */
-    const int ANNOUNCE_VALIDITY_SECONDS = 3600 * 2;
+/*
+ * A peer announced to a swarm, as stored in the Tracker's list of announces
+ * ordered by time.
+ */
+struct Announce {
+    NodeID swarm;
+    tcp::endpoint endpoint;
+    std::chrono::steady_clock::time_point last_seen;
+};
 
+using AnnounceList = std::list<Announce>;
+
+class Swarm {
     public:
-    void add(tcp::endpoint endpoint);
+    boost::optional<AnnounceList::iterator> find(const tcp::endpoint& endpoint) const;
+    void add(AnnounceList::iterator announce);
+    void remove(const tcp::endpoint& endpoint);
     std::vector<tcp::endpoint> list(unsigned int count);
-    void expire();
     bool empty() const { return _peers.empty(); }
 
     private:
-    struct Peer {
-        tcp::endpoint endpoint;
-        std::chrono::steady_clock::time_point last_seen;
-    };
-    std::vector<Peer> _peers;
+    std::vector<AnnounceList::iterator> _peers;
     std::map<tcp::endpoint, size_t> _peer_indices;
 };
 
 } // namespace detail
 
+/*
+ * Both the Tracker and the DataStore are bounded, as anybody can make a DHT
+ * node store things. When full, the entries least recently announced or put
+ * are dropped first. Entries are also kept ordered by time so that expiring
+ * them needs no full scan.
+ */
 class Tracker {
     public:
-    Tracker(asio::io_service& ios);
+    /*
+     * This number based on vague hints. I could not find any proper
+     * specification on recommended validity times, and this could be
+     * completely wrong.
+     */
+    const int ANNOUNCE_VALIDITY_SECONDS = 3600 * 2;
+
+    static const size_t DEFAULT_MAX_PEERS = 100000;
+
+    struct Stats {
+        size_t swarms = 0;
+        size_t peers = 0;
+        size_t expired_peers = 0;
+        size_t evicted_peers = 0;
+    };
+
+    public:
+    Tracker(asio::io_service& ios, size_t max_peers = DEFAULT_MAX_PEERS);
     ~Tracker();
 
     std::string generate_token(asio::ip::address address, NodeID id)
@@ -91,10 +126,20 @@ class Tracker {
     void add_peer(NodeID swarm, tcp::endpoint endpoint);
     std::vector<tcp::endpoint> list_peers(NodeID swarm, unsigned int count);
 
+    const Stats& stats() const { return _stats; }
+
+    private:
+    void expire();
+    void remove_oldest();
+
     private:
     asio::io_service& _ios;
+    size_t _max_peers;
     detail::DhtWriteTokenStorage _token_storage;
-    std::map<NodeID, std::unique_ptr<detail::Swarm>> _swarms;
+    std::map<NodeID, detail::Swarm> _swarms;
+    // Least recently announced first.
+    detail::AnnounceList _announces;
+    Stats _stats;
     Signal<void()> _terminate_signal;
 };
 
@@ -106,8 +151,19 @@ class DataStore {
      */
     const int PUT_VALIDITY_SECONDS = 3600 * 2;
 
+    static const size_t DEFAULT_MAX_BYTES = 16 * 1024 * 1024;
+
+    struct Stats {
+        size_t immutable_items = 0;
+        size_t mutable_items = 0;
+        // Approximate memory used by the stored items.
+        size_t bytes = 0;
+        size_t expired_items = 0;
+        size_t evicted_items = 0;
+    };
+
     public:
-    DataStore(asio::io_service& ios);
+    DataStore(asio::io_service& ios, size_t max_bytes = DEFAULT_MAX_BYTES);
     ~DataStore();
 
     std::string generate_token(asio::ip::address address, NodeID id)
@@ -128,20 +184,44 @@ class DataStore {
     void put_mutable(MutableDataItem item);
     boost::optional<MutableDataItem> get_mutable(NodeID id);
 
+    const Stats& stats() const { return _stats; }
+
     private:
-    struct ImmutableStoredItem {
-        BencodedValue value;
-        std::chrono::steady_clock::time_point last_seen;
-    };
-    struct MutableStoredItem {
-        MutableDataItem item;
+    /*
+     * Values are kept bencoded, which takes much less memory than a
+     * BencodedValue tree.
+     */
+    struct StoredItem {
+        std::string encoded_value;
+
+        // Only used by mutable items.
+        util::Ed25519PublicKey public_key;
+        std::string salt;
+        int64_t sequence_number;
+        std::array<uint8_t, 64> signature;
+
         std::chrono::steady_clock::time_point last_seen;
+        std::list<NodeID>::iterator order;
+        size_t size;
     };
 
+    using Items = std::map<NodeID, StoredItem>;
+
+    void insert(Items&, std::list<NodeID>&, NodeID, StoredItem);
+    void erase(Items&, std::list<NodeID>&, Items::iterator);
+    void expire();
+    bool remove_oldest();
+
+    private:
     asio::io_service& _ios;
+    size_t _max_bytes;
     detail::DhtWriteTokenStorage _token_storage;
-    std::map<NodeID, ImmutableStoredItem> _immutable_data;
-    std::map<NodeID, MutableStoredItem> _mutable_data;
+    Items _immutable_data;
+    Items _mutable_data;
+    // Least recently put first.
+    std::list<NodeID> _immutable_order;
+    std::list<NodeID> _mutable_order;
+    Stats _stats;
     Signal<void()> _terminate_signal;
 };
 
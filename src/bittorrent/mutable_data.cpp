@@ -1,7 +1,9 @@
 #include "mutable_data.h"
 
 #include "../util/bytes.h"
+#include "../util/condition_variable.h"
 #include "../util/crypto.h"
+#include "../util/lru_cache.h"
 
 namespace ouinet {
 namespace bittorrent {
@@ -12,6 +14,8 @@ static std::string mutable_data_signature_buffer(
     int64_t sequence_number
 ) {
     std::string encoded_data = bencoding_encode(data);
+    std::string salt_size = std::to_string(salt.size());
+    std::string sequence = std::to_string(sequence_number);
 
     /*
      * Low-level buffer computation is mandated by
@@ -22,24 +26,71 @@ static std::string mutable_data_signature_buffer(
      * implemented using the BencodedMap logic.
      */
     std::string signature_buffer;
+    signature_buffer.reserve( 6 + salt_size.size() + 1 + salt.size()
+                            + 6 + sequence.size() + 4 + encoded_data.size());
+
     if (!salt.empty()) {
         signature_buffer += "4:salt";
-        signature_buffer += std::to_string(salt.size());
+        signature_buffer += salt_size;
         signature_buffer += ":";
-        signature_buffer += salt.to_string();
+        signature_buffer.append(salt.data(), salt.size());
     }
     signature_buffer += "3:seqi";
-    signature_buffer += std::to_string(sequence_number);
+    signature_buffer += sequence;
     signature_buffer += "e1:v";
     signature_buffer += encoded_data;
     return signature_buffer;
 }
 
+/*
+ * Items whose signature is known to be good, indexed by the hash of the
+ * public key, the signature and the signed buffer (which covers the salt,
+ * the sequence number and the value). Only successful verifications are
+ * stored, so a forged item can never hit the cache.
+ *
+ * There is one cache per thread. `MutableDataVerifier` workers only check
+ * signatures, the cache is always used from the thread asking for them.
+ */
+class VerifiedSignatureCache {
+    public:
+    static const size_t CACHE_SIZE = 4096;
+
+    static std::string key( const MutableDataItem& item
+                          , const std::string& signature_buffer)
+    {
+        auto digest = util::sha1( item.public_key.serialize()
+                                , item.signature
+                                , signature_buffer);
+        return std::string(digest.begin(), digest.end());
+    }
+
+    bool contains(const std::string& key)
+    {
+        return _cache.get(key) != nullptr;
+    }
+
+    void insert(const std::string& key)
+    {
+        _cache.put(key, true);
+    }
+
+    static VerifiedSignatureCache& instance()
+    {
+        static thread_local VerifiedSignatureCache cache;
+        return cache;
+    }
+
+    private:
+    VerifiedSignatureCache() : _cache(CACHE_SIZE) {}
+
+    util::LruCache<std::string, bool> _cache;
+};
+
 MutableDataItem MutableDataItem::sign(
     BencodedValue value,
     int64_t sequence_number,
     boost::string_view salt,
-    util::Ed25519PrivateKey private_key
+    const util::Ed25519PrivateKey& private_key
 ) {
     MutableDataItem output{
         private_key.public_key(),
@@ -57,14 +108,94 @@ MutableDataItem MutableDataItem::sign(
 
 bool MutableDataItem::verify() const
 {
-    return public_key.verify(
-        mutable_data_signature_buffer(
-            value,
-            salt,
-            sequence_number
-        ),
-        signature
+    auto& cache = VerifiedSignatureCache::instance();
+
+    std::string signature_buffer
+        = mutable_data_signature_buffer(value, salt, sequence_number);
+    std::string key = VerifiedSignatureCache::key(*this, signature_buffer);
+
+    if (cache.contains(key)) return true;
+
+    if (!public_key.verify(signature_buffer, signature)) return false;
+
+    cache.insert(key);
+    return true;
+}
+
+MutableDataVerifier::MutableDataVerifier( asio::io_service& ios
+                                        , size_t thread_count)
+    : _ios(ios)
+{
+    if (thread_count == 0) return;
+
+    _work = std::make_unique<asio::io_service::work>(_workers_ios);
+
+    for (size_t i = 0; i < thread_count; i++) {
+        _threads.emplace_back([this] { _workers_ios.run(); });
+    }
+}
+
+MutableDataVerifier::~MutableDataVerifier()
+{
+    /*
+     * Workers are not stopped but left to run out of jobs, so that every
+     * pending `verify` gets its result posted back and its coroutine resumed.
+     */
+    _work = nullptr;
+
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+bool MutableDataVerifier::verify( const MutableDataItem& item
+                                , asio::yield_context yield)
+{
+    if (!is_threaded()) return item.verify();
+
+    std::string signature_buffer = mutable_data_signature_buffer(
+        item.value,
+        item.salt,
+        item.sequence_number
     );
+    std::string key = VerifiedSignatureCache::key(item, signature_buffer);
+
+    if (VerifiedSignatureCache::instance().contains(key)) return true;
+
+    /*
+     * The job state is shared with the worker, and neither side refers to
+     * this verifier once the job is posted: it may be destroyed while the
+     * caller waits.
+     */
+    struct Job {
+        bool valid = false;
+        ConditionVariable done;
+        Job(asio::io_service& ios) : done(ios) {}
+    };
+
+    auto job = std::make_shared<Job>(_ios);
+
+    _workers_ios.post([ job
+                      , &ios = _ios
+                      , public_key = item.public_key
+                      , signature = item.signature
+                      , signature_buffer = std::move(signature_buffer)
+                      ] {
+        bool valid = public_key.verify(signature_buffer, signature);
+
+        ios.post([job, valid] {
+            job->valid = valid;
+            job->done.notify();
+        });
+    });
+
+    sys::error_code ec;
+    job->done.wait(yield[ec]);
+
+    if (ec || !job->valid) return false;
+
+    VerifiedSignatureCache::instance().insert(key);
+    return true;
 }
 
 } // bittorrent namespace
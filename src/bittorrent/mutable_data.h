@@ -1,8 +1,14 @@
 #pragma once
 
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+
 #include <chrono>
 #include <deque>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "bencoding.h"
 #include "node_id.h"
@@ -24,11 +30,44 @@ struct MutableDataItem {
         BencodedValue value,
         int64_t sequence_number,
         boost::string_view salt,
-        util::Ed25519PrivateKey private_key
+        const util::Ed25519PrivateKey& private_key
     );
 
+    /*
+     * Successful verifications are remembered for a while, so verifying an
+     * identical item again (e.g. when many nodes return the same value) is
+     * cheap.
+     */
     bool verify() const;
 };
 
+/*
+ * Verifies the signature of mutable data items on a pool of worker threads,
+ * so that a flood of items to check does not block the io_service thread.
+ *
+ * With no worker threads, verification happens in the calling thread.
+ * Destroying the verifier waits for the jobs already handed to the workers,
+ * and callers still get their results (possibly after the verifier is gone).
+ */
+class MutableDataVerifier {
+    public:
+    MutableDataVerifier(asio::io_service& ios, size_t thread_count = 0);
+
+    MutableDataVerifier(const MutableDataVerifier&) = delete;
+    MutableDataVerifier& operator=(const MutableDataVerifier&) = delete;
+
+    ~MutableDataVerifier();
+
+    bool is_threaded() const { return !_threads.empty(); }
+
+    bool verify(const MutableDataItem&, asio::yield_context);
+
+    private:
+    asio::io_service& _ios;
+    asio::io_service _workers_ios;
+    std::unique_ptr<asio::io_service::work> _work;
+    std::vector<std::thread> _threads;
+};
+
 } // bittorrent namespace
 } // ouinet namespace
@@ -1,6 +1,8 @@
-#include <boost/crc.hpp>
 #include "node_id.h"
 
+#include <climits>
+
+using namespace ouinet;
 using namespace ouinet::bittorrent;
 
 static bool get_rbit(const NodeID::Buffer& buffer, size_t n) {
@@ -78,22 +80,49 @@ NodeID NodeID::generate(asio::ip::address address)
     return generate(address, boost::none);
 }
 
-NodeID NodeID::generate( asio::ip::address address
-                       , boost::optional<uint8_t> test_rnd)
+/*
+ * CRC32C (Castagnoli), as used by BEP42. Where available the SSE4.2 crc32
+ * instruction is used, otherwise a table computed once at start up.
+ */
+static uint32_t crc32c(const uint8_t* data, size_t size)
 {
-    /*
-     * Choose DHT ID based on ip address.
-     * See: BEP 42
-     */
+    uint32_t crc = 0xffffffff;
 
-    NodeID node_id;
+#ifdef __SSE4_2__
+    for (size_t i = 0; i < size; i++) {
+        crc = __builtin_ia32_crc32qi(crc, data[i]);
+    }
+#else
+    struct Table {
+        uint32_t entries[256];
+
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+                }
+                entries[i] = c;
+            }
+        }
+    };
 
-    using CRC32C = boost::crc_optimal<32, 0x1edc6f41, 0xffffffff, 0xffffffff, true, true>;
+    static const Table table;
 
-    uint32_t checksum;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+#endif
 
-    node_id.buffer[19] = (test_rnd ? *test_rnd : std::rand()) & 0xff;
+    return ~crc;
+}
 
+/*
+ * The checksum whose first 21 bits must start the ID of a node on $address
+ * which has $r as the last byte of its ID.
+ */
+static uint32_t bep42_checksum(const asio::ip::address& address, uint8_t r)
+{
     if (address.is_v4()) {
         auto ip_bytes = address.to_v4().to_bytes();
 
@@ -101,11 +130,9 @@ NodeID NodeID::generate( asio::ip::address address
             ip_bytes[i] &= (0xff >> (6 - i * 2));
         }
 
-        ip_bytes[0] |= ((node_id.buffer[19] & 7) << 5);
+        ip_bytes[0] |= ((r & 7) << 5);
 
-        CRC32C crc;
-        crc.process_bytes(ip_bytes.data(), 4);
-        checksum = crc.checksum();
+        return crc32c(ip_bytes.data(), 4);
     } else {
         auto ip_bytes = address.to_v6().to_bytes();
 
@@ -113,12 +140,44 @@ NodeID NodeID::generate( asio::ip::address address
             ip_bytes[i] &= (0xff >> (7 - i));
         }
 
-        ip_bytes[0] |= ((node_id.buffer[19] & 7) << 5);
+        ip_bytes[0] |= ((r & 7) << 5);
 
-        CRC32C crc;
-        crc.process_bytes(ip_bytes.data(), 8);
-        checksum = crc.checksum();
+        return crc32c(ip_bytes.data(), 8);
     }
+}
+
+static bool is_bep42_exempt(const asio::ip::address& address)
+{
+    if (address.is_v4()) {
+        auto ip = address.to_v4().to_ulong();
+
+        return (ip & 0xff000000) == 0x0a000000  // 10.0.0.0/8
+            || (ip & 0xfff00000) == 0xac100000  // 172.16.0.0/12
+            || (ip & 0xffff0000) == 0xc0a80000  // 192.168.0.0/16
+            || (ip & 0xffff0000) == 0xa9fe0000  // 169.254.0.0/16
+            || (ip & 0xff000000) == 0x7f000000; // 127.0.0.0/8
+    } else {
+        auto ip = address.to_v6();
+
+        return ip.is_loopback()
+            || ip.is_link_local()
+            || (ip.to_bytes()[0] & 0xfe) == 0xfc; // fc00::/7
+    }
+}
+
+NodeID NodeID::generate( asio::ip::address address
+                       , boost::optional<uint8_t> test_rnd)
+{
+    /*
+     * Choose DHT ID based on ip address.
+     * See: BEP 42
+     */
+
+    NodeID node_id;
+
+    node_id.buffer[19] = (test_rnd ? *test_rnd : std::rand()) & 0xff;
+
+    uint32_t checksum = bep42_checksum(address, node_id.buffer[19]);
 
     node_id.buffer[0] = (checksum >> 24) & 0xff;
     node_id.buffer[1] = (checksum >> 16) & 0xff;
@@ -130,19 +189,14 @@ NodeID NodeID::generate( asio::ip::address address
     return node_id;
 }
 
-bool NodeID::closer_to(const NodeID& left, const NodeID& right) const
+bool NodeID::is_bep42_compliant(const asio::ip::address& address) const
 {
-    for (size_t i = 0; i < sizeof(buffer); i++) {
-        uint8_t l = left .buffer[i] ^ buffer[i];
-        uint8_t r = right.buffer[i] ^ buffer[i];
-        if (l < r) {
-            return true;
-        }
-        if (r < l) {
-            return false;
-        }
-    }
-    return false;
+    if (is_bep42_exempt(address)) return true;
+
+    uint32_t checksum = bep42_checksum(address, buffer[19]);
+
+    // The first 21 bits of both.
+    return node_id_detail::load_be32(buffer.data()) >> 11 == checksum >> 11;
 }
 
 std::ostream& ouinet::bittorrent::operator<<(std::ostream& os, const NodeID& id)
@@ -4,11 +4,34 @@
 #include <boost/optional.hpp>
 #include <string>
 #include <array>
+#include <cstring>
+#include <functional>
+#include <tuple>
 #include "../namespaces.h"
 #include "../util/bytes.h"
 
 namespace ouinet { namespace bittorrent {
 
+namespace node_id_detail {
+    inline uint64_t load_be64(const uint8_t* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        return v;
+    }
+
+    inline uint32_t load_be32(const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap32(v);
+#endif
+        return v;
+    }
+} // node_id_detail namespace
+
 struct NodeID {
     static constexpr size_t size     = 20;
     static constexpr size_t bit_size = size * 8;
@@ -42,9 +65,16 @@ struct NodeID {
     static NodeID from_bytestring(const std::string& bytestring) { return NodeID{ util::bytes::to_array<uint8_t, size>(bytestring) }; }
     static NodeID zero();
 
+    // Number of leading bits this and `other` have in common.
+    size_t common_prefix_length(const NodeID& other) const;
+
     // http://bittorrent.org/beps/bep_0042.html
     static NodeID generate(asio::ip::address address);
 
+    // Whether this ID is one a node on `address` may use according to
+    // BEP42. Local network addresses, which BEP42 exempts, accept any ID.
+    bool is_bep42_compliant(const asio::ip::address& address) const;
+
     bool operator==(const NodeID& other) const { return buffer == other.buffer; }
     bool operator<(const NodeID& other) const { return buffer < other.buffer; }
 
@@ -52,6 +82,22 @@ struct NodeID {
     // metrics.
     bool closer_to(const NodeID& left, const NodeID& right) const;
 
+    // The XOR distance between two IDs, as a value that compares like the
+    // (big endian) number it stands for. Cheaper to compare than IDs when
+    // sorting many of them by distance to the same target.
+    struct Distance {
+        uint64_t high;
+        uint64_t middle;
+        uint32_t low;
+
+        bool operator<(const Distance& other) const {
+            return std::tie(high, middle, low)
+                 < std::tie(other.high, other.middle, other.low);
+        }
+    };
+
+    Distance distance(const NodeID& other) const;
+
     private:
     static NodeID generate( asio::ip::address address
                           , boost::optional<uint8_t> test_rnd);
@@ -59,4 +105,69 @@ struct NodeID {
 
 std::ostream& operator<<(std::ostream&, const NodeID&);
 
+inline
+NodeID::Distance NodeID::distance(const NodeID& other) const
+{
+    using namespace node_id_detail;
+
+    const uint8_t* a = buffer.data();
+    const uint8_t* b = other.buffer.data();
+
+    return Distance{ load_be64(a)      ^ load_be64(b)
+                   , load_be64(a + 8)  ^ load_be64(b + 8)
+                   , load_be32(a + 16) ^ load_be32(b + 16) };
+}
+
+inline
+size_t NodeID::common_prefix_length(const NodeID& other) const
+{
+    Distance d = distance(other);
+
+    if (d.high)   return __builtin_clzll(d.high);
+    if (d.middle) return 64 + __builtin_clzll(d.middle);
+    if (d.low)    return 128 + __builtin_clz(d.low);
+
+    return bit_size;
+}
+
+/*
+ * Compares the XOR distances a word at a time, most significant first; in
+ * the common case the first word is enough.
+ */
+inline
+bool NodeID::closer_to(const NodeID& left, const NodeID& right) const
+{
+    using namespace node_id_detail;
+
+    const uint8_t* t = buffer.data();
+    const uint8_t* l = left.buffer.data();
+    const uint8_t* r = right.buffer.data();
+
+    uint64_t t64 = load_be64(t);
+    uint64_t l64 = load_be64(l) ^ t64;
+    uint64_t r64 = load_be64(r) ^ t64;
+    if (l64 != r64) return l64 < r64;
+
+    t64 = load_be64(t + 8);
+    l64 = load_be64(l + 8) ^ t64;
+    r64 = load_be64(r + 8) ^ t64;
+    if (l64 != r64) return l64 < r64;
+
+    uint32_t t32 = load_be32(t + 16);
+    return (load_be32(l + 16) ^ t32) < (load_be32(r + 16) ^ t32);
+}
+
 }} // namespaces
+
+namespace std {
+    /*
+     * IDs are (pseudo-)random, so any of their words makes a good hash.
+     */
+    template<> struct hash<ouinet::bittorrent::NodeID> {
+        size_t operator()(const ouinet::bittorrent::NodeID& id) const {
+            size_t ret;
+            memcpy(&ret, id.buffer.data(), sizeof(ret));
+            return ret;
+        }
+    };
+} // std namespace
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+
+namespace ouinet { namespace bittorrent {
+
+/*
+ * Token bucket rate limiting, one bucket per source address.
+ *
+ * Each address may spend up to $burst tokens at once, and gets $rate tokens
+ * back per second. Buckets that are full again carry no information and are
+ * forgotten when there are too many of them.
+ */
+class RateLimiter {
+    using Clock = std::chrono::steady_clock;
+    using Address = boost::asio::ip::address;
+
+    struct Bucket {
+        double tokens;
+        Clock::time_point updated;
+        std::list<Address>::iterator order;
+    };
+
+    public:
+    RateLimiter(double rate, double burst, size_t max_addresses)
+        : _rate(rate)
+        , _burst(burst)
+        , _max_addresses(max_addresses)
+    {}
+
+    /*
+     * Take $cost tokens from the bucket of $address. Returns false (and
+     * takes nothing) if there are not enough of them.
+     */
+    bool consume(const Address& address, double cost)
+    {
+        auto now = Clock::now();
+
+        auto it = _buckets.find(address);
+
+        if (it == _buckets.end()) {
+            if (_buckets.size() >= _max_addresses) {
+                forget_idle(now);
+            }
+            if (_buckets.size() >= _max_addresses) {
+                // Under a flood from many addresses, treat the newcomers as
+                // if they had an empty bucket.
+                return false;
+            }
+            it = _buckets.emplace(address, Bucket{ _burst, now, {} }).first;
+            it->second.order = _order.insert(_order.end(), address);
+        } else {
+            _order.splice(_order.end(), _order, it->second.order);
+        }
+
+        Bucket& bucket = it->second;
+        refill(bucket, now);
+
+        if (bucket.tokens < cost) return false;
+
+        bucket.tokens -= cost;
+        return true;
+    }
+
+    private:
+    void refill(Bucket& bucket, Clock::time_point now) const
+    {
+        std::chrono::duration<double> elapsed = now - bucket.updated;
+        bucket.tokens = std::min(_burst, bucket.tokens + elapsed.count() * _rate);
+        bucket.updated = now;
+    }
+
+    /*
+     * Forget the least recently used buckets for as long as they are full.
+     * These are the ones which had the most time to refill, so this only
+     * looks at a few buckets rather than at all of them.
+     */
+    void forget_idle(Clock::time_point now)
+    {
+        while (!_order.empty()) {
+            auto it = _buckets.find(_order.front());
+            refill(it->second, now);
+            if (it->second.tokens < _burst) break;
+            _order.pop_front();
+            _buckets.erase(it);
+        }
+    }
+
+    private:
+    double _rate;
+    double _burst;
+    size_t _max_addresses;
+    std::map<Address, Bucket> _buckets;
+    // Least recently used first.
+    std::list<Address> _order;
+};
+
+}} // namespaces
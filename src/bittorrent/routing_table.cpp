@@ -1,56 +1,173 @@
 #include "routing_table.h"
 
-#include <set>
+#include <algorithm>
+#include <cassert>
+#include <iterator>
 
+using namespace ouinet::bittorrent;
 using namespace ouinet::bittorrent::dht;
 
+/*
+ * Buckets not containing _node_id stop being split at depths which are a
+ * multiple of TREE_BASE. This turns the routing table into a 2^TREE_BASE-ary
+ * tree rather than a binary one, and saves in round trips.
+ */
+static const size_t TREE_BASE = 5;
+
+/*
+ * Distance from $target to the closest ID in $range. Buckets of the same
+ * level cover disjoint ranges, so this orders them by distance to $target.
+ */
+static NodeID::Distance range_distance(const NodeID& target, const NodeID::Range& range)
+{
+    NodeID closest = target;
+
+    size_t bytes = range.mask / 8;
+    size_t bits  = range.mask % 8;
+
+    std::copy(range.stencil.begin(), range.stencil.begin() + bytes, closest.buffer.begin());
+
+    if (bits) {
+        uint8_t m = 0xff << (8 - bits);
+        closest.buffer[bytes] = (range.stencil[bytes] & m) | (target.buffer[bytes] & ~m);
+    }
+
+    return target.distance(closest);
+}
+
+/*
+ * Move the nodes and candidates of $from for which $moves is true to $to,
+ * keeping their order.
+ */
+template<class Pred>
+static void move_nodes(RoutingBucket& from, RoutingBucket& to, Pred moves)
+{
+    auto move_matching = [&] (auto& f, auto& t) {
+        auto keep = std::stable_partition(f.begin(), f.end(),
+            [&] (const RoutingNode& n) { return !moves(n.contact.id); });
+        std::move(keep, f.end(), std::back_inserter(t));
+        f.erase(keep, f.end());
+    };
+
+    move_matching(from.nodes, to.nodes);
+    move_matching(from.verified_candidates, to.verified_candidates);
+    move_matching(from.unverified_candidates, to.unverified_candidates);
+}
+
 RoutingTable::RoutingTable(NodeID node_id) :
     _node_id(node_id)
 {
-    _root_node = std::make_unique<TreeNode>(NodeID::Range::max());
-    _root_node->bucket = std::make_unique<RoutingBucket>();
+    _buckets.emplace_back();
+    _ranges.push_back(NodeID::Range::max());
+    _level_begin.push_back(0);
 }
 
-void RoutingTable::TreeNode::split() {
-    assert(bucket);
-    assert(!left_child);
-    assert(!right_child);
+size_t RoutingTable::level(const NodeID& id) const
+{
+    return std::min(id.common_prefix_length(_node_id), last_level());
+}
 
-    /*
-     * Buckets that may be split are never supposed to have candidates
-     * in them.
-     */
-    assert(bucket->verified_candidates.empty());
-    assert(bucket->unverified_candidates.empty());
+size_t RoutingTable::level_end(size_t level) const
+{
+    if (level == last_level()) return _buckets.size();
+    return _level_begin[level + 1];
+}
 
-    /*
-     * Split the bucket.
-     */
-    left_child = std::make_unique<TreeNode>(range.reduce(0));
-    left_child->bucket = std::make_unique<RoutingBucket>();
+/*
+ * Index of the bucket of $level that $id falls in, were it to belong to
+ * that level.
+ */
+size_t RoutingTable::bucket_index(size_t level, const NodeID& id) const
+{
+    size_t begin = _level_begin[level];
+    size_t end = level_end(level);
 
-    right_child = std::make_unique<TreeNode>(range.reduce(1));
-    right_child->bucket = std::make_unique<RoutingBucket>();
+    if (end - begin == 1) return begin;
 
-    for (const auto& node : bucket->nodes) {
-        if (node.contact.id.bit(depth())) {
-            right_child->bucket->nodes.push_back(node);
-        } else {
-            left_child->bucket->nodes.push_back(node);
-        }
+    auto i = std::upper_bound(_ranges.begin() + begin, _ranges.begin() + end, id,
+        [] (const NodeID& id, const NodeID::Range& r) { return id.buffer < r.stencil; });
+
+    return i - _ranges.begin() - 1;
+}
+
+/*
+ * The routing table contains every known good node in the smallest subtree
+ * that contains _node_id and has at least BUCKET_SIZE contacts in it.
+ * Buckets in that subtree may always be split when full.
+ *
+ * The buckets of $level are in that subtree when the levels after it hold
+ * fewer than BUCKET_SIZE nodes.
+ */
+bool RoutingTable::in_exhaustive_subtree(size_t level) const
+{
+    size_t size = 0;
+
+    for (size_t i = _buckets.size(); i > _level_begin[level + 1]; i--) {
+        size += _buckets[i - 1].nodes.size();
+        if (size >= RoutingBucket::BUCKET_SIZE) return false;
     }
 
-    bucket = nullptr;
+    return true;
 }
 
-size_t RoutingTable::TreeNode::count_routing_nodes() const
+/*
+ * Split a bucket of a level other than the last one in two, on the bit
+ * following its range.
+ */
+void RoutingTable::split_bucket(size_t level, size_t index)
 {
-    if (bucket) {
-        return bucket->nodes.size();
-    } else {
-        return left_child ->count_routing_nodes()
-             + right_child->count_routing_nodes();
+    assert(level < last_level());
+
+    NodeID::Range left = _ranges[index];
+    size_t bit = left.mask++;
+
+    NodeID::Range right = left;
+    NodeID stencil{ right.stencil };
+    stencil.set_bit(bit, true);
+    right.stencil = stencil.buffer;
+
+    _ranges[index] = left;
+    _ranges.insert(_ranges.begin() + index + 1, right);
+    _buckets.insert(_buckets.begin() + index + 1, RoutingBucket());
+
+    for (size_t l = level + 1; l < _level_begin.size(); l++) {
+        _level_begin[l]++;
     }
+
+    move_nodes(_buckets[index], _buckets[index + 1],
+        [bit] (const NodeID& id) { return id.bit(bit); });
+}
+
+/*
+ * Split the last level in two: the nodes that have exactly as many leading
+ * bits in common with _node_id as the level number stay (in a new bucket of
+ * that level), the rest go to a new last level.
+ */
+void RoutingTable::split_last_level()
+{
+    assert(last_level() + 1 < NodeID::bit_size);
+
+    size_t l = last_level();
+
+    NodeID::Range self = _ranges.back();
+    self.mask++;
+    NodeID stencil{ self.stencil };
+    stencil.set_bit(l, _node_id.bit(l));
+    self.stencil = stencil.buffer;
+
+    NodeID::Range other = self;
+    stencil.set_bit(l, !_node_id.bit(l));
+    other.stencil = stencil.buffer;
+
+    _ranges.back() = other;
+    _ranges.push_back(self);
+    _buckets.emplace_back();
+    _level_begin.push_back(_buckets.size() - 1);
+
+    size_t last = _buckets.size() - 1;
+
+    move_nodes(_buckets[last - 1], _buckets[last],
+        [&] (const NodeID& id) { return id.bit(l) == _node_id.bit(l); });
 }
 
 /*
@@ -66,169 +183,137 @@ size_t RoutingTable::TreeNode::count_routing_nodes() const
  */
 RoutingBucket* RoutingTable::find_bucket(NodeID id, bool split_buckets)
 {
-    TreeNode* tree_node = _root_node.get();
-    std::set<TreeNode*> ancestors;
-    ancestors.insert(tree_node);
-    bool node_contains_self = true;
-    while (!tree_node->bucket) {
-        if (id.bit(tree_node->depth())) {
-            tree_node = tree_node->right_child.get();
-        } else {
-            tree_node = tree_node->left_child.get();
-        }
-        if (id.bit(tree_node->depth()) != _node_id.bit(tree_node->depth())) {
-            node_contains_self = false;
-        }
-        ancestors.insert(tree_node);
-    }
+    size_t l = level(id);
+    size_t index = bucket_index(l, id);
 
-    if (split_buckets) {
-        /*
-         * If the contact is already in this bucket, return it.
-         */
-        for (size_t i = 0; i < tree_node->bucket->nodes.size(); i++) {
-            if (tree_node->bucket->nodes[i].contact.id == id) {
-                return tree_node->bucket.get();
-            }
-        }
+    if (!split_buckets) return &_buckets[index];
 
-        /*
-         * If the bucket is full and allowed to be split, split it.
-         *
-         * A full bucket may be split in three conditions:
-         * - if the bucket ID space contains _node_id;
-         * - if the bucket depth is not a multiple of TREE_BASE (this turns the
-         *   routing table into a 2^TREE_BASE-ary tree rather than a binary
-         *   one, and saves in round trips);
-         * - if the bucket is a descendent of the deepest ancestor of _node_id
-         *   that contains at least BUCKET_SIZE nodes.
-         */
-        const int TREE_BASE = 5;
-        TreeNode* exhaustive_root = exhaustive_routing_subtable_fragment_root();
-
-        while (tree_node->bucket->nodes.size() == RoutingBucket::BUCKET_SIZE
-                && tree_node->depth() < NodeID::bit_size) {
-            if (
-                !node_contains_self
-                && (tree_node->depth() % TREE_BASE) == 0
-                && !ancestors.count(exhaustive_root)
-            ) {
-                break;
-            }
-
-            tree_node->split();
-
-            if (id.bit(tree_node->depth())) {
-                tree_node = tree_node->right_child.get();
-            } else {
-                tree_node = tree_node->left_child.get();
-            }
-
-            if (_node_id.bit(tree_node->depth()) != id.bit(tree_node->depth())) {
-                node_contains_self = false;
-            }
-
-            ancestors.insert(tree_node);
-
-            // TODO: each bucket needs a refresh background coroutine.
+    {
+        const auto& nodes = _buckets[index].nodes;
+
+        if (nodes.size() < RoutingBucket::BUCKET_SIZE) {
+            return &_buckets[index];
         }
-    }
 
-    return tree_node->bucket.get();
-}
+        bool contains_id = std::any_of(nodes.begin(), nodes.end(),
+            [&] (const RoutingNode& node) { return node.contact.id == id; });
 
-/*
- * The routing table contains every known good node in the smallest subtree
- * that contains _node_id and has at least BUCKET_SIZE contacts in it.
- * This function computes the root of that subtree. Routing tree nodes
- * below this node may always be split when full.
- */
-RoutingTable::TreeNode* RoutingTable::exhaustive_routing_subtable_fragment_root() const
-{
-    std::vector<TreeNode*> path;
-    TreeNode* tree_node = _root_node.get();
+        if (contains_id) return &_buckets[index];
+    }
 
-    while (!tree_node->bucket) {
-        path.push_back(tree_node);
-        if (_node_id.bit(path.size())) {
-            tree_node = tree_node->right_child.get();
+    /*
+     * A full bucket may be split in three conditions:
+     * - if the bucket ID space contains _node_id;
+     * - if the bucket depth is not a multiple of TREE_BASE;
+     * - if the bucket is in the exhaustive subtree (see in_exhaustive_subtree).
+     */
+    while (_buckets[index].nodes.size() >= RoutingBucket::BUCKET_SIZE) {
+        if (l == last_level()) {
+            if (last_level() + 1 >= NodeID::bit_size) break;
+            split_last_level();
         } else {
-            tree_node = tree_node->left_child.get();
-        }
-    }
+            size_t depth = _ranges[index].mask;
 
-    size_t size = tree_node->bucket->nodes.size();
+            if (depth >= NodeID::bit_size) break;
 
-    while (size < RoutingBucket::BUCKET_SIZE && !path.empty()) {
-        tree_node = path.back();
-        path.pop_back();
-        if (_node_id.bit(path.size())) {
-            size += tree_node->left_child->count_routing_nodes();
-        } else {
-            size += tree_node->right_child->count_routing_nodes();
+            if (depth % TREE_BASE == 0 && !in_exhaustive_subtree(l)) break;
+
+            split_bucket(l, index);
         }
-    }
 
-    return tree_node;
-}
+        l = level(id);
+        index = bucket_index(l, id);
 
-void RoutingTable::TreeNode::closest_routing_nodes( NodeID target
-                                                  , size_t max_output
-                                                  , std::vector<NodeContact>& output)
-{
-    if (output.size() >= max_output) {
-        return;
-    }
-    if (bucket) {
-        /*
-         * Nodes are listed oldest first, so iterate in reverse order
-         */
-        for (auto it = bucket->nodes.rbegin(); it != bucket->nodes.rend(); ++it) {
-            if (!it->is_bad()) {
-                output.push_back(it->contact);
-                if (output.size() >= max_output) {
-                    break;
-                }
-            }
-        }
-    } else {
-        if (target.bit(depth())) {
-            right_child->closest_routing_nodes(target, max_output, output);
-            left_child ->closest_routing_nodes(target, max_output, output);
-        } else {
-            left_child ->closest_routing_nodes(target, max_output, output);
-            right_child->closest_routing_nodes(target, max_output, output);
-        }
+        // TODO: each bucket needs a refresh background coroutine.
     }
+
+    return &_buckets[index];
 }
 
 /*
  * Find the $count nodes in the routing table, not known to be bad, that are
  * closest to $target.
+ *
+ * With c the level $target falls in, the nodes of level c are closer to
+ * $target than those of any level after it, which in turn are closer than
+ * those of level c-1, then c-2, and so on. So we only need to look at (and
+ * sort) as many levels as it takes to get $count nodes.
+ *
+ * Within a level, buckets cover disjoint ranges, so they can be taken one
+ * at a time in order of distance to $target.
  */
 std::vector<NodeContact>
 RoutingTable::find_closest_routing_nodes(NodeID target, size_t count)
 {
-    TreeNode* tree_node = _root_node.get();
-    std::vector<TreeNode*> ancestors;
-    ancestors.push_back(tree_node);
+    std::vector<NodeContact> output;
+    output.reserve(count);
+
+    std::vector<std::pair<NodeID::Distance, const NodeContact*>> group;
+    std::vector<std::pair<NodeID::Distance, size_t>> order;
 
-    while (!tree_node->bucket) {
-        if (target.bit(tree_node->depth())) {
-            tree_node = tree_node->right_child.get();
+    auto add = [&] (const RoutingBucket& bucket) {
+        for (auto& node : bucket.nodes) {
+            if (node.is_bad()) continue;
+            group.push_back({ target.distance(node.contact.id), &node.contact });
         }
-        else {
-            tree_node = tree_node->left_child.get();
+    };
+
+    auto flush = [&] {
+        size_t n = std::min(group.size(), count - output.size());
+
+        std::partial_sort(group.begin(), group.begin() + n, group.end(),
+            [] (const auto& l, const auto& r) { return l.first < r.first; });
+
+        for (size_t i = 0; i < n; i++) {
+            output.push_back(*group[i].second);
         }
+        group.clear();
+    };
 
-        ancestors.push_back(tree_node);
-    }
+    size_t c = level(target);
 
-    std::vector<NodeContact> output;
+    auto add_level = [&] (size_t level) {
+        // The bucket closest to $target comes first, and is often enough.
+        // Below level c, $target does not fall in any bucket, but it would
+        // if bit $level differed from that of _node_id.
+        NodeID t = target;
+        if (level != c) t.set_bit(level, !_node_id.bit(level));
+
+        size_t first = bucket_index(level, t);
+
+        add(_buckets[first]);
+        flush();
+
+        if (output.size() >= count) return;
+
+        order.clear();
+
+        for (size_t i = _level_begin[level]; i < level_end(level); i++) {
+            if (i == first) continue;
+            order.push_back({ range_distance(target, _ranges[i]), i });
+        }
+
+        std::sort(order.begin(), order.end(),
+            [] (const auto& l, const auto& r) { return l.first < r.first; });
+
+        for (auto& o : order) {
+            if (output.size() >= count) break;
+            add(_buckets[o.second]);
+            flush();
+        }
+    };
+
+    add_level(c);
+
+    if (output.size() < count && c != last_level()) {
+        for (size_t i = _level_begin[c + 1]; i < _buckets.size(); i++) {
+            add(_buckets[i]);
+        }
+        flush();
+    }
 
-    for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
-        (*it)->closest_routing_nodes(target, count, output);
-        if (output.size() >= count) break;
+    for (size_t l = c; l > 0 && output.size() < count; l--) {
+        add_level(l - 1);
     }
 
     return output;
@@ -4,6 +4,7 @@
 
 #include <chrono>
 #include <deque>
+#include <vector>
 
 #include "node_id.h"
 
@@ -52,63 +53,54 @@ struct RoutingBucket {
 };
 
 class RoutingTable {
-    private:
-    struct TreeNode {
-        /*
-         * A tree node is either a leaf with a bucket pointer,
-         * or a non-leaf with children.
-         */
-
-        NodeID::Range range;
-
-        TreeNode(NodeID::Range r) : range(std::move(r)) {}
-
-        void split();
-        size_t depth() const { return range.mask; }
-        size_t count_routing_nodes() const;
-
-        void closest_routing_nodes( NodeID target
-                              , size_t max_output
-                              , std::vector<NodeContact>& output);
-
-        std::unique_ptr<TreeNode> left_child;
-        std::unique_ptr<TreeNode> right_child;
-        std::unique_ptr<RoutingBucket> bucket;
-    };
-
     public:
     RoutingTable(NodeID);
     RoutingTable(const RoutingTable&) = delete;
 
+    /*
+     * The returned pointer stays valid until the next call to
+     * find_bucket(..., true).
+     */
     RoutingBucket* find_bucket(NodeID id, bool split_buckets);
     std::vector<NodeContact> find_closest_routing_nodes(NodeID target, size_t count);
 
     template<class F> void for_each_bucket(F&&);
 
     private:
-    TreeNode* exhaustive_routing_subtable_fragment_root() const;
-
-    template<class F> void for_each_bucket(F&&, TreeNode*);
+    size_t last_level() const { return _level_begin.size() - 1; }
+    size_t level(const NodeID&) const;
+    size_t level_end(size_t level) const;
+    size_t bucket_index(size_t level, const NodeID&) const;
+    bool in_exhaustive_subtree(size_t level) const;
+    void split_bucket(size_t level, size_t index);
+    void split_last_level();
 
     private:
     NodeID _node_id;
-    std::unique_ptr<TreeNode> _root_node;
+    /*
+     * Buckets are grouped by level: level i holds the nodes whose ID has
+     * exactly i leading bits in common with _node_id, except for the last
+     * level, which holds every node having at least that many in common (and
+     * so contains _node_id). The last level is a single bucket.
+     *
+     * Other levels start as a single bucket, which is split further on the
+     * bits following the first one differing from _node_id (as leaves of a
+     * binary tree would be), so that far away parts of the ID space still
+     * get a fair share of the table. Their buckets are kept in ID order.
+     *
+     * Level i starts at _buckets[_level_begin[i]], and _ranges[j] is the
+     * part of the ID space covered by _buckets[j].
+     */
+    std::vector<RoutingBucket> _buckets;
+    std::vector<NodeID::Range> _ranges;
+    std::vector<size_t> _level_begin;
 };
 
 template<class F>
 void RoutingTable::for_each_bucket(F&& f) {
-    for_each_bucket(std::forward<F>(f), _root_node.get());
-}
-
-template<class F>
-void RoutingTable::for_each_bucket(F&& f, TreeNode* node) {
-    if (node->bucket) {
-        f(node->range, *node->bucket);
-        return;
+    for (size_t i = 0; i < _buckets.size(); i++) {
+        f(_ranges[i], _buckets[i]);
     }
-
-    for_each_bucket(std::forward<F>(f), node->left_child.get());
-    for_each_bucket(std::forward<F>(f), node->right_child.get());
 }
 
 }}} // namespaces
@@ -4,6 +4,7 @@
 #include "../namespaces.h"
 #include "../or_throw.h"
 #include "../util/condition_variable.h"
+#include "datagram_socket.h"
 
 namespace ouinet { namespace bittorrent {
 
@@ -40,19 +41,18 @@ private:
     };
 
     struct RecvLoop : std::enable_shared_from_this<RecvLoop> {
-        void start(std::shared_ptr<udp::socket>);
+        void start(std::shared_ptr<DatagramSocket>);
         IntrusiveList<RecvEntry> queue;
     };
 
 public:
-    UdpMultiplexer(udp::socket);
+    UdpMultiplexer(std::unique_ptr<DatagramSocket>);
 
     UdpMultiplexer(const UdpMultiplexer&) = delete;
 
     asio::io_service& get_io_service();
 
-    template<class Buffers>
-    void send(const Buffers&, const udp::endpoint&, asio::yield_context);
+    void send(asio::const_buffer, const udp::endpoint&, asio::yield_context);
 
     // NOTE: The the pointer inside the returned string_view is guaranteed to
     // be valid only until the next coroutine based async IO call or until
@@ -63,19 +63,17 @@ public:
 
 private:
     // XXX: Having three shared_ptrs is overkill.
-    std::shared_ptr<udp::socket> _socket;
+    std::shared_ptr<DatagramSocket> _socket;
     std::shared_ptr<SendLoop> _send_loop;
     std::shared_ptr<RecvLoop> _recv_loop;
 };
 
 inline
-UdpMultiplexer::UdpMultiplexer(udp::socket s)
-    : _socket(std::make_shared<udp::socket>(std::move(s)))
+UdpMultiplexer::UdpMultiplexer(std::unique_ptr<DatagramSocket> s)
+    : _socket(std::move(s))
     , _send_loop(std::make_shared<SendLoop>(_socket->get_io_service()))
     , _recv_loop(std::make_shared<RecvLoop>())
 {
-    assert(_socket->is_open());
-
     _send_loop->start();
     _recv_loop->start(_socket);
 }
@@ -108,29 +106,28 @@ void UdpMultiplexer::SendLoop::start() {
     });
 }
 
-template<class Buffers>
 inline
-void UdpMultiplexer::send( const Buffers& buf
+void UdpMultiplexer::send( asio::const_buffer buf
                          , const udp::endpoint& to
                          , asio::yield_context yield)
 {
     ConditionVariable write_cv(_socket->get_io_service());
 
     struct SendEntry_ : SendEntry {
-        udp::socket& socket;
+        DatagramSocket& socket;
         ConditionVariable& write_cv;
-        const Buffers& buf;
+        asio::const_buffer buf;
         const udp::endpoint& to;
 
-        SendEntry_( udp::socket& socket
+        SendEntry_( DatagramSocket& socket
                   , ConditionVariable& write_cv
-                  , const Buffers& buf
+                  , asio::const_buffer buf
                   , const udp::endpoint& to)
             : socket(socket), write_cv(write_cv), buf(buf), to(to) {}
 
         void operator()(asio::yield_context yield) override {
             sys::error_code ec;
-            socket.async_send_to(buf, to, yield[ec]);
+            socket.send_to(buf, to, yield[ec]);
             write_cv.notify(ec);
         }
     };
@@ -149,7 +146,7 @@ void UdpMultiplexer::send( const Buffers& buf
 }
 
 inline
-void UdpMultiplexer::RecvLoop::start(std::shared_ptr<udp::socket> socket)
+void UdpMultiplexer::RecvLoop::start(std::shared_ptr<DatagramSocket> socket)
 {
     auto& ios = socket->get_io_service();
 
@@ -169,9 +166,9 @@ void UdpMultiplexer::RecvLoop::start(std::shared_ptr<udp::socket> socket)
 
             buf.resize(max_buf_size);
 
-            size_t size = socket->async_receive_from( asio::buffer(buf)
-                                                    , from
-                                                    , yield[ec]);
+            size_t size = socket->receive_from( asio::buffer(buf)
+                                              , from
+                                              , yield[ec]);
 
             buf.resize(size);
 
@@ -1,12 +1,36 @@
 #include "bep44_db.h"
 #include "../bittorrent/dht.h"
+#include "../async_sleep.h"
 #include "../or_throw.h"
+#include "../util.h"
+#include "../util/bytes.h"
+
+#include <list>
+#include <vector>
 
 using namespace std;
 using namespace ouinet;
 
 namespace bt = bittorrent;
 
+/*
+ * Salt of the item describing the index, and prefix of the salt of shards.
+ */
+static const string INDEX_INFO_SALT = "ouinet-index";
+
+/*
+ * Nodes refuse to store items whose encoded value is this big or bigger.
+ */
+static const size_t MAX_ITEM_VALUE_SIZE = 1000;
+
+static const unsigned MAX_SHARD_BITS = 24;
+
+/*
+ * How often clients check whether the injector changed the way it stores
+ * its index.
+ */
+static const auto INDEX_INFO_CHECK_INTERVAL = chrono::minutes(10);
+
 template<size_t N>
 static
 boost::string_view as_string_view(const array<uint8_t, N>& a)
@@ -14,57 +38,282 @@ boost::string_view as_string_view(const array<uint8_t, N>& a)
     return boost::string_view((char*) a.data(), a.size());
 }
 
+static uint32_t shard_index(const array<uint8_t, 20>& url_hash, unsigned shard_bits)
+{
+    uint32_t prefix = uint32_t(url_hash[0]) << 24
+                    | uint32_t(url_hash[1]) << 16
+                    | uint32_t(url_hash[2]) << 8
+                    | uint32_t(url_hash[3]);
+
+    return prefix >> (32 - shard_bits);
+}
+
+static string shard_salt(uint32_t index, unsigned shard_bits)
+{
+    return util::str(INDEX_INFO_SALT, '-', shard_bits, '-', index);
+}
+
+/*
+ * The whole SHA1 of the URL is used as its key within a shard, so that the
+ * injector can always tell which per URL item an entry belongs to, even for
+ * entries left by a previous run.
+ */
+static string shard_entry_key(const array<uint8_t, 20>& url_hash)
+{
+    return string((char*) url_hash.data(), url_hash.size());
+}
+
+static boost::optional<array<uint8_t, 20>> shard_entry_url_hash(const string& key)
+{
+    if (key.size() != 20) return boost::none;
+    return util::bytes::to_array<uint8_t, 20>(key);
+}
+
+/*
+ * Use the timestamp as a version ID, but make sure it always grows.
+ */
+static int64_t next_sequence_number(int64_t last)
+{
+    using Time = boost::posix_time::ptime;
+
+    Time unix_epoch(boost::gregorian::date(1970, 1, 1));
+    Time ts = boost::posix_time::microsec_clock::universal_time();
+
+    return max<int64_t>((ts - unix_epoch).total_milliseconds(), last + 1);
+}
+
+/*
+ * Shard contents as kept by the injector.
+ *
+ * Concurrent inserts into the same shard are coalesced: while the shard is
+ * being published, new entries just mark it dirty and wait for the
+ * publishing coroutine to push them along in its next round.
+ */
+struct Bep44InjectorDb::Shard {
+    using UrlHash = array<uint8_t, 20>;
+
+    map<string, string> entries;
+    // Keys of $entries, least recently inserted first.
+    list<string> order;
+    int64_t sequence_number = 0;
+
+    bool loaded = false;
+    bool dirty = false;
+    bool publishing = false;
+    ConditionVariable published;
+
+    Shard(asio::io_service& ios) : published(ios) {}
+
+    void set(const string& key, string value)
+    {
+        if (entries.count(key)) order.remove(key);
+        entries[key] = move(value);
+        order.push_back(key);
+    }
+
+    /*
+     * Build the shard value, dropping the oldest entries until it fits
+     * in an item. The dropped entries are added to $dropped.
+     */
+    bt::BencodedMap value(vector<pair<UrlHash, string>>& dropped)
+    {
+        size_t size = 2; // "d" ... "e"
+        for (auto& e : entries) {
+            size += encoded_entry_size(e.first, e.second);
+        }
+
+        while (size >= MAX_ITEM_VALUE_SIZE && !order.empty()) {
+            auto i = entries.find(order.front());
+            size -= encoded_entry_size(i->first, i->second);
+
+            dropped.emplace_back(*shard_entry_url_hash(i->first), move(i->second));
+
+            entries.erase(i);
+            order.pop_front();
+        }
+
+        bt::BencodedMap ret;
+        for (auto& e : entries) ret[e.first] = e.second;
+        return ret;
+    }
+
+    static size_t encoded_entry_size(const string& key, const string& value)
+    {
+        return bt::bencoding_encode(key).size()
+             + bt::bencoding_encode(value).size();
+    }
+};
+
 Bep44ClientDb::Bep44ClientDb( bt::MainlineDht& bt_dht
                             , util::Ed25519PublicKey bt_pubkey)
     : _bt_dht(bt_dht)
     , _bt_pubkey(bt_pubkey)
+    , _index_info_checked_cv(bt_dht.get_io_service())
     , _was_destroyed(make_shared<bool>(false))
-{}
+{
+    auto& ios = get_io_service();
+
+    asio::spawn(ios, [this, &ios, wd = _was_destroyed] (asio::yield_context yield) {
+        while (true) {
+            sys::error_code ec;
+            update_index_info(yield[ec]);
+
+            if (*wd) return;
+
+            if (!_index_info_checked) {
+                _index_info_checked = true;
+                _index_info_checked_cv.notify();
+            }
+
+            if (!async_sleep(ios, INDEX_INFO_CHECK_INTERVAL, _terminate_signal, yield)) {
+                return;
+            }
+
+            if (*wd) return;
+        }
+    });
+}
 
 
 Bep44InjectorDb::Bep44InjectorDb( bt::MainlineDht& bt_dht
-                                , util::Ed25519PrivateKey bt_privkey)
+                                , util::Ed25519PrivateKey bt_privkey
+                                , unsigned shard_bits)
     : _bt_dht(bt_dht)
     , _bt_privkey(bt_privkey)
+    , _shard_bits(min(shard_bits, MAX_SHARD_BITS))
     , _was_destroyed(make_shared<bool>(false))
 {}
 
 
-static string find( bt::MainlineDht& dht
-                  , util::Ed25519PublicKey pubkey
-                  , const string& key
-                  , asio::yield_context yield)
+/*
+ * Index entries are usually well replicated, so there is no point in waiting
+ * for the whole lookup to finish once a few responsible nodes agree on the
+ * latest version.
+ */
+static bt::MutableGetPolicy find_policy()
+{
+    bt::MutableGetPolicy policy;
+    policy.quorum = 3;
+    policy.deadline = chrono::seconds(10);
+    return policy;
+}
+
+static bt::MutableDataItem find_item( bt::MainlineDht& dht
+                                  , const util::Ed25519PublicKey& pubkey
+                                  , boost::string_view salt
+                                  , asio::yield_context yield)
 {
     sys::error_code ec;
 
-    auto salt = util::sha1(key);
+    auto opt_data = dht.mutable_get(pubkey, salt, find_policy(), yield[ec]);
 
-    auto opt_data = dht.mutable_get( pubkey
-                                   , as_string_view(salt)
-                                   , yield[ec]);
-    
     if (!ec && !opt_data) {
         // TODO: This shouldn't happen (it does), the above
         // function should return an error if not successful.
         ec = asio::error::not_found;
     }
 
+    if (ec) return or_throw<bt::MutableDataItem>(yield, ec);
+
+    return move(*opt_data);
+}
+
+static string find( bt::MainlineDht& dht
+                  , const util::Ed25519PublicKey& pubkey
+                  , boost::optional<unsigned> shard_bits
+                  , const string& key
+                  , asio::yield_context yield)
+{
+    sys::error_code ec;
+
+    auto salt = util::sha1(key);
+
+    if (shard_bits) {
+        auto shard = find_item( dht, pubkey
+                              , shard_salt(shard_index(salt, *shard_bits), *shard_bits)
+                              , yield[ec]).value;
+
+        if (ec == asio::error::operation_aborted) {
+            return or_throw<string>(yield, ec);
+        }
+
+        if (!ec) {
+            auto entries = shard.as_map();
+            if (entries) {
+                auto i = entries->find(shard_entry_key(salt));
+                if (i != entries->end() && i->second.is_string()) {
+                    return *i->second.as_string();
+                }
+            }
+        }
+
+        // Not in the shard, it may still have been inserted on its own.
+        ec = sys::error_code();
+    }
+
+    auto value = find_item(dht, pubkey, as_string_view(salt), yield[ec]).value;
+
     if (ec) return or_throw<string>(yield, ec);
 
-    assert(opt_data->value.is_string());
-    return *opt_data->value.as_string();
+    assert(value.is_string());
+    return *value.as_string();
+}
+
+
+/*
+ * Find out whether the injector keeps a sharded index, and how many bits
+ * it uses to tell shards apart. Failures leave things as they were, so that
+ * a bad lookup does not send us back to per URL items.
+ */
+void Bep44ClientDb::update_index_info(asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    sys::error_code ec;
+
+    auto info = find_item(_bt_dht, _bt_pubkey, INDEX_INFO_SALT, yield[ec]).value;
+
+    if (*wd) return or_throw(yield, asio::error::operation_aborted);
+    if (ec) return;
+
+    auto info_map = info.as_map();
+    if (!info_map) return;
+
+    auto i = info_map->find("shard-bits");
+    if (i == info_map->end()) return;
+
+    auto bits = i->second.as_int();
+    if (!bits || *bits < 0 || *bits > MAX_SHARD_BITS) return;
+
+    if (*bits == 0) {
+        _shard_bits = boost::none;
+    } else {
+        _shard_bits = unsigned(*bits);
+    }
 }
 
 
 string Bep44ClientDb::find(const string& key, asio::yield_context yield)
 {
-    return ::find(_bt_dht, _bt_pubkey, key, yield);
+    if (!_index_info_checked) {
+        auto wd = _was_destroyed;
+        sys::error_code ec;
+
+        _index_info_checked_cv.wait(yield[ec]);
+
+        if (!ec && *wd) ec = asio::error::operation_aborted;
+        if (ec) return or_throw<string>(yield, ec);
+    }
+
+    return ::find(_bt_dht, _bt_pubkey, _shard_bits, key, yield);
 }
 
 
 string Bep44InjectorDb::find(const string& key, asio::yield_context yield)
 {
-    return ::find(_bt_dht, _bt_privkey.public_key(), key, yield);
+    boost::optional<unsigned> shard_bits;
+    if (_shard_bits) shard_bits = _shard_bits;
+
+    return ::find(_bt_dht, _bt_privkey.public_key(), shard_bits, key, yield);
 }
 
 
@@ -72,24 +321,168 @@ void Bep44InjectorDb::insert( string key
                             , string value
                             , asio::yield_context yield)
 {
-    using Time = boost::posix_time::ptime;
+    if (_shard_bits) {
+        insert_sharded(key, move(value), yield);
+    } else {
+        insert_item(key, move(value), yield);
+    }
+}
 
+
+void Bep44InjectorDb::insert_item( const string& key
+                                 , string value
+                                 , asio::yield_context yield)
+{
+    publish_item(util::sha1(key), move(value), yield);
+}
+
+
+void Bep44InjectorDb::publish_item( const array<uint8_t, 20>& url_hash
+                                  , string value
+                                  , asio::yield_context yield)
+{
     /*
      * Use the sha1 of the URL as salt;
      * Use the timestamp as a version ID.
      */
+    auto item = bt::MutableDataItem::sign( move(value)
+                                         , next_sequence_number(0)
+                                         , as_string_view(url_hash)
+                                         , _bt_privkey);
 
-    auto salt = util::sha1(key);
+    _bt_dht.mutable_put_start(item, yield);
+}
 
-    Time unix_epoch(boost::gregorian::date(1970, 1, 1));
-    Time ts = boost::posix_time::microsec_clock::universal_time();
 
-    auto item = bt::MutableDataItem::sign( value
-                                         , (ts - unix_epoch).total_milliseconds()
-                                         , as_string_view(salt)
-                                         , _bt_privkey);
+void Bep44InjectorDb::insert_sharded( const string& key
+                                    , string value
+                                    , asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    sys::error_code ec;
 
-    _bt_dht.mutable_put_start(item, yield);
+    if (!_index_info_published) {
+        bt::BencodedMap info;
+        info["shard-bits"] = int64_t(_shard_bits);
+
+        auto item = bt::MutableDataItem::sign( info
+                                             , next_sequence_number(0)
+                                             , INDEX_INFO_SALT
+                                             , _bt_privkey);
+
+        _bt_dht.mutable_put_start(item, yield[ec]);
+
+        if (!ec && *wd) ec = asio::error::operation_aborted;
+        if (ec) return or_throw(yield, ec);
+
+        _index_info_published = true;
+    }
+
+    auto url_hash = util::sha1(key);
+    uint32_t index = shard_index(url_hash, _shard_bits);
+
+    auto& shard_ptr = _shards[index];
+    if (!shard_ptr) shard_ptr.reset(new Shard(get_io_service()));
+    Shard& shard = *shard_ptr;
+
+    shard.set(shard_entry_key(url_hash), move(value));
+    shard.dirty = true;
+
+    // The URL may have been inserted on its own before sharding was enabled,
+    // stop republishing that item.
+    _bt_dht.mutable_put_stop(bt::dht::DataStore::mutable_get_id
+            (_bt_privkey.public_key(), as_string_view(url_hash)));
+
+    if (shard.publishing) {
+        shard.published.wait(yield[ec]);
+        if (!ec && *wd) ec = asio::error::operation_aborted;
+        return or_throw(yield, ec);
+    }
+
+    publish_shard(index, shard, yield);
+}
+
+
+/*
+ * Keep publishing $shard until no more entries were added to it in the
+ * meantime, then wake up everyone waiting for them.
+ */
+void Bep44InjectorDb::publish_shard( uint32_t index
+                                   , Shard& shard
+                                   , asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    sys::error_code ec;
+
+    auto salt = shard_salt(index, _shard_bits);
+
+    shard.publishing = true;
+
+    if (!shard.loaded) {
+        /*
+         * Pick up whatever a previous run of the injector left in this
+         * shard, otherwise the first insert would wipe it out.
+         */
+        auto old = find_item(_bt_dht, _bt_privkey.public_key(), salt, yield[ec]);
+
+        if (*wd) return or_throw(yield, asio::error::operation_aborted);
+
+        auto old_entries = old.value.as_map();
+
+        if (!ec && old_entries) {
+            shard.sequence_number = old.sequence_number;
+
+            for (auto& e : *old_entries) {
+                if ( shard.entries.count(e.first)
+                  || !shard_entry_url_hash(e.first)
+                  || !e.second.is_string()) {
+                    continue;
+                }
+                shard.entries[e.first] = *e.second.as_string();
+                shard.order.push_front(e.first);
+            }
+        }
+
+        shard.loaded = true;
+        ec = sys::error_code();
+    }
+
+    while (shard.dirty) {
+        shard.dirty = false;
+        shard.sequence_number = next_sequence_number(shard.sequence_number);
+
+        vector<pair<Shard::UrlHash, string>> dropped;
+
+        auto item = bt::MutableDataItem::sign( shard.value(dropped)
+                                             , shard.sequence_number
+                                             , salt
+                                             , _bt_privkey);
+
+        _bt_dht.mutable_put_start(item, yield[ec]);
+
+        if (*wd) return or_throw(yield, asio::error::operation_aborted);
+        if (ec) break;
+
+        // Their own items were stopped when they went into the shard,
+        // publish them again now that clients will not find them there.
+        // This is done aside, so as not to hold back later shard updates.
+        for (auto& d : dropped) {
+            asio::spawn(get_io_service(), [ this
+                                          , wd
+                                          , url_hash = d.first
+                                          , value = move(d.second)
+                                          ] (asio::yield_context yield) mutable {
+                if (*wd) return;
+                sys::error_code ec;
+                publish_item(url_hash, move(value), yield[ec]);
+            });
+        }
+    }
+
+    shard.publishing = false;
+    shard.published.notify(ec);
+
+    return or_throw(yield, ec);
 }
 
 
@@ -108,6 +501,7 @@ boost::asio::io_service& Bep44InjectorDb::get_io_service()
 Bep44ClientDb::~Bep44ClientDb()
 {
     *_was_destroyed = true;
+    _terminate_signal();
 }
 
 
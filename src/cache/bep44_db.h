@@ -2,9 +2,15 @@
 
 #include <boost/system/error_code.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <map>
+#include <memory>
 
 #include "../namespaces.h"
+#include "../util/condition_variable.h"
 #include "../util/crypto.h"
+#include "../util/signal.h"
 #include "db.h"
 
 namespace ouinet { namespace bittorrent { class MainlineDht; }}
@@ -12,6 +18,23 @@ namespace ouinet { namespace util { class Ed25519PublicKey; }}
 
 namespace ouinet {
 
+/*
+ * The injector may store its index in one of two ways:
+ *
+ *   - One mutable item per URL, with the SHA1 of the URL as salt.
+ *
+ *   - Sharded: URLs are grouped by the first $shard_bits bits of their SHA1,
+ *     and each group is stored as a single mutable item mapping the SHA1
+ *     of each URL to its value. This takes one DHT publication per
+ *     shard instead of one per URL. Shard items are kept under the BEP44 size
+ *     limit by dropping their least recently inserted entries.
+ *
+ * In sharded mode the injector also publishes a small item describing the
+ * index, so that clients can find out about it without any configuration.
+ * Clients check it in the background, and fall back to the per URL items
+ * when a URL is not in its shard. The injector keeps publishing per URL
+ * items for the entries that do not fit in their shard.
+ */
 class Bep44ClientDb : public ClientDb {
 public:
     Bep44ClientDb( bittorrent::MainlineDht& bt_dht
@@ -23,16 +46,26 @@ public:
 
     ~Bep44ClientDb();
 
+private:
+    void update_index_info(asio::yield_context);
+
 private:
     bittorrent::MainlineDht& _bt_dht;
     util::Ed25519PublicKey _bt_pubkey;
+    boost::optional<unsigned> _shard_bits;
+    // Lookups wait for the first check of the index info only.
+    bool _index_info_checked = false;
+    ConditionVariable _index_info_checked_cv;
+    Signal<void()> _terminate_signal;
     std::shared_ptr<bool> _was_destroyed;
 };
 
 class Bep44InjectorDb : public InjectorDb {
 public:
+    // Zero $shard_bits means one item per URL.
     Bep44InjectorDb( bittorrent::MainlineDht& bt_dht
-                   , util::Ed25519PrivateKey bt_privkey);
+                   , util::Ed25519PrivateKey bt_privkey
+                   , unsigned shard_bits = 0);
 
     std::string find(const std::string& key, asio::yield_context) override;
 
@@ -42,9 +75,22 @@ public:
 
     ~Bep44InjectorDb();
 
+private:
+    struct Shard;
+
+    void insert_item(const std::string& key, std::string value, asio::yield_context);
+    void publish_item( const std::array<uint8_t, 20>& url_hash
+                     , std::string value
+                     , asio::yield_context);
+    void insert_sharded(const std::string& key, std::string value, asio::yield_context);
+    void publish_shard(uint32_t index, Shard&, asio::yield_context);
+
 private:
     bittorrent::MainlineDht& _bt_dht;
     util::Ed25519PrivateKey _bt_privkey;
+    unsigned _shard_bits;
+    bool _index_info_published = false;
+    std::map<uint32_t, std::unique_ptr<Shard>> _shards;
     std::shared_ptr<bool> _was_destroyed;
 };
 
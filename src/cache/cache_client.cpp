@@ -61,7 +61,8 @@ CacheClient::CacheClient( asio_ipfs::node ipfs_node
                         , fs::path path_to_repo)
     : _path_to_repo(move(path_to_repo))
     , _ipfs_node(new asio_ipfs::node(move(ipfs_node)))
-    , _bt_dht(new bt::MainlineDht(_ipfs_node->get_io_service()))
+    , _bt_dht(new bt::MainlineDht( _ipfs_node->get_io_service()
+                                 , _path_to_repo/"dht"))
     , _btree_db(new BTreeClientDb( *_ipfs_node
                                  , ipns
                                  , *_bt_dht
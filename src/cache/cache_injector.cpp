@@ -21,16 +21,22 @@ namespace bt = ouinet::bittorrent;
 CacheInjector::CacheInjector
         ( asio::io_service& ios
         , util::Ed25519PrivateKey bt_privkey
-        , fs::path path_to_repo)
+        , fs::path path_to_repo
+        , unsigned bep44_index_shard_bits
+        , size_t dht_verification_threads)
     : _ipfs_node(new asio_ipfs::node(ios, (path_to_repo/"ipfs").native()))
-    , _bt_dht(new bt::MainlineDht(ios))
+    , _bt_dht(new bt::MainlineDht( ios
+                                , path_to_repo/"dht"
+                                , dht_verification_threads))
     , _publisher(new Publisher(*_ipfs_node, *_bt_dht, bt_privkey))
     , _btree_db(new BTreeInjectorDb(*_ipfs_node, *_publisher, path_to_repo))
     , _scheduler(new Scheduler(ios, _concurrency))
     , _was_destroyed(make_shared<bool>(false))
 {
     _bt_dht->set_interfaces({asio::ip::address_v4::any()});
-    _bep44_db.reset(new Bep44InjectorDb(*_bt_dht, bt_privkey));
+    _bep44_db.reset(new Bep44InjectorDb( *_bt_dht
+                                       , bt_privkey
+                                       , bep44_index_shard_bits));
 }
 
 string CacheInjector::ipfs_id() const
@@ -33,7 +33,9 @@ public:
 public:
     CacheInjector( boost::asio::io_service&
                  , util::Ed25519PrivateKey bt_privkey
-                 , fs::path path_to_repo);
+                 , fs::path path_to_repo
+                 , unsigned bep44_index_shard_bits = 0
+                 , size_t dht_verification_threads = 0);
 
     CacheInjector(const CacheInjector&) = delete;
     CacheInjector& operator=(const CacheInjector&) = delete;
@@ -12,9 +12,19 @@ namespace ouinet { namespace bittorrent { class MainlineDht; }}
 
 namespace ouinet {
 
+class ResolverLoop;
+
+/*
+ * Keeps resolving the IPNS key of the cache index, and calls $on_resolve
+ * whenever it points somewhere new.
+ *
+ * Resolution backends (IPFS, and the BitTorrent DHT if a key is given) are
+ * not run all at once: the one which has been fastest and most reliable so
+ * far goes first, and the next one only joins in if it fails or stalls. The
+ * polling interval grows while the key keeps resolving to the same value.
+ */
 class Resolver {
 private:
-    struct Loop;
     using OnResolve = std::function<void(std::string, asio::yield_context)>;
 
 public:
@@ -30,8 +40,7 @@ public:
 
 private:
     asio::io_service& _ios;
-    std::shared_ptr<Loop> _ipfs_loop;
-    std::shared_ptr<Loop> _bt_loop;
+    std::shared_ptr<ResolverLoop> _loop;
 };
 
 } // namespace
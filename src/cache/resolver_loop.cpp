@@ -0,0 +1,256 @@
+#include "resolver_loop.h"
+#include "../logger.h"
+#include "../or_throw.h"
+#include "../util/condition_variable.h"
+
+using namespace std;
+using namespace ouinet;
+using boost::optional;
+
+using Clock = ResolverLoop::Clock;
+
+/*
+ * Weight of the last resolution in the moving averages below.
+ */
+static const double STATS_WEIGHT = 0.3;
+
+static double seconds(Clock::duration d)
+{
+    return chrono::duration<double>(d).count();
+}
+
+struct ResolverLoop::Backend {
+    string name;
+    Resolve resolve;
+
+    // Moving average of the outcome of resolutions (1 for success).
+    double success_rate = 1;
+    // Moving average of the duration of successful resolutions.
+    optional<double> latency;
+    // A resolution is still running, maybe from a previous round.
+    bool busy = false;
+
+    Backend(string name, Resolve resolve)
+        : name(move(name))
+        , resolve(move(resolve))
+    {}
+
+    // Expected time to get an answer; backends never tried go first, and
+    // those which never succeeded are taken to be as slow as it gets.
+    double cost(const Config& config) const
+    {
+        if (!latency && success_rate == 1) return 0;
+
+        double l = latency ? *latency : seconds(config.max_stall_timeout);
+        return l / max(success_rate, 0.1);
+    }
+
+    Clock::duration stall_timeout(const Config& config) const
+    {
+        if (!latency) return config.max_stall_timeout;
+
+        auto t = chrono::duration_cast<Clock::duration>(
+                chrono::duration<double>(*latency * config.stall_factor));
+
+        return min(max(t, config.min_stall_timeout), config.max_stall_timeout);
+    }
+
+    void record(bool success, Clock::duration duration)
+    {
+        success_rate += STATS_WEIGHT * ((success ? 1 : 0) - success_rate);
+
+        if (!success) return;
+
+        double d = seconds(duration);
+        latency = latency ? *latency + STATS_WEIGHT * (d - *latency) : d;
+    }
+};
+
+/*
+ * The resolutions started in one polling round. They may outlive it
+ * if they stall.
+ */
+struct ResolverLoop::Round {
+    optional<string> result;
+    size_t running = 0;
+    bool stalled = false;
+    // Bumped for every backend started, so that a stall timer which
+    // already fired for a previous one is not taken for the current one's.
+    size_t attempt = 0;
+    ConditionVariable cv;
+
+    Round(asio::io_service& ios) : cv(ios) {}
+};
+
+ResolverLoop::Config ResolverLoop::Config::defaults()
+{
+    Config config;
+    config.min_interval = chrono::seconds(20);
+    config.max_interval = chrono::minutes(5);
+    config.stall_factor = 2;
+    config.min_stall_timeout = chrono::seconds(5);
+    config.max_stall_timeout = chrono::seconds(60);
+    return config;
+}
+
+ResolverLoop::ResolverLoop(asio::io_service& ios, OnResolve on_resolve)
+    : ResolverLoop(ios, move(on_resolve), Config::defaults())
+{}
+
+ResolverLoop::ResolverLoop( asio::io_service& ios
+                          , OnResolve on_resolve
+                          , Config config)
+    : _ios(ios)
+    , _config(config)
+    , _timer(ios)
+    , _on_resolve(move(on_resolve))
+{}
+
+void ResolverLoop::add_backend(string name, Resolve resolve)
+{
+    _backends.push_back(make_shared<Backend>(move(name), move(resolve)));
+}
+
+void ResolverLoop::start()
+{
+    asio::spawn(_ios, [self = shared_from_this()]
+                      (asio::yield_context yield) {
+            if (self->_was_stopped) return;
+            self->run(yield);
+        });
+}
+
+void ResolverLoop::run(asio::yield_context yield)
+{
+    auto interval = _config.min_interval;
+
+    while (!_was_stopped) {
+        sys::error_code ec;
+
+        auto value = resolve(yield[ec]);
+
+        if (_was_stopped) return;
+
+        if (ec) {
+            interval = _config.min_interval;
+        }
+        else if (_last_value && *_last_value == value) {
+            interval = min(interval * 2, _config.max_interval);
+        }
+        else {
+            interval = _config.min_interval;
+            _last_value = value;
+
+            _on_resolve(move(value), yield[ec]);
+            if (_was_stopped) return;
+        }
+
+        _timer.expires_from_now(interval);
+        _timer.async_wait(yield[ec]);
+    }
+}
+
+/*
+ * Start backends one by one, cheapest first, moving on to the next one
+ * when the current one fails or stalls. Stalled ones keep running, and
+ * whichever backend answers first wins.
+ */
+string ResolverLoop::resolve(asio::yield_context yield)
+{
+    auto order = _backends;
+
+    stable_sort(order.begin(), order.end(),
+        [this] (const shared_ptr<Backend>& l, const shared_ptr<Backend>& r) {
+            return l->cost(_config) < r->cost(_config);
+        });
+
+    _round = make_shared<Round>(_ios);
+    auto r = _round;
+
+    for (auto& backend : order) {
+        // Still stuck since some previous round.
+        if (backend->busy) continue;
+
+        start_resolution(backend, r);
+
+        auto attempt = ++r->attempt;
+        r->stalled = false;
+
+        asio::steady_timer stall_timer(_ios);
+        stall_timer.expires_from_now(backend->stall_timeout(_config));
+        stall_timer.async_wait([r, attempt] (const sys::error_code& ec) {
+            if (ec || r->attempt != attempt) return;
+            r->stalled = true;
+            r->cv.notify();
+        });
+
+        wait(*r, yield);
+        stall_timer.cancel();
+
+        if (_was_stopped) {
+            return or_throw<string>(yield, asio::error::operation_aborted);
+        }
+
+        if (r->result) return *r->result;
+
+        if (r->stalled) {
+            LOG_DEBUG("Resolution stalled (", backend->name, ")"
+                     , ", trying the next backend");
+        }
+    }
+
+    // Every backend has been started, wait for the stalled ones.
+    while (!r->result && r->running && !_was_stopped) {
+        sys::error_code ec;
+        r->cv.wait(yield[ec]);
+    }
+
+    if (_was_stopped) {
+        return or_throw<string>(yield, asio::error::operation_aborted);
+    }
+
+    if (!r->result) return or_throw<string>(yield, asio::error::not_found);
+
+    return *r->result;
+}
+
+// Until something resolves, all running resolutions fail, or the last
+// one started stalls.
+void ResolverLoop::wait(Round& r, asio::yield_context yield)
+{
+    while (!r.result && r.running && !r.stalled && !_was_stopped) {
+        sys::error_code ec;
+        r.cv.wait(yield[ec]);
+    }
+}
+
+void ResolverLoop::start_resolution(shared_ptr<Backend> backend, shared_ptr<Round> r)
+{
+    backend->busy = true;
+    r->running++;
+
+    asio::spawn(_ios, [ backend = move(backend)
+                      , r = move(r)
+                      , self = shared_from_this()
+                      ] (asio::yield_context yield) {
+            sys::error_code ec;
+            auto start = Clock::now();
+
+            auto value = backend->resolve(yield[ec]);
+
+            backend->busy = false;
+            backend->record(!ec, Clock::now() - start);
+
+            if (!ec && !r->result) r->result = move(value);
+
+            r->running--;
+            r->cv.notify();
+        });
+}
+
+void ResolverLoop::stop()
+{
+    _was_stopped = true;
+    _timer.cancel();
+    if (_round) _round->cv.notify();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../namespaces.h"
+
+namespace ouinet {
+
+/*
+ * The polling loop behind `Resolver`, which knows nothing of the actual
+ * resolution backends it is given.
+ *
+ * Backends are not run all at once: the one which has been fastest and most
+ * reliable so far goes first, and the next one only joins in if it fails or
+ * stalls. The polling interval grows while the value stays the same, and
+ * $on_resolve is called whenever it changes.
+ */
+class ResolverLoop : public std::enable_shared_from_this<ResolverLoop> {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Resolve = std::function<std::string(asio::yield_context)>;
+    using OnResolve = std::function<void(std::string, asio::yield_context)>;
+
+    struct Config {
+        /*
+         * Polling interval right after the resolved value changed (or
+         * failed to resolve), and the most it may grow to while the value
+         * stays the same.
+         */
+        Clock::duration min_interval;
+        Clock::duration max_interval;
+        /*
+         * A backend is considered stalled (and the next one is started)
+         * after $stall_factor times its usual resolution time, within these
+         * bounds. Backends with no successful resolution yet get the
+         * maximum.
+         */
+        double stall_factor;
+        Clock::duration min_stall_timeout;
+        Clock::duration max_stall_timeout;
+
+        static Config defaults();
+    };
+
+    ResolverLoop(asio::io_service&, OnResolve);
+    ResolverLoop(asio::io_service&, OnResolve, Config);
+
+    ResolverLoop(const ResolverLoop&) = delete;
+    ResolverLoop& operator=(const ResolverLoop&) = delete;
+
+    void add_backend(std::string name, Resolve);
+
+    void start();
+    void stop();
+
+private:
+    struct Backend;
+    struct Round;
+
+    void run(asio::yield_context);
+    std::string resolve(asio::yield_context);
+    void wait(Round&, asio::yield_context);
+    void start_resolution(std::shared_ptr<Backend>, std::shared_ptr<Round>);
+
+private:
+    bool _was_stopped = false;
+    asio::io_service& _ios;
+    Config _config;
+    asio::steady_timer _timer;
+    OnResolve _on_resolve;
+    std::vector<std::shared_ptr<Backend>> _backends;
+    std::shared_ptr<Round> _round;
+    boost::optional<std::string> _last_value;
+};
+
+} // namespace
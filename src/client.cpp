@@ -9,6 +9,7 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/ssl/stream.hpp>
 #include <boost/optional/optional_io.hpp>
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <cstdlib>  // for atexit()
@@ -36,6 +37,7 @@
 #include "default_timeout.h"
 #include "ssl/ca_certificate.h"
 #include "ssl/dummy_certificate.h"
+#include "ssl/mitm_context.h"
 
 #ifndef __ANDROID__
 #  include "force_exit_on_signal.h"
@@ -47,7 +49,7 @@
 
 #include "util/signal.h"
 #include "util/crypto.h"
-#include "util/lru_cache.h"
+#include "util/io_service_pool.h"
 
 #include "logger.h"
 
@@ -65,6 +67,9 @@ static const fs::path OUINET_PID_FILE = "pid";
 static const fs::path OUINET_CA_CERT_FILE = "ssl-ca-cert.pem";
 static const fs::path OUINET_CA_KEY_FILE = "ssl-ca-key.pem";
 static const fs::path OUINET_CA_DH_FILE = "ssl-ca-dh.pem";
+static const fs::path OUINET_MITM_CERTS_DIR = "ssl-certs";
+// How many stored MitM certificates to get ready on start.
+static const size_t OUINET_MITM_CERTS_PREPARED = 100;
 
 //------------------------------------------------------------------------------
 class Client::State : public enable_shared_from_this<Client::State> {
@@ -73,10 +78,6 @@ class Client::State : public enable_shared_from_this<Client::State> {
 public:
     State(asio::io_service& ios)
         : _ios(ios)
-        // A certificate chain with OUINET_CA + SUBJECT_CERT
-        // can be around 2 KiB, so this would be around 2 MiB.
-        // TODO: Fine tune if necessary.
-        , _ssl_certificate_cache(1000)
     { }
 
     void start(int argc, char* argv[]);
@@ -85,6 +86,16 @@ public:
         _cache = nullptr;
         _shutdown_signal();
         if (_injector) _injector->stop();
+
+        for (auto& w : _workers) {
+            w.ios.post([&w] { w.shutdown_signal(); });
+        }
+
+        if (_pool) _pool->stop();
+    }
+
+    ~State() {
+        if (_pool) _pool->join();
     }
 
     void setup_ipfs_cache();
@@ -115,7 +126,13 @@ private:
 
     void listen_tcp( asio::yield_context
                    , tcp::endpoint
-                   , function<void(GenericStream, asio::yield_context)>);
+                   , function<void(GenericStream, asio::yield_context)>
+                   , bool use_pool = false);
+
+    // The signal closing connections served by `ios` on shutdown.
+    Signal<void()>& shutdown_signal_of(asio::io_service& ios);
+
+    void prepare_mitm_certificates();
 
     void setup_injector(asio::yield_context);
 
@@ -131,10 +148,21 @@ private:
     fs::path ca_key_path()  const { return _config.repo_root() / OUINET_CA_KEY_FILE;  }
     fs::path ca_dh_path()   const { return _config.repo_root() / OUINET_CA_DH_FILE;   }
 
+private:
+    // What browser connections served by a thread of the `_pool` need
+    // for themselves. Everything else in this class belongs to `_ios`.
+    struct Worker {
+        asio::io_service& ios;
+        Signal<void()> shutdown_signal;
+
+        Worker(asio::io_service& ios) : ios(ios) {}
+    };
+
 private:
     asio::io_service& _ios;
     std::unique_ptr<CACertificate> _ca_certificate;
-    util::LruCache<string, string> _ssl_certificate_cache;
+    // Used by MitM handshakes, which may run in any thread.
+    std::unique_ptr<MitmContext> _mitm_context;
     ClientConfig _config;
     std::unique_ptr<OuiServiceClient> _injector;
     std::unique_ptr<CacheClient> _cache;
@@ -147,8 +175,12 @@ private:
     bool _is_ipns_being_setup = false;
 
     // For debugging
-    uint64_t _next_connection_id = 0;
+    std::atomic<uint64_t> _next_connection_id{0};
     ConnectionPool<std::string> _injector_connections;
+
+    std::list<Worker> _workers;
+    // Last, so that its threads are joined before the above goes away.
+    std::unique_ptr<util::IoServicePool> _pool;
 };
 
 //------------------------------------------------------------------------------
@@ -235,7 +267,10 @@ void Client::State::handle_connect_request( GenericStream& client_c
         return;
     }
 
-    full_duplex(client_c, inj.connection, yield);
+    auto stats = full_duplex(client_c, inj.connection, yield);
+
+    LOG_DEBUG("CONNECT tunnel to ", req.target(), " closed; bytes from browser: "
+             , stats.from_c1, ", from injector: ", stats.from_c2);
 }
 
 //------------------------------------------------------------------------------
@@ -550,47 +585,6 @@ private:
 //    return res;
 //}
 
-//------------------------------------------------------------------------------
-void setup_ssl_context( asio::ssl::context& ssl_context
-                      , const string& cert_chain
-                      , const string& private_key
-                      , const string& dh)
-{
-    namespace ssl = boost::asio::ssl;
-
-    ssl_context.set_options( ssl::context::default_workarounds
-                           | ssl::context::no_sslv2
-                           | ssl::context::single_dh_use);
-
-    ssl_context.use_certificate_chain(
-            asio::buffer(cert_chain.data(), cert_chain.size()));
-
-    ssl_context.use_private_key( asio::buffer( private_key.data()
-                                             , private_key.size())
-                               , ssl::context::file_format::pem);
-
-    ssl_context.use_tmp_dh(asio::buffer(dh.data(), dh.size()));
-
-    ssl_context.set_password_callback(
-        [](std::size_t, ssl::context_base::password_purpose)
-        {
-            assert(0 && "TODO: Not yet supported");
-            return "";
-        });
-}
-
-static
-string base_domain_from_target(const beast::string_view& target)
-{
-    auto full_host = target.substr(0, target.rfind(':'));
-    size_t dot0, dot1 = 0;
-    if ((dot0 = full_host.find('.')) != full_host.rfind('.'))
-        // Two different dots were found
-        // (e.g. "www.example.com" but not "localhost" or "example.com").
-        dot1 = dot0 + 1;  // skip first component and dot (e.g. "www.")
-    return full_host.substr(dot1).to_string();
-}
-
 //------------------------------------------------------------------------------
 GenericStream Client::State::ssl_mitm_handshake( GenericStream&& con
                                                , const Request& con_req
@@ -598,40 +592,20 @@ GenericStream Client::State::ssl_mitm_handshake( GenericStream&& con
 {
     namespace ssl = boost::asio::ssl;
 
-    ssl::context ssl_context{ssl::context::tls_server};
-
-    // TODO: We really should be waiting for
-    // the TLS Client Hello message to arrive at the clear text connection
-    // (after we send back 200 OK),
-    // then retrieve the value of the Server Name Indication (SNI) field
-    // and rewind the Hello message,
-    // but for the moment we will assume that the browser sends
-    // a host name instead of an IP address or its reverse resolution.
-    auto base_domain = base_domain_from_target(con_req.target());
-
-    const string* crt_chain = _ssl_certificate_cache.get(base_domain);
-
-    if (!crt_chain) {
-        DummyCertificate dummy_crt(*_ca_certificate, base_domain);
-
-        crt_chain
-            = _ssl_certificate_cache.put(move(base_domain)
-                                        , dummy_crt.pem_certificate()
-                                          + _ca_certificate->pem_certificate());
-    }
-
-    setup_ssl_context( ssl_context
-                     , *crt_chain
-                     , _ca_certificate->pem_private_key()
-                     , _ca_certificate->pem_dh_param());
-
     // Send back OK to let the UA know we have the "tunnel"
     http::response<http::string_body> res{http::status::ok, con_req.version()};
     http::async_write(con, res, yield);
 
     sys::error_code ec;
 
-    auto ssl_sock = make_unique<ssl::stream<GenericStream>>(move(con), ssl_context);
+    auto ssl_sock = make_unique<ssl::stream<GenericStream>>
+        (move(con), _mitm_context->context());
+
+    // The certificate is picked during the handshake, from the host name
+    // in the browser's TLS Client Hello (SNI) or else this one.
+    _mitm_context->set_default_host( ssl_sock->native_handle()
+                                   , con_req.target().to_string());
+
     ssl_sock->async_handshake(ssl::stream_base::server, yield[ec]);
     if (ec) return or_throw<GenericStream>(yield, ec);
 
@@ -653,7 +627,7 @@ void Client::State::serve_request( GenericStream&& con
     namespace rr = request_route;
     using rr::responder;
 
-    auto close_con_slot = _shutdown_signal.connect([&con] {
+    auto close_con_slot = shutdown_signal_of(con.get_io_service()).connect([&con] {
         con.close();
     });
 
@@ -794,7 +768,25 @@ void Client::State::serve_request( GenericStream&& con
         //}
         request_config = route_choose_config(req, matches, default_request_config);
 
-        auto res = cache_control.fetch(req, yield[ec].tag("cache_control.fetch"));
+        Response res;
+
+        if (&con.get_io_service() == &_ios) {
+            res = cache_control.fetch(req, yield[ec].tag("cache_control.fetch"));
+        }
+        else {
+            // Routing, the injector and the cache belong to the main thread.
+            // The fetch may outlive this coroutine on shutdown, so it works
+            // on copies of the request and its configuration.
+            res = util::run_on<Response>(_ios, con.get_io_service(),
+                [this, req, request_config, tag = yield.tag()]
+                (asio::yield_context main_yield) mutable {
+                    Client::ClientCacheControl cache_control(*this, request_config);
+                    return cache_control.fetch
+                        ( req
+                        , Yield(_ios, main_yield, tag)
+                            .tag("cache_control.fetch"));
+                }, shutdown_signal_of(con.get_io_service()), yield[ec]);
+        }
 
         if (ec) {
 #ifndef NDEBUG
@@ -901,10 +893,22 @@ void Client::State::setup_ipfs_cache()
 }
 
 //------------------------------------------------------------------------------
+Signal<void()>& Client::State::shutdown_signal_of(asio::io_service& ios)
+{
+    for (auto& w : _workers) {
+        if (&w.ios == &ios) return w.shutdown_signal;
+    }
+    return _shutdown_signal;
+}
+
+//------------------------------------------------------------------------------
+// With `use_pool`, accepted connections are handed over to the threads of
+// the `_pool` (if any), where `handler` runs.
 void Client::State::listen_tcp
         ( asio::yield_context yield
         , tcp::endpoint local_endpoint
-        , function<void(GenericStream, asio::yield_context)> handler)
+        , function<void(GenericStream, asio::yield_context)> handler
+        , bool use_pool)
 {
     sys::error_code ec;
 
@@ -944,7 +948,9 @@ void Client::State::listen_tcp
 
     for(;;)
     {
-        tcp::socket socket(_ios);
+        auto& con_ios = (use_pool && _pool) ? _pool->next() : _ios;
+
+        tcp::socket socket(con_ios);
         acceptor.async_accept(socket, yield[ec]);
 
         if(ec) {
@@ -964,6 +970,27 @@ void Client::State::listen_tcp
 
             GenericStream connection(move(socket) , move(tcp_shutter));
 
+            if (&con_ios != &_ios) {
+                asio::spawn( con_ios
+                           , [ this
+                             , c = move(connection)
+                             , handler
+                             , lock = make_shared<WaitCondition::Lock>
+                                          (wait_condition.lock())
+                             ](asio::yield_context yield) mutable {
+                                 // The lock belongs to the main thread,
+                                 // let it be released there.
+                                 auto on_exit = defer([&] {
+                                     _ios.post([l = move(lock)] {});
+                                 });
+
+                                 auto& ios = c.get_io_service();
+                                 if (shutdown_signal_of(ios).call_count()) return;
+                                 handler(move(c), yield);
+                             });
+                continue;
+            }
+
             asio::spawn( _ios
                        , [ this
                          , self = shared_from_this()
@@ -996,6 +1023,14 @@ void Client::State::start(int argc, char* argv[])
         return;
     }
 
+    if (_config.threads() > 1) {
+        _pool = make_unique<util::IoServicePool>(_config.threads());
+
+        for (size_t i = 0; i < _pool->size(); i++) {
+            _workers.emplace_back((*_pool)[i]);
+        }
+    }
+
 #ifndef __ANDROID__
     auto pid_path = get_pid_path();
     if (exists(pid_path)) {
@@ -1034,6 +1069,16 @@ void Client::State::start(int argc, char* argv[])
             << _ca_certificate->pem_dh_param();
     }
 
+    // Up to 1000 leaf certificates (about 1 KiB each) are kept in memory.
+    // TODO: Fine tune if necessary.
+    _mitm_context = make_unique<MitmContext>
+        ( *_ca_certificate
+        , _config.repo_root() / OUINET_MITM_CERTS_DIR
+        , _config.mitm_ecdsa()
+        , 1000);
+
+    prepare_mitm_certificates();
+
     asio::spawn
         ( _ios
         , [this, self = shared_from_this()]
@@ -1056,10 +1101,11 @@ void Client::State::start(int argc, char* argv[])
 
               listen_tcp( yield[ec]
                         , _config.local_endpoint()
-                        , [this, self]
+                        , [this]
                           (GenericStream c, asio::yield_context yield) {
                       serve_request(move(c), yield);
-                  });
+                  }
+                  , true);
           });
 
     if (_config.front_end_endpoint() != tcp::endpoint()) {
@@ -1098,6 +1144,40 @@ void Client::State::start(int argc, char* argv[])
     }
 }
 
+//------------------------------------------------------------------------------
+// Load (or generate again if they expired) the certificates of the domains
+// most recently visited in previous runs, one at a time and in the
+// background, so that the first handshakes with them do not pay for it.
+// Stale certificates are removed from the store first.
+void Client::State::prepare_mitm_certificates()
+{
+    auto& ios = _pool ? _pool->next() : _ios;
+
+    // Only keep `self` in the main thread, the last reference must not be
+    // dropped by a thread of the pool (it is joined before this goes away).
+    auto self = _pool ? nullptr : shared_from_this();
+
+    asio::spawn(ios, [this, &ios, self = move(self)]
+                     (asio::yield_context yield) {
+        auto& shutdown_signal = shutdown_signal_of(ios);
+
+        _mitm_context->prune_store();
+
+        for (auto& domain : _mitm_context->stored_domains(OUINET_MITM_CERTS_PREPARED)) {
+            // Let connections be served in between.
+            ios.post(yield);
+            if (shutdown_signal.call_count()) return;
+
+            try {
+                _mitm_context->prepare(domain);
+            }
+            catch (const std::exception& e) {
+                LOG_DEBUG("Failed to prepare certificate for ", domain, ": ", e.what());
+            }
+        }
+    });
+}
+
 //------------------------------------------------------------------------------
 void Client::State::setup_injector(asio::yield_context yield)
 {
@@ -2,6 +2,7 @@
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
+#include <thread>
 
 #include "namespaces.h"
 #include "util.h"
@@ -110,6 +111,16 @@ public:
             , po::value<string>()->default_value("btree")
             , "Default database type to use, can be either \"btree\" or \"bep44\"")
            ("disable-cache", "Disable all cache operations (even initialization)")
+           ("threads"
+            , po::value<unsigned int>()->default_value(1)
+            , "Number of threads serving browser connections (0: one per core). "
+              "Requests are still routed, fetched and cached in the main thread.")
+           ("mitm-key-type"
+            , po::value<string>()->default_value("rsa")
+            , "Key type of the certificates presented to the browser, can be either "
+              "\"rsa\" (use the key of the CA) or \"ecdsa\" (a P-256 key of their own "
+              "for browsers supporting it, which is cheaper in every handshake, "
+              "and RSA for the rest; this generates two certificates per domain)")
            ;
 
         return desc;
@@ -119,6 +130,12 @@ public:
 
     bool cache_enabled() const { return !_disable_cache; }
 
+    // Number of threads serving browser connections.
+    size_t threads() const { return _threads; }
+
+    // Whether to present ECDSA certificates to browsers supporting them.
+    bool mitm_ecdsa() const { return _mitm_ecdsa; }
+
 private:
     bool _is_help = false;
     fs::path _repo_root;
@@ -137,6 +154,8 @@ private:
 
     boost::optional<util::Ed25519PublicKey> _bt_pubkey;
     bool _disable_cache = false;
+    size_t _threads = 1;
+    bool _mitm_ecdsa = false;
 };
 
 inline
@@ -290,6 +309,28 @@ ClientConfig::ClientConfig(int argc, char* argv[])
     if (vm.count("disable-cache")) {
         _disable_cache = true;
     }
+
+    if (vm.count("threads")) {
+        _threads = vm["threads"].as<unsigned int>();
+
+        if (_threads == 0) {
+            _threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    if (vm.count("mitm-key-type")) {
+        auto type = vm["mitm-key-type"].as<string>();
+
+        if (type == "rsa") {
+            _mitm_ecdsa = false;
+        }
+        else if (type == "ecdsa") {
+            _mitm_ecdsa = true;
+        }
+        else {
+            throw std::runtime_error("Invalid value for --mitm-key-type");
+        }
+    }
 }
 
 inline
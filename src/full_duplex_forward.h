@@ -1,66 +1,295 @@
 #pragma once
 
-#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <array>
+#include <cerrno>
+#include <memory>
+#include <vector>
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <signal.h>
+#  include <unistd.h>
+#endif
+
 #include "generic_stream.h"
 #include "util/wait_condition.h"
 
 namespace ouinet {
 
+// Bytes forwarded by `full_duplex` in each direction.
+struct FullDuplexStats {
+    size_t from_c1 = 0;  // read from `c1` and written to `c2`
+    size_t from_c2 = 0;  // read from `c2` and written to `c1`
+};
+
+namespace full_duplex_detail {
+
+// Relay buffers start small (most tunnels carry little data) and grow
+// while reads fill them, up to `max_buffer_size`.
+static const size_t min_buffer_size = 2048;
+static const size_t max_buffer_size = 64 * 1024;
+
+/*
+ * Relay buffers no longer in use, by size, to be taken by other tunnels.
+ * There is one pool per thread, so no locking is needed.
+ */
+class BufferPool {
+public:
+    using Buffer = std::unique_ptr<uint8_t[]>;
+
+    static BufferPool& instance() {
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    Buffer get(size_t size) {
+        auto& free = _free[size_class(size)];
+        if (free.empty()) return Buffer(new uint8_t[size]);
+        auto b = std::move(free.back());
+        free.pop_back();
+        return b;
+    }
+
+    void put(Buffer b, size_t size) {
+        auto& free = _free[size_class(size)];
+        if (free.size() < max_free) free.push_back(std::move(b));
+    }
+
+private:
+    // Buffers of each size kept at most.
+    static const size_t max_free = 32;
+
+    // Sizes are powers of two from `min_buffer_size` to `max_buffer_size`.
+    static size_t size_class(size_t size) {
+        size_t c = 0;
+        for (size_t s = min_buffer_size; s < size; s *= 2) c++;
+        return c;
+    }
+
+    std::array<std::vector<Buffer>, 6> _free;
+};
+
+class RelayBuffer {
+public:
+    RelayBuffer()
+        : _size(min_buffer_size)
+        , _data(BufferPool::instance().get(_size))
+    {}
+
+    RelayBuffer(const RelayBuffer&) = delete;
+    RelayBuffer& operator=(const RelayBuffer&) = delete;
+
+    asio::mutable_buffer buffer() { return asio::buffer(_data.get(), _size); }
+
+    // Call with the amount of data read into the buffer.
+    void adapt(size_t length) {
+        if (length < _size || _size >= max_buffer_size) return;
+        BufferPool::instance().put(std::move(_data), _size);
+        _size *= 2;
+        _data = BufferPool::instance().get(_size);
+    }
+
+    ~RelayBuffer() {
+        BufferPool::instance().put(std::move(_data), _size);
+    }
+
+private:
+    size_t _size;
+    BufferPool::Buffer _data;
+};
+
 inline
-void full_duplex( GenericStream& c1
-                , GenericStream& c2
+void half_duplex( GenericStream& in
+                , GenericStream& out
+                , size_t& forwarded
                 , asio::yield_context yield)
 {
-    static const auto half_duplex
-        = []( GenericStream& in
-            , GenericStream& out
-            , asio::yield_context& yield)
-    {
-        sys::error_code ec;
-        std::array<uint8_t, 2048> data;
-
-        for (;;) {
-            // XXX: Workaround: For some reason calling in.async_read_some
-            // directly throws the boost::coroutines::detail::forced_unwind
-            // exception from GenericStream::async_read_some::result.get.
-            // When it's used indirectly through async_read then it doesn't.
-            //
-            // ¯\_(ツ)_/¯
-            //
-            //// size_t length = in.async_read_some(asio::buffer(data), yield[ec]);
-            size_t length = asio::async_read
-                ( in
-                , asio::buffer(data)
-                , [](const sys::error_code& ec, size_t size) -> size_t {
-                    if (ec) return 0;
-                    return size ? 0 : ~size_t(0);
-                  }
-                , yield[ec]);
+    sys::error_code ec;
+    RelayBuffer buffer;
 
-            if (ec) break;
+    for (;;) {
+        size_t length = in.async_read_some(buffer.buffer(), yield[ec]);
+        if (ec) break;
+
+        asio::async_write(out, asio::buffer(buffer.buffer(), length), yield[ec]);
+        if (ec) break;
+
+        forwarded += length;
+        buffer.adapt(length);
+    }
+}
+
+#ifdef __linux__
+/*
+ * `splice` from a pipe into a socket whose peer is gone raises SIGPIPE,
+ * which kills the process by default (unlike socket sends, there is no
+ * MSG_NOSIGNAL for it). So the signal is blocked in this thread for the
+ * call, and taken out of the pending ones if the call raised it.
+ */
+inline
+ssize_t splice_to_socket(int pipe_r, int socket, size_t length)
+{
+    sigset_t sigpipe, old_mask, pending;
+    ::sigemptyset(&sigpipe);
+    ::sigaddset(&sigpipe, SIGPIPE);
+
+    ::pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    // One already pending is not ours to take.
+    ::sigpending(&pending);
+    bool was_pending = ::sigismember(&pending, SIGPIPE);
+
+    ssize_t written = ::splice( pipe_r, nullptr
+                              , socket, nullptr
+                              , length
+                              , SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    int error = errno;
+
+    if (written < 0 && error == EPIPE && !was_pending) {
+        static const timespec no_wait = {0, 0};
+        ::sigtimedwait(&sigpipe, nullptr, &no_wait);
+    }
+
+    ::pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
 
-            asio::async_write(out, asio::buffer(data, length), yield[ec]);
+    errno = error;
+    return written;
+}
+
+/*
+ * Move data between two streams made of TCP sockets through a pipe with
+ * `splice`, so that it never gets copied to (and back from) user space.
+ * Return false if it could not be set up, with nothing read from `in`.
+ *
+ * The sockets are looked up again after every wait, since the streams
+ * may be closed (and their sockets gone) meanwhile.
+ */
+inline
+bool half_duplex_splice( GenericStream& in
+                       , GenericStream& out
+                       , size_t& forwarded
+                       , asio::yield_context yield)
+{
+    using tcp = asio::ip::tcp;
+
+    if (!in.tcp_socket() || !out.tcp_socket()) return false;
+
+    int pipe_fds[2];
+    if (::pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) return false;
+
+    int pipe_r = pipe_fds[0], pipe_w = pipe_fds[1];
+
+    // The default pipe size is already 64 KiB, try to get it at least.
+    ::fcntl(pipe_w, F_SETPIPE_SZ, int(max_buffer_size));
+
+    sys::error_code ec;
+
+    // Calls below should fail rather than block.
+    in.tcp_socket()->non_blocking(true, ec);
+    if (!ec) out.tcp_socket()->non_blocking(true, ec);
+
+    if (ec) {
+        ::close(pipe_r);
+        ::close(pipe_w);
+        return false;
+    }
+
+    for (;;) {
+        auto in_s = in.tcp_socket();
+        if (!in_s) break;
+
+        ssize_t length = ::splice( in_s->native_handle(), nullptr
+                                 , pipe_w, nullptr
+                                 , max_buffer_size
+                                 , SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (length == 0) break;  // end of stream
+
+        if (length < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+            in_s->async_wait(tcp::socket::wait_read, yield[ec]);
             if (ec) break;
+            continue;
         }
+
+        while (length > 0) {
+            auto out_s = out.tcp_socket();
+            if (!out_s) break;
+
+            ssize_t written = splice_to_socket( pipe_r
+                                              , out_s->native_handle()
+                                              , length);
+
+            if (written < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+                out_s->async_wait(tcp::socket::wait_write, yield[ec]);
+                if (ec) break;
+                continue;
+            }
+
+            length -= written;
+            forwarded += written;
+        }
+
+        if (length > 0) break;  // failed to write it all
+    }
+
+    ::close(pipe_r);
+    ::close(pipe_w);
+    return true;
+}
+#endif
+
+} // full_duplex_detail namespace
+
+/*
+ * Forward data read from each stream to the other one until both stop
+ * (e.g. because of end of stream or being closed).
+ *
+ * Between two plain TCP sockets in Linux, data is moved with `splice`
+ * without going through user space. Otherwise it is read into a buffer
+ * which grows with the pace of the data.
+ */
+inline
+FullDuplexStats full_duplex( GenericStream& c1
+                           , GenericStream& c2
+                           , asio::yield_context yield)
+{
+    namespace detail = full_duplex_detail;
+
+    const auto half_duplex = []( GenericStream& in
+                               , GenericStream& out
+                               , size_t& forwarded
+                               , asio::yield_context yield)
+    {
+#ifdef __linux__
+        if (detail::half_duplex_splice(in, out, forwarded, yield)) return;
+#endif
+        detail::half_duplex(in, out, forwarded, yield);
     };
 
     assert(&c1.get_io_service() == &c2.get_io_service());
 
+    FullDuplexStats stats;
     WaitCondition wait_condition(c1.get_io_service());
 
     asio::spawn
         ( yield
         , [&, lock = wait_condition.lock()](asio::yield_context yield) {
-              half_duplex(c1, c2, yield);
+              half_duplex(c1, c2, stats.from_c1, yield);
           });
 
     asio::spawn
         ( yield
         , [&, lock = wait_condition.lock()](asio::yield_context yield) {
-              half_duplex(c2, c1, yield);
+              half_duplex(c2, c1, stats.from_c2, yield);
           });
 
     wait_condition.wait(yield);
+
+    return stats;
 }
 
 } // ouinet namespace
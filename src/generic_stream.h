@@ -1,6 +1,7 @@
 #pragma once
 
 #include "namespaces.h"
+#include "util/handler_slot.h"
 
 #include <boost/system/error_code.hpp>
 #include <boost/asio/buffer.hpp>
@@ -8,9 +9,13 @@
 #include <boost/asio/async_result.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <array>
+#include <cassert>
 #include <functional>
-#include <vector>
 #include <iostream>
+#include <memory>
+#include <type_traits>
 
 namespace ouinet {
 
@@ -43,6 +48,73 @@ namespace generic_stream_detail {
 
     template<class T> T& deref(T& v) { return v; }
     template<class T> T& deref(std::unique_ptr<T>& v) { return *v; }
+
+    template<class T> asio::ip::tcp::socket* as_tcp_socket(T&) { return nullptr; }
+    inline asio::ip::tcp::socket* as_tcp_socket(asio::ip::tcp::socket& s) { return &s; }
+
+    // A copy of (at most `max_size` buffers of) a buffer sequence, without
+    // allocating. Reading or writing just the first buffers is fine for
+    // `async_*_some` operations. Asio does not send more than 64 buffers
+    // to the system in one go anyway.
+    template<class Buffer> struct BufferArray {
+        using value_type     = Buffer;
+        using const_iterator = const Buffer*;
+
+        static constexpr size_t max_size = 64;
+
+        template<class Sequence> void assign(const Sequence& bs) {
+            size = 0;
+            auto i = asio::buffer_sequence_begin(bs);
+            auto e = asio::buffer_sequence_end(bs);
+            for (; i != e && size < max_size; ++i) array[size++] = *i;
+        }
+
+        const_iterator begin() const { return array.data(); }
+        const_iterator end()   const { return array.data() + size; }
+
+        std::array<Buffer, max_size> array;
+        size_t size = 0;
+    };
+
+    // The completion handler passed to the wrapped stream. It keeps the
+    // stream alive while the operation is pending and has Asio allocate
+    // the operation in the slot.
+    template<class Base>
+    class Completion {
+    public:
+        Completion(std::shared_ptr<Base> base, util::HandlerSlot& slot)
+            : _base(std::move(base)), _slot(&slot) {}
+
+        Completion(Completion&& other)
+            : _base(std::move(other._base)), _slot(other._slot)
+        { other._slot = nullptr; }
+
+        Completion& operator=(Completion&&) = delete;
+
+        void operator()(const sys::error_code& ec, size_t n) {
+            auto slot = _slot;
+            _slot = nullptr;
+            // Keep the stream alive during the call.
+            auto base = std::move(_base);
+            (*slot)(ec, n);
+        }
+
+        // Asio destroys pending operations without calling them
+        // when the io_service goes away.
+        ~Completion() { if (_slot) _slot->reset(); }
+
+        friend void* asio_handler_allocate(size_t size, Completion* c) {
+            return c->_slot->allocate_op(size);
+        }
+
+        friend void asio_handler_deallocate(void* p, size_t, Completion* c) {
+            c->_slot->deallocate_op(p);
+        }
+
+    private:
+        std::shared_ptr<Base> _base;
+        util::HandlerSlot* _slot;
+    };
 } // namespace
 
 
@@ -61,11 +133,12 @@ public:
 #endif
 
 private:
-    using OnRead  = std::function<void(sys::error_code, size_t)>;
-    using OnWrite = std::function<void(sys::error_code, size_t)>;
+    struct Base;
 
-    using ReadBuffers  = std::vector<asio::mutable_buffer>;
-    using WriteBuffers = std::vector<asio::const_buffer>;
+    using Completion = generic_stream_detail::Completion<Base>;
+
+    using ReadBuffers  = generic_stream_detail::BufferArray<asio::mutable_buffer>;
+    using WriteBuffers = generic_stream_detail::BufferArray<asio::const_buffer>;
 
     struct Base {
         virtual asio::io_service& get_io_service() = 0;
@@ -73,15 +146,20 @@ private:
         virtual executor_type     get_executor() = 0;
 #endif
 
-        virtual void read_impl (OnRead&&)  = 0;
-        virtual void write_impl(OnWrite&&) = 0;
+        virtual void read_impl (Completion&&) = 0;
+        virtual void write_impl(Completion&&) = 0;
 
         virtual void close() = 0;
 
+        virtual asio::ip::tcp::socket* tcp_socket() = 0;
+
         virtual ~Base() {}
 
         ReadBuffers  read_buffers;
         WriteBuffers write_buffers;
+
+        util::HandlerSlot read_slot;
+        util::HandlerSlot write_slot;
     };
 
     template<class Impl>
@@ -111,12 +189,12 @@ private:
         }
 #endif
 
-        void read_impl(OnRead&& on_read) override
+        void read_impl(Completion&& on_read) override
         {
             _impl->async_read_some(read_buffers, std::move(on_read));
         }
 
-        void write_impl(OnWrite&& on_write) override
+        void write_impl(Completion&& on_write) override
         {
             _impl->async_write_some(write_buffers, std::move(on_write));
         }
@@ -126,6 +204,11 @@ private:
             _shutter(*_impl);
         }
 
+        asio::ip::tcp::socket* tcp_socket() override
+        {
+            return generic_stream_detail::as_tcp_socket(*_impl);
+        }
+
     private:
         generic_stream_detail::Deref<Impl> _impl;
         Shutter _shutter;
@@ -138,6 +221,13 @@ public:
 
     bool has_implementation() const { return _impl != nullptr; }
 
+    // The TCP socket this stream is directly made of, if that is the case.
+    // Otherwise (e.g. with TLS or I2P streams) null.
+    asio::ip::tcp::socket* tcp_socket()
+    {
+        return _impl ? _impl->tcp_socket() : nullptr;
+    }
+
 public:
     GenericStream() {
         if (_debug) {
@@ -261,27 +351,17 @@ public:
 
         boost::asio::async_completion<Token, Sig> init(token);
 
-        using Handler = std::decay_t<decltype(init.completion_handler)>;
-
-        // XXX: Handler is non-copyable, but can we do this without allocation?
-        auto handler = make_shared<Handler>(std::move(init.completion_handler));
-
         if (!_impl) {
-            return _ios->post([h = move(handler)]
-                              { (*h)(asio::error::bad_descriptor, 0); });
+            // Rare, so allocating here is fine (post needs a copyable handler).
+            using Handler = std::decay_t<decltype(init.completion_handler)>;
+            auto h = make_shared<Handler>(std::move(init.completion_handler));
+            _ios->post([h] { (*h)(asio::error::bad_descriptor, 0); });
+            return init.result.get();
         }
 
-        _impl->read_buffers.resize(distance( asio::buffer_sequence_begin(bs)
-                                           , asio::buffer_sequence_end(bs)));
-
-        copy( asio::buffer_sequence_begin(bs)
-            , asio::buffer_sequence_end(bs)
-            , _impl->read_buffers.begin());
-
-        _impl->read_impl([h = move(handler), impl = _impl]
-                         (const system::error_code& ec, size_t size) {
-                             (*h)(ec, size);
-                         });
+        _impl->read_buffers.assign(bs);
+        _impl->read_slot.emplace(std::move(init.completion_handler));
+        _impl->read_impl(Completion(_impl, _impl->read_slot));
 
         return init.result.get();
     }
@@ -305,27 +385,17 @@ public:
 
         boost::asio::async_completion<Token, Sig> init(token);
 
-        using Handler = std::decay_t<decltype(init.completion_handler)>;
-
-        // XXX: Handler is non-copyable, but can we do this without allocation?
-        auto handler = make_shared<Handler>(std::move(init.completion_handler));
-
         if (!_impl) {
-            return _ios->post([h = move(handler)]
-                              { (*h)(asio::error::bad_descriptor, 0); });
+            // Rare, so allocating here is fine (post needs a copyable handler).
+            using Handler = std::decay_t<decltype(init.completion_handler)>;
+            auto h = make_shared<Handler>(std::move(init.completion_handler));
+            _ios->post([h] { (*h)(asio::error::bad_descriptor, 0); });
+            return init.result.get();
         }
 
-        _impl->write_buffers.resize(distance( asio::buffer_sequence_begin(bs)
-                                            , asio::buffer_sequence_end(bs)));
-
-        copy( asio::buffer_sequence_begin(bs)
-            , asio::buffer_sequence_end(bs)
-            , _impl->write_buffers.begin());
-
-        _impl->write_impl([h = move(handler), impl = _impl]
-                          (const system::error_code& ec, size_t size) {
-                              (*h)(ec, size);
-                          });
+        _impl->write_buffers.assign(bs);
+        _impl->write_slot.emplace(std::move(init.completion_handler));
+        _impl->write_impl(Completion(_impl, _impl->write_slot));
 
         return init.result.get();
     }
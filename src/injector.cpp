@@ -38,6 +38,7 @@
 
 #include "util/timeout.h"
 #include "util/crypto.h"
+#include "util/io_service_pool.h"
 
 #include "logger.h"
 #include "defer.h"
@@ -71,6 +72,19 @@ using ConPools = map<PoolId, ConPool>;
 
 static const boost::filesystem::path OUINET_PID_FILE = "pid";
 
+//------------------------------------------------------------------------------
+// Everything a connection needs which must not be shared with connections
+// served by other threads. Each io_service serving connections has one.
+struct Worker {
+    asio::io_service& ios;
+    ConPools connection_pools;
+    uuid_generator genuuid;
+    // Closes the connections of this worker on shutdown.
+    Signal<void()> shutdown_signal;
+
+    Worker(asio::io_service& ios) : ios(ios) {}
+};
+
 //------------------------------------------------------------------------------
 static
 void handle_bad_request( GenericStream& con
@@ -150,7 +164,10 @@ void handle_connect_request( GenericStream& client_c
         return;
     }
 
-    full_duplex(client_c, origin_c, yield);
+    auto stats = full_duplex(client_c, origin_c, yield);
+
+    LOG_DEBUG("CONNECT tunnel to ", req.target(), " closed; bytes from client: "
+             , stats.from_c1, ", from origin: ", stats.from_c2);
 }
 
 //------------------------------------------------------------------------------
@@ -210,12 +227,16 @@ public:
     // TODO: Replace this with cancellation support in which fetch_ operations
     // get a signal parameter
     InjectorCacheControl( asio::io_service& ios
+                        , asio::io_service& cache_ios
                         , ConPools& connection_pools
                         , const InjectorConfig& config
                         , unique_ptr<CacheInjector>& injector
                         , uuid_generator& genuuid
                         , Signal<void()>& abort_signal)
-        : injector(injector)
+        : ios(ios)
+        , cache_ios(cache_ios)
+        , abort_signal(abort_signal)
+        , injector(injector)
         , config(config)
         , genuuid(genuuid)
         , cc("Ouinet Injector")
@@ -293,10 +314,9 @@ public:
     }
 
 private:
+    // The injector is only touched from `cache_ios`, see util::run_on.
     Response insert_content(Request rq, Response rs, Yield yield)
     {
-        if (!injector) return rs;
-
         // Recover and pop out synchronous injection toggle.
         bool sync = ( rq[http_::request_sync_injection_hdr]
                       == http_::request_sync_injection_true );
@@ -308,9 +328,11 @@ private:
         // This injection code logs errors but does not propagate them.
         auto inject = [
             rq, rs,
-            injector = injector.get(),
+            &injector = injector,
             db_type = config.default_db_type()
         ] (boost::asio::yield_context yield) mutable -> string {
+            if (!injector) return string();
+
             rq.erase(http_::request_sync_injection_hdr);
 
             sys::error_code ec;
@@ -333,12 +355,14 @@ private:
 
         if (sync) {
             // Zlib-compress descriptor, Base64-encode and put in header.
-            auto desc_data = inject(yield);
+            auto desc_data = util::run_on<string>( cache_ios, ios, move(inject)
+                                                 , abort_signal, yield);
+            if (desc_data.empty()) return rs;  // no injector
             auto compressed_desc = util::zlib_compress(move(desc_data));
             auto encoded_desc = util::base64_encode(move(compressed_desc));
             rs.set(http_::response_descriptor_hdr, move(encoded_desc));
         } else {
-            asio::spawn(asio::yield_context(yield), inject);
+            asio::spawn(cache_ios, move(inject));
         }
 
         return rs;
@@ -347,17 +371,25 @@ private:
     CacheEntry
     fetch_stored(const Request& rq, asio::yield_context yield)
     {
-        if (!injector)
-            return or_throw<CacheEntry>( yield
-                                       , asio::error::operation_not_supported);
-
-        // TODO: use string_view
-        return injector->get_content( rq.target().to_string()
-                                    , config.default_db_type()
-                                    , yield);
+        return util::run_on<CacheEntry>(cache_ios, ios, [
+            &injector = injector,
+            // TODO: use string_view
+            url = rq.target().to_string(),
+            db_type = config.default_db_type()
+        ] (asio::yield_context yield) {
+            if (!injector)
+                return or_throw<CacheEntry>( yield
+                                           , asio::error::operation_not_supported);
+
+            return injector->get_content(url, db_type, yield);
+        }, abort_signal, yield);
     }
 
 private:
+    asio::io_service& ios;
+    asio::io_service& cache_ios;
+    // Closes the connection of this worker on shutdown.
+    Signal<void()>& abort_signal;
     unique_ptr<CacheInjector>& injector;
     const InjectorConfig& config;
     uuid_generator& genuuid;
@@ -446,25 +478,28 @@ resolve_target( const Request& req
 }
 
 //------------------------------------------------------------------------------
+// Runs in the thread of `worker`, which is also that of `con`.
 static
 void serve( InjectorConfig& config
           , uint64_t connection_id
           , GenericStream con
+          , asio::io_service& cache_ios
           , unique_ptr<CacheInjector>& injector
-          , ConPools& connection_pools
-          , uuid_generator& genuuid
-          , Signal<void()>& close_connection_signal
+          , Worker& worker
           , asio::yield_context yield_)
 {
+    auto& close_connection_signal = worker.shutdown_signal;
+
     auto close_connection_slot = close_connection_signal.connect([&con] {
         con.close();
     });
 
     InjectorCacheControl cc( con.get_io_service()
-                           , connection_pools
+                           , cache_ios
+                           , worker.connection_pools
                            , config
                            , injector
-                           , genuuid
+                           , worker.genuuid
                            , close_connection_signal);
 
     for (;;) {
@@ -550,20 +585,39 @@ void serve( InjectorConfig& config
 }
 
 //------------------------------------------------------------------------------
+// Connections are served by the worker of the io_service they come with:
+// either one of the `pool` or (for those which can't be moved there) the
+// one of `proxy_server`, where the cache and everything else lives.
 static
 void listen( InjectorConfig& config
            , OuiServiceServer& proxy_server
+           , util::IoServicePool& pool
+           , list<Worker>& workers
            , unique_ptr<CacheInjector>& cache_injector
            , Signal<void()>& shutdown_signal
            , asio::yield_context yield)
 {
-    uuid_generator genuuid;
+    asio::io_service& ios = proxy_server.get_io_service();
 
-    auto stop_proxy_slot = shutdown_signal.connect([&proxy_server] {
+    auto worker_of = [&] (asio::io_service& ios) -> Worker& {
+        for (auto& w : workers) if (&w.ios == &ios) return w;
+        assert(0 && "Connection on an unknown io_service");
+        return workers.front();
+    };
+
+    if (pool.size()) {
+        proxy_server.distribute_connections([&pool] () -> asio::io_service& {
+            return pool.next();
+        });
+    }
+
+    auto stop_proxy_slot = shutdown_signal.connect([&proxy_server, &workers] {
         proxy_server.stop_listen();
-    });
 
-    asio::io_service& ios = proxy_server.get_io_service();
+        for (auto& w : workers) {
+            w.ios.post([&w] { w.shutdown_signal(); });
+        }
+    });
 
     sys::error_code ec;
     proxy_server.start_listen(yield[ec]);
@@ -572,12 +626,8 @@ void listen( InjectorConfig& config
         return;
     }
 
-    WaitCondition shutdown_connections(ios);
-
     uint64_t next_connection_id = 0;
 
-    ConPools connection_pools;
-
     while (true) {
         GenericStream connection = proxy_server.accept(yield[ec]);
         if (ec == boost::asio::error::operation_aborted) {
@@ -591,23 +641,22 @@ void listen( InjectorConfig& config
 
         uint64_t connection_id = next_connection_id++;
 
-        asio::spawn(ios, [
+        auto& worker = worker_of(connection.get_io_service());
+
+        asio::spawn(worker.ios, [
             connection = std::move(connection),
             &cache_injector,
-            &shutdown_signal,
+            &ios,
             &config,
-            &genuuid,
-            &connection_pools,
-            connection_id,
-            lock = shutdown_connections.lock()
+            &worker,
+            connection_id
         ] (boost::asio::yield_context yield) mutable {
             serve( config
                  , connection_id
                  , std::move(connection)
+                 , ios
                  , cache_injector
-                 , connection_pools
-                 , genuuid
-                 , shutdown_signal
+                 , worker
                  , yield);
         });
     }
@@ -665,7 +714,9 @@ int main(int argc, const char* argv[])
         cache_injector = make_unique<CacheInjector>
                                 ( ios
                                 , config.bt_private_key()
-                                , config.repo_root());
+                                , config.repo_root()
+                                , config.bep44_index_shard_bits()
+                                , config.dht_verification_threads());
 
         auto shutdown_ipfs_slot = shutdown_signal.connect([&] {
             cache_injector = nullptr;
@@ -701,14 +752,26 @@ int main(int argc, const char* argv[])
         proxy_server.add(std::move(i2p_server));
     }
 
+    // Connections being served refer to their worker, so these must outlive
+    // the threads of the pool.
+    list<Worker> workers;
+    workers.emplace_back(ios);
+
+    util::IoServicePool pool(config.threads() > 1 ? config.threads() : 0);
+    for (size_t i = 0; i < pool.size(); i++) workers.emplace_back(pool[i]);
+
     asio::spawn(ios, [
         &proxy_server,
+        &pool,
+        &workers,
         &cache_injector,
         &config,
         &shutdown_signal
     ] (asio::yield_context yield) {
         listen( config
               , proxy_server
+              , pool
+              , workers
               , cache_injector
               , shutdown_signal
               , yield);
@@ -727,5 +790,8 @@ int main(int argc, const char* argv[])
 
     ios.run();
 
+    // Let the other threads finish serving their connections.
+    pool.join();
+
     return EXIT_SUCCESS;
 }
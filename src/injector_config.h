@@ -1,5 +1,7 @@
 #pragma once
 
+#include <thread>
+
 #include "util/crypto.h"
 #include "cache/db.h"
 
@@ -43,8 +45,19 @@ public:
     DbType default_db_type() const
     { return _default_db_type; }
 
+    unsigned bep44_index_shard_bits() const
+    { return _bep44_index_shard_bits; }
+
+    // Number of threads verifying signatures of incoming DHT data.
+    size_t dht_verification_threads() const
+    { return _dht_verification_threads; }
+
     bool cache_enabled() const { return !_disable_cache; }
 
+    // Number of threads serving client connections.
+    size_t threads() const
+    { return _threads; }
+
 private:
     void setup_bt_private_key(const std::string& hex);
 
@@ -58,7 +71,10 @@ private:
     std::string _credentials;
     util::Ed25519PrivateKey _bt_private_key;
     DbType _default_db_type = DbType::btree;
+    unsigned _bep44_index_shard_bits = 0;
+    size_t _dht_verification_threads = 0;
     bool _disable_cache = false;
+    size_t _threads = 1;
 };
 
 inline
@@ -88,7 +104,19 @@ InjectorConfig::options_description()
         ("default-db"
          , po::value<string>()->default_value("btree")
          , "Default database type to use, can be either \"btree\" or \"bep44\"")
+        ("bep44-index-shard-bits"
+         , po::value<unsigned int>()->default_value(0)
+         , "Group BEP44 index entries into 2^N shared DHT items "
+           "instead of using one item per URL (0: one item per URL)")
+        ("dht-verification-threads"
+         , po::value<unsigned int>()->default_value(0)
+         , "Number of threads verifying signatures of BEP44 items "
+           "received from the DHT (0: verify them in the main thread)")
         ("disable-cache", "Disable all cache operations (even initialization)")
+        ("threads"
+         , po::value<unsigned int>()->default_value(1)
+         , "Number of threads serving client connections (0: one per core). "
+           "The cache always runs in the main thread.")
         ;
 
     return desc;
@@ -190,9 +218,25 @@ InjectorConfig::InjectorConfig(int argc, const char**argv)
         }
     }
 
+    if (vm.count("bep44-index-shard-bits")) {
+        _bep44_index_shard_bits = vm["bep44-index-shard-bits"].as<unsigned int>();
+    }
+
+    if (vm.count("dht-verification-threads")) {
+        _dht_verification_threads = vm["dht-verification-threads"].as<unsigned int>();
+    }
+
     if (vm.count("disable-cache")) {
         _disable_cache = true;
     }
+
+    if (vm.count("threads")) {
+        _threads = vm["threads"].as<unsigned int>();
+
+        if (_threads == 0) {
+            _threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
 }
 
 inline void InjectorConfig::setup_bt_private_key(const std::string& hex)
@@ -113,6 +113,8 @@ void Logger::log(log_level_t level, std::string msg, std::string function_name)
       msg += "\033[0m";
 #endif
 
+    std::lock_guard<std::mutex> lock(output_mutex);
+
     //time stamp
     if (_stamp_with_time) {
       msg = std::to_string(log_get_timestamp()) + ": " + msg;
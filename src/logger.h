@@ -17,6 +17,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <mutex>
 
 #include "namespaces.h"
 #include "util.h"
@@ -42,6 +43,8 @@ class Logger
     bool log_to_file;
     std::string log_filename;
     std::ofstream log_file;
+    // Messages may come from several threads.
+    std::mutex output_mutex;
 
     /************************* Time Functions **************************/
 
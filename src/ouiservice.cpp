@@ -43,7 +43,9 @@ void OuiServiceServer::start_listen(asio::yield_context yield)
             lock.release(true);
 
             while (true) {
-                GenericStream connection = implementation->accept(yield[ec]);
+                GenericStream connection = _next_io_service
+                    ? implementation->accept_on(_next_io_service(), yield[ec])
+                    : implementation->accept(yield[ec]);
                 /*
                  * TODO: Reconnect logic? There are errors other than operation_aborted.
                  */
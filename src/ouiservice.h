@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <list>
 #include <memory>
 #include <vector>
@@ -21,6 +22,17 @@ class OuiServiceImplementationServer
     virtual void stop_listen() = 0;
 
     virtual GenericStream accept(asio::yield_context yield) = 0;
+
+    /*
+     * Like accept(), but with the I/O of the new connection running on
+     * $ios. Implementations which can not move connections to another
+     * io_service return them on their own one.
+     */
+    virtual GenericStream accept_on( asio::io_service& ios
+                                   , asio::yield_context yield)
+    {
+        return accept(yield);
+    }
 };
 
 class OuiServiceServer
@@ -32,6 +44,17 @@ class OuiServiceServer
 
     void add(std::unique_ptr<OuiServiceImplementationServer> implementation);
 
+    /*
+     * Have each new connection run on the io_service returned by $next
+     * (where the implementation supports it). Must be called before
+     * start_listen(). The caller is then responsible for only touching
+     * accepted connections from their own io_service's thread.
+     */
+    void distribute_connections(std::function<asio::io_service&()> next)
+    {
+        _next_io_service = std::move(next);
+    }
+
     /*
      * TODO: Should this have start() and stop() in addition to *_listen()?
      */
@@ -46,6 +69,7 @@ class OuiServiceServer
     asio::io_service& _ios;
 
     std::vector<std::unique_ptr<OuiServiceImplementationServer>> _implementations;
+    std::function<asio::io_service&()> _next_io_service;
 
     Signal<void()> _stop_listen;
     std::list<GenericStream> _connection_queue;
@@ -48,10 +48,17 @@ void TcpOuiServiceServer::stop_listen()
 }
 
 GenericStream TcpOuiServiceServer::accept(asio::yield_context yield)
+{
+    return accept_on(_ios, yield);
+}
+
+GenericStream TcpOuiServiceServer::accept_on( asio::io_service& ios
+                                            , asio::yield_context yield)
 {
     sys::error_code ec;
 
-    asio::ip::tcp::socket socket(_ios);
+    // The acceptor may hand the socket over to another io_service.
+    asio::ip::tcp::socket socket(ios);
     _acceptor.async_accept(socket, yield[ec]);
 
     if (ec) {
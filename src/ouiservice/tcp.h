@@ -17,6 +17,8 @@ class TcpOuiServiceServer : public OuiServiceImplementationServer
     void stop_listen() override;
 
     GenericStream accept(asio::yield_context yield) override;
+    GenericStream accept_on( asio::io_service& ios
+                           , asio::yield_context yield) override;
 
     private:
     asio::io_service& _ios;
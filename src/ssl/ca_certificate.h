@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <openssl/x509v3.h>
 
@@ -22,6 +23,7 @@ public:
 
 private:
     friend class DummyCertificate;
+    friend class MitmContext;
 
     X509_NAME* get_subject_name() const;
     EVP_PKEY*  get_private_key() const;
@@ -38,7 +40,8 @@ private:
     std::string _pem_certificate;
     std::string _pem_dh_param;
 
-    unsigned long _next_serial_number;
+    // Certificates may be generated from several threads.
+    std::atomic<unsigned long> _next_serial_number;
 };
 
 } // namespace
@@ -2,13 +2,43 @@
 #include "ca_certificate.h"
 #include "util.h"
 
+#include <openssl/ec.h>
+#include <openssl/err.h>
+
 using namespace std;
 using namespace ouinet;
 
+// A new P-256 key, the curve most widely supported for ECDSA certificates.
+static EVP_PKEY* new_ecdsa_key()
+{
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!ctx) throw runtime_error("Failed in EVP_PKEY_CTX_new_id");
+
+    EVP_PKEY* pk = nullptr;
+
+    // Refer to the curve by name in the certificate, not by parameters.
+    bool ok = EVP_PKEY_keygen_init(ctx) > 0
+           && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0
+           && EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) > 0
+           && EVP_PKEY_keygen(ctx, &pk) > 0;
+
+    EVP_PKEY_CTX_free(ctx);
+
+    if (!ok) {
+        EVP_PKEY_free(pk);
+        throw runtime_error("Failed to generate ECDSA key");
+    }
+
+    return pk;
+}
+
 DummyCertificate::DummyCertificate( CACertificate& ca_cert
-                                  , const string& cn)
+                                  , const string& cn
+                                  , KeyType key_type)
     : _x(X509_new())
 {
+    if (key_type == KeyType::ecdsa) _pk = new_ecdsa_key();
+
     X509_set_version(_x, ca_cert.x509_version);
     ASN1_INTEGER_set(X509_get_serialNumber(_x), ca_cert.next_serial_number());
 
@@ -19,7 +49,7 @@ DummyCertificate::DummyCertificate( CACertificate& ca_cert
     // [Validity Period, 9.4.1](https://cabforum.org/wp-content/uploads/BRv1.2.3.pdf).
     X509_gmtime_adj(X509_get_notAfter(_x), 3 * ssl::util::ONE_YEAR);
 
-    X509_set_pubkey(_x, ca_cert.get_private_key());
+    X509_set_pubkey(_x, _pk ? _pk : ca_cert.get_private_key());
     
     string wc_cn("*." + cn);
     X509_NAME* name = X509_get_subject_name(_x); 
@@ -46,28 +76,79 @@ DummyCertificate::DummyCertificate( CACertificate& ca_cert
         _pem_certificate = ssl::util::read_bio(bio);
         BIO_free_all(bio);
     }
+
+    if (_pk) {
+        BIO* bio = BIO_new(BIO_s_mem());
+        PEM_write_bio_PrivateKey(bio, _pk, nullptr, nullptr, 0, nullptr, nullptr);
+        _pem_private_key = ssl::util::read_bio(bio);
+        BIO_free_all(bio);
+    }
 }
 
+DummyCertificate::DummyCertificate(string pem)
+{
+    BIO* bio = BIO_new_mem_buf((void*) pem.data(), pem.size());
+    _x = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+
+    if (!_x) {
+        BIO_free_all(bio);
+        throw runtime_error("Failed to parse PEM certificate");
+    }
+
+    auto key_offset = pem.size() - BIO_pending(bio);
+    _pk = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+    BIO_free_all(bio);
+
+    // No key after the certificate is fine, it uses the one of the CA.
+    if (!_pk) ERR_clear_error();
+
+    if (_pk && X509_check_private_key(_x, _pk) != 1) {
+        X509_free(_x);
+        EVP_PKEY_free(_pk);
+        throw runtime_error("PEM private key does not match the certificate");
+    }
+
+    _pem_private_key = _pk ? pem.substr(key_offset) : "";
+    pem.resize(key_offset);
+    _pem_certificate = move(pem);
+}
+
+bool DummyCertificate::is_usable(const CACertificate& ca_cert, long margin) const
+{
+    // Certificates signed by a previous CA would be rejected by browsers.
+    if (X509_verify(_x, ca_cert.get_private_key()) != 1) return false;
+
+    time_t limit = time(nullptr) + margin;
+    return X509_cmp_time(X509_get_notAfter(_x), &limit) > 0;
+}
 
 DummyCertificate::~DummyCertificate()
 {
     if (_x) X509_free(_x);
+    if (_pk) EVP_PKEY_free(_pk);
 }
 
 DummyCertificate::DummyCertificate(DummyCertificate&& other)
     : _x(other._x)
+    , _pk(other._pk)
     , _pem_certificate(move(other._pem_certificate))
+    , _pem_private_key(move(other._pem_private_key))
 {
     other._x = nullptr;
+    other._pk = nullptr;
 }
 
 DummyCertificate& DummyCertificate::operator=(DummyCertificate&& other)
 {
     if (_x) X509_free(_x);
+    if (_pk) EVP_PKEY_free(_pk);
 
     _x = other._x;
     other._x = nullptr;
+    _pk = other._pk;
+    other._pk = nullptr;
     _pem_certificate = move(other._pem_certificate);
+    _pem_private_key = move(other._pem_private_key);
 
     return *this;
 }
@@ -12,9 +12,20 @@ class CACertificate;
 
 class DummyCertificate {
 public:
+    enum class KeyType {
+        // Use the (RSA) key of the CA.
+        rsa,
+        // Use a new ECDSA P-256 key of its own, which makes handshakes
+        // much cheaper for the client, but some browsers may not support.
+        ecdsa
+    };
+
     // If `cn` is ``example.com``, this generates a certificate for
     // ``*.example.com`` with ``example.com`` as an alternative name.
-    DummyCertificate(CACertificate&, const std::string& cn);
+    DummyCertificate(CACertificate&, const std::string& cn, KeyType = KeyType::rsa);
+
+    // Parse a certificate generated earlier (see `pem()`).
+    DummyCertificate(std::string pem);
 
     DummyCertificate(const DummyCertificate&) = delete;
     DummyCertificate& operator=(const DummyCertificate&) = delete;
@@ -24,12 +35,26 @@ public:
 
     const std::string& pem_certificate() const { return _pem_certificate; }
 
+    // The certificate followed by its own private key, if any.
+    std::string pem() const { return _pem_certificate + _pem_private_key; }
+
+    X509* get_x509() const { return _x; }
+
+    // Null if the certificate uses the key of the CA.
+    EVP_PKEY* get_private_key() const { return _pk; }
+
+    // Whether it was signed by the given CA and is still valid
+    // for at least `margin` seconds.
+    bool is_usable(const CACertificate&, long margin) const;
+
     ~DummyCertificate();
 
 private:
     X509* _x;
+    EVP_PKEY* _pk = nullptr;
 
     std::string _pem_certificate;
+    std::string _pem_private_key;
 };
 
 } // namespace
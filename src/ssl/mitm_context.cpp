@@ -0,0 +1,356 @@
+#include "mitm_context.h"
+#include "ca_certificate.h"
+#include "dummy_certificate.h"
+
+#include "../util/bytes.h"
+
+#include <boost/filesystem.hpp>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+
+using namespace std;
+using namespace ouinet;
+
+namespace ssl = boost::asio::ssl;
+namespace fs = boost::filesystem;
+
+// Stored certificates are generated again when they expire before this
+// (in seconds).
+static const long STORED_CERT_MIN_VALIDITY = 30 * 24 * 60 * 60;
+
+// Stored ECDSA certificates are kept besides the RSA ones
+// in files with this suffix.
+static const string ECDSA_SUFFIX = ".ecdsa";
+
+// Only the most recently used certificates of each key type are kept
+// in the store, older ones are removed by `prune_store`.
+static const size_t MAX_STORED_CERTS = 1000;
+
+// The base domain a certificate was generated for, from its common name
+// ("*.example.com"), or an empty string if it has none such.
+static string certificate_domain(X509* x)
+{
+    char cn[256];
+    int len = X509_NAME_get_text_by_NID( X509_get_subject_name(x)
+                                       , NID_commonName, cn, sizeof(cn));
+
+    if (len < 2 || cn[0] != '*' || cn[1] != '.') return {};
+    return string(cn + 2, len - 2);
+}
+
+// Same as above for the certificate stored in the file at `path`.
+static string stored_domain(const fs::path& path)
+{
+    BIO* bio = BIO_new_file(path.string().c_str(), "r");
+    if (!bio) return {};
+
+    X509* x = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+    BIO_free_all(bio);
+    if (!x) return {};
+
+    auto domain = certificate_domain(x);
+    X509_free(x);
+    return domain;
+}
+
+// Index of the default host (a heap allocated string) in the ex_data of
+// connections, freed along with them.
+static int default_host_index()
+{
+    static int index = SSL_get_ex_new_index
+        ( 0, nullptr, nullptr, nullptr
+        , [] (void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+              delete static_cast<string*>(ptr);
+          });
+
+    return index;
+}
+
+MitmContext::MitmContext( CACertificate& ca_certificate
+                        , fs::path store_dir
+                        , bool ecdsa
+                        , size_t cache_size)
+    : _ca_certificate(ca_certificate)
+    , _context(ssl::context::tls_server)
+    , _store_dir(move(store_dir))
+    , _ecdsa(ecdsa)
+    , _cache(cache_size)
+{
+    if (!_store_dir.empty()) {
+        sys::error_code ec;
+        fs::create_directories(_store_dir, ec);
+        if (ec) _store_dir.clear();  // just do without it
+    }
+
+    _context.set_options( ssl::context::default_workarounds
+                        | ssl::context::no_sslv2
+                        | ssl::context::single_dh_use);
+
+    _context.set_password_callback(
+        [](std::size_t, ssl::context_base::password_purpose)
+        {
+            assert(0 && "TODO: Not yet supported");
+            return "";
+        });
+
+    // RSA leaf certificates use the key of the CA.
+    if (!SSL_CTX_use_PrivateKey(_context.native_handle(), _ca_certificate._pk)) {
+        throw runtime_error("Failed to set up the MitM private key");
+    }
+
+    // Sent along with every leaf certificate.
+    X509_up_ref(_ca_certificate._x);
+    if (!SSL_CTX_add_extra_chain_cert(_context.native_handle(), _ca_certificate._x)) {
+        X509_free(_ca_certificate._x);
+        throw runtime_error("Failed to set up the MitM certificate chain");
+    }
+
+    auto& dh = _ca_certificate.pem_dh_param();
+    _context.use_tmp_dh(asio::buffer(dh.data(), dh.size()));
+
+    SSL_CTX_set_tlsext_servername_callback(_context.native_handle(), on_server_name);
+    SSL_CTX_set_tlsext_servername_arg(_context.native_handle(), this);
+}
+
+void MitmContext::set_default_host(SSL* ssl, const string& host)
+{
+    auto index = default_host_index();
+    delete static_cast<string*>(SSL_get_ex_data(ssl, index));
+    SSL_set_ex_data(ssl, index, new string(host));
+}
+
+// Called for every handshake, whether the browser sent SNI or not.
+int MitmContext::on_server_name(SSL* ssl, int* alert, void* arg)
+{
+    auto self = static_cast<MitmContext*>(arg);
+
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+    if (!host) {
+        auto default_host = static_cast<string*>
+            (SSL_get_ex_data(ssl, default_host_index()));
+
+        if (!default_host) {
+            *alert = SSL_AD_UNRECOGNIZED_NAME;
+            return SSL_TLSEXT_ERR_ALERT_FATAL;
+        }
+
+        host = default_host->c_str();
+    }
+
+    auto domain = base_domain(host);
+    shared_ptr<DummyCertificate> rsa_cert, ecdsa_cert;
+
+    try {
+        rsa_cert = self->certificate_for(domain, KeyType::rsa);
+
+        if (self->_ecdsa) {
+            ecdsa_cert = self->certificate_for(domain, KeyType::ecdsa);
+        }
+    }
+    catch (const std::exception&) {
+        *alert = SSL_AD_INTERNAL_ERROR;
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+
+    // The connection takes its own references to the X509 and key objects.
+    // Certificates with different key types go to different slots, the one
+    // to use is chosen later from what the browser supports.
+    bool ok = SSL_use_certificate(ssl, rsa_cert->get_x509());
+
+    if (ok && ecdsa_cert) {
+        ok = SSL_use_certificate(ssl, ecdsa_cert->get_x509())
+          && SSL_use_PrivateKey(ssl, ecdsa_cert->get_private_key());
+    }
+
+    if (!ok) {
+        *alert = SSL_AD_INTERNAL_ERROR;
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+shared_ptr<DummyCertificate>
+MitmContext::certificate_for(const string& base_domain, KeyType key_type)
+{
+    auto key = (key_type == KeyType::ecdsa ? "ecdsa " : "rsa ") + base_domain;
+
+    {
+        lock_guard<mutex> lock(_cache_mutex);
+        if (auto cert = _cache.get(key)) return *cert;
+    }
+
+    // Loaded or generated without the lock,
+    // other connections need not wait for it.
+    auto cert = load(base_domain, key_type);
+
+    if (!cert) {
+        cert = make_shared<DummyCertificate>(_ca_certificate, base_domain, key_type);
+        store(base_domain, key_type, *cert);
+    }
+
+    lock_guard<mutex> lock(_cache_mutex);
+    _cache.put(key, cert);
+    return cert;
+}
+
+string MitmContext::base_domain(beast::string_view host)
+{
+    auto full_host = host.substr(0, host.rfind(':'));
+    size_t dot0, dot1 = 0;
+    if ((dot0 = full_host.find('.')) != full_host.rfind('.'))
+        // Two different dots were found
+        // (e.g. "www.example.com" but not "localhost" or "example.com").
+        dot1 = dot0 + 1;  // skip first component and dot (e.g. "www.")
+    return full_host.substr(dot1).to_string();
+}
+
+void MitmContext::prepare(const string& base_domain)
+{
+    certificate_for(base_domain, KeyType::rsa);
+    if (_ecdsa) certificate_for(base_domain, KeyType::ecdsa);
+}
+
+// Files are named after a hash of the domain keyed with the CA private key,
+// so that listing the store does not tell which sites were visited.
+fs::path MitmContext::store_path(const string& base_domain, KeyType key_type) const
+{
+    if (_store_dir.empty() || base_domain.empty()) return {};
+
+    auto& key = _ca_certificate.pem_private_key();
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+
+    if (!HMAC( EVP_sha256(), key.data(), key.size()
+             , reinterpret_cast<const unsigned char*>(base_domain.data())
+             , base_domain.size(), digest, &digest_size)) {
+        return {};
+    }
+
+    auto name = util::bytes::to_hex(string(reinterpret_cast<char*>(digest), digest_size));
+    auto suffix = key_type == KeyType::ecdsa ? ECDSA_SUFFIX : "";
+    return _store_dir / (name + suffix + ".pem");
+}
+
+shared_ptr<DummyCertificate>
+MitmContext::load(const string& base_domain, KeyType key_type)
+{
+    auto path = store_path(base_domain, key_type);
+    if (path.empty()) return nullptr;
+
+    sys::error_code ec;
+    if (!fs::exists(path, ec)) return nullptr;
+
+    shared_ptr<DummyCertificate> cert;
+
+    try {
+        stringstream ss;
+        ss << fs::ifstream(path).rdbuf();
+        cert = make_shared<DummyCertificate>(ss.str());
+    }
+    catch (const std::exception&) {
+        return nullptr;
+    }
+
+    if (!cert->is_usable(_ca_certificate, STORED_CERT_MIN_VALIDITY)) {
+        return nullptr;
+    }
+
+    // Only ECDSA certificates come with a key of their own.
+    if (bool(cert->get_private_key()) != (key_type == KeyType::ecdsa)) {
+        return nullptr;
+    }
+
+    if (certificate_domain(cert->get_x509()) != base_domain) return nullptr;
+
+    // Keep track of use for `stored_domains`.
+    fs::last_write_time(path, time(nullptr), ec);
+
+    return cert;
+}
+
+void MitmContext::store( const string& base_domain
+                       , KeyType key_type
+                       , const DummyCertificate& cert)
+{
+    auto path = store_path(base_domain, key_type);
+    if (path.empty()) return;
+
+    // Write to a temporary file first, so that a concurrent `load`
+    // (maybe from another thread) never sees it half written.
+    auto tmp_path = _store_dir / fs::unique_path("%%%%-%%%%-%%%%.tmp");
+
+    {
+        fs::ofstream out(tmp_path, ios::binary | ios::trunc);
+        out << cert.pem();
+        if (!out.good()) {
+            sys::error_code ec;
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+
+    sys::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec) fs::remove(tmp_path, ec);
+}
+
+void MitmContext::prune_store()
+{
+    for (auto key_type : {KeyType::rsa, KeyType::ecdsa}) {
+        auto files = stored_files(key_type);
+
+        for (size_t i = MAX_STORED_CERTS; i < files.size(); i++) {
+            sys::error_code ec;
+            fs::remove(files[i].second, ec);
+        }
+    }
+}
+
+vector<pair<time_t, fs::path>> MitmContext::stored_files(KeyType key_type) const
+{
+    vector<pair<time_t, fs::path>> found;
+
+    if (_store_dir.empty()) return found;
+
+    sys::error_code ec;
+    for (fs::directory_iterator it(_store_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        auto& path = it->path();
+        if (path.extension() != ".pem") continue;
+
+        bool is_ecdsa = path.stem().extension() == ECDSA_SUFFIX;
+        if (is_ecdsa != (key_type == KeyType::ecdsa)) continue;
+
+        sys::error_code ec_;
+        auto mtime = fs::last_write_time(path, ec_);
+        if (ec_) continue;
+
+        found.emplace_back(mtime, path);
+    }
+
+    sort(found.begin(), found.end(), [] (const auto& a, const auto& b) {
+        return a.first > b.first;
+    });
+
+    return found;
+}
+
+vector<string> MitmContext::stored_domains(size_t max) const
+{
+    vector<string> ret;
+
+    // Every domain has an RSA certificate, look just for those.
+    for (auto& f : stored_files(KeyType::rsa)) {
+        if (ret.size() == max) break;
+        auto domain = stored_domain(f.second);
+        if (!domain.empty()) ret.push_back(move(domain));
+    }
+
+    return ret;
+}
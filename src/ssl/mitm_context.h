@@ -0,0 +1,105 @@
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/filesystem/path.hpp>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../namespaces.h"
+#include "../util/lru_cache.h"
+#include "dummy_certificate.h"
+
+namespace ouinet {
+
+class CACertificate;
+
+/*
+ * The TLS server context used for all MitM connections of the client.
+ *
+ * The CA key, CA certificate (as the chain) and DH parameters are loaded
+ * once. The leaf certificate is picked during each handshake from the
+ * Server Name Indication sent by the browser, falling back to the host of
+ * the CONNECT request when there is none. Leaf certificates are generated
+ * on first use and kept parsed in an LRU cache.
+ *
+ * With `ecdsa`, an ECDSA certificate (with a key of its own) is offered
+ * besides the one using the RSA key of the CA, and OpenSSL picks the former
+ * for browsers which support it. Signing with it is much cheaper than with
+ * RSA, which matters on slow devices since it happens in every handshake,
+ * but it takes generating (and storing) two certificates per domain.
+ *
+ * If a store directory is given, generated certificates are also saved there
+ * (one PEM file per base domain and key type, named after a keyed hash of
+ * the domain) and loaded from it when first needed in later runs, so that
+ * signing is not repeated on every start. Stored certificates which are
+ * about to expire or were signed by another CA are generated again, and
+ * `prune_store` removes all but the most recently used ones.
+ *
+ * It may be used from several threads at once.
+ */
+class MitmContext {
+public:
+    using KeyType = DummyCertificate::KeyType;
+
+    MitmContext( CACertificate&
+               , boost::filesystem::path store_dir = {}
+               , bool ecdsa = false
+               , size_t cache_size = 1000);
+
+    MitmContext(const MitmContext&) = delete;
+    MitmContext& operator=(const MitmContext&) = delete;
+
+    asio::ssl::context& context() { return _context; }
+
+    // Use the certificate for `host` with this connection unless the
+    // browser asks for another one via SNI.
+    void set_default_host(SSL*, const std::string& host);
+
+    // "www.example.com" -> "example.com", the name certificates are
+    // generated for (it is valid for subdomains too). A trailing port is
+    // removed.
+    static std::string base_domain(beast::string_view host);
+
+    // Base domains of up to `max` stored certificates, most recently used
+    // first (use stands in for visits, it is cheaper to keep track of).
+    std::vector<std::string> stored_domains(size_t max) const;
+
+    // Have the certificate for `base_domain` loaded (or generated)
+    // ahead of the first handshake that needs it. This blocks.
+    void prepare(const std::string& base_domain);
+
+    // Remove the least recently used stored certificates beyond a limit.
+    // This lists the whole store, so it should only be done now and then
+    // and away from handshakes.
+    void prune_store();
+
+private:
+    static int on_server_name(SSL*, int*, void*);
+
+    std::shared_ptr<DummyCertificate> certificate_for(const std::string& base_domain, KeyType);
+
+    std::shared_ptr<DummyCertificate> load(const std::string& base_domain, KeyType);
+    void store(const std::string& base_domain, KeyType, const DummyCertificate&);
+
+    boost::filesystem::path store_path(const std::string& base_domain, KeyType) const;
+
+    // Stored certificate files, most recently used first.
+    std::vector<std::pair<std::time_t, boost::filesystem::path>>
+    stored_files(KeyType) const;
+
+private:
+    CACertificate& _ca_certificate;
+    asio::ssl::context _context;
+    boost::filesystem::path _store_dir;
+    bool _ecdsa;
+
+    std::mutex _cache_mutex;
+    // Keyed by key type and base domain.
+    util::LruCache<std::string, std::shared_ptr<DummyCertificate>> _cache;
+};
+
+} // namespace
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
@@ -9,6 +11,7 @@
 
 #include "../generic_stream.h"
 #include "../or_throw.h"
+#include "../util/lru_cache.h"
 #include "../util/signal.h"
 
 
@@ -43,10 +46,97 @@ static inline std::string read_bio(BIO* bio) {
     return std::string(data, length);
 };
 
+// TLS sessions last negotiated with origins, by host name. Offering one in
+// a new connection to the same host lets the server resume it with an
+// abbreviated handshake (no certificate exchange or verification, and one
+// round trip less before TLS 1.3).
+//
+// Sessions are collected from the new session callback of the client
+// context rather than after the handshake, since TLS 1.3 servers send
+// their tickets after it finishes.
+//
+// Connections share their session object with the cache, since OpenSSL
+// 1.1.0 (still used on Android) cannot copy sessions. OpenSSL marks the session
+// of a connection freed without a TLS shutdown as not resumable, so
+// client streams flag theirs as shut down when closed (see
+// `client_handshake`). A session which still ends up not resumable just
+// costs its host a full handshake, which brings a new session in.
+class ClientSessionCache {
+public:
+    using Session = std::shared_ptr<SSL_SESSION>;
+
+    static ClientSessionCache& instance()
+    {
+        static ClientSessionCache cache;
+        return cache;
+    }
+
+    Session get(const std::string& host)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto s = _sessions.get(host);
+        if (!s) return nullptr;
+        return *s;
+    }
+
+    void put(const std::string& host, SSL_SESSION* session)
+    {
+        // Without an identifier or a ticket there is nothing to resume.
+        unsigned int id_length = 0;
+        ::SSL_SESSION_get_id(session, &id_length);
+        if (id_length == 0 && !::SSL_SESSION_has_ticket(session)) return;
+
+        ::SSL_SESSION_up_ref(session);
+        Session s(session, ::SSL_SESSION_free);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sessions.put(host, std::move(s));
+    }
+
+private:
+    ClientSessionCache() : _sessions(1024) {}
+
+    std::mutex _mutex;
+    ouinet::util::LruCache<std::string, Session> _sessions;
+};
+
+// The context shared by all client handshakes, so that the system CA
+// store is only loaded once. Verification parameters which depend on the
+// host are set on each stream instead.
+inline
+boost::asio::ssl::context& client_context()
+{
+    namespace ssl = boost::asio::ssl;
+
+    static auto ctx = [] {
+        auto ctx = std::make_unique<ssl::context>(ssl::context::tls_client);
+
+        ctx->set_default_verify_paths();
+        ctx->set_verify_mode(ssl::verify_peer);
+
+        auto native = ctx->native_handle();
+
+        ::SSL_CTX_set_session_cache_mode( native
+                                        , SSL_SESS_CACHE_CLIENT
+                                        | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+        ::SSL_CTX_sess_set_new_cb(native, [] (SSL* ssl, SSL_SESSION* session) {
+            auto host = ::SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+            if (host) ClientSessionCache::instance().put(host, session);
+            return 0;  // the original stays with OpenSSL
+        });
+
+        return ctx;
+    }();
+
+    return *ctx;
+}
+
 // Perform an SSL client handshake over the given stream `con`
 // and return an SSL-tunneled stream using it as a lower layer.
 //
 // The verification is done for the given `host` name, using SNI.
+// A session previously established with `host` is offered for resumption.
 static inline
 ouinet::GenericStream
 client_handshake( ouinet::GenericStream&& con
@@ -58,20 +148,22 @@ client_handshake( ouinet::GenericStream&& con
     using namespace ouinet;
     namespace ssl = boost::asio::ssl;
 
-    // SSL contexts do not seem to be reusable.
-    ssl::context ssl_context{ssl::context::tls_client};
-    ssl_context.set_default_verify_paths();
-    ssl_context.set_verify_mode(ssl::verify_peer);
-    ssl_context.set_verify_callback(ssl::rfc2818_verification(host));
-
     boost::system::error_code ec;
 
-    auto ssl_sock = make_unique<ssl::stream<GenericStream>>(move(con), ssl_context);
+    auto ssl_sock = make_unique<ssl::stream<GenericStream>>(move(con), client_context());
+    ssl_sock->set_verify_callback(ssl::rfc2818_verification(host), ec);
+
     // Set Server Name Indication (SNI).
     // As seen in ``http_client_async_ssl.cpp`` Boost Beast example.
-    if (!::SSL_set_tlsext_host_name(ssl_sock->native_handle(), host.c_str()))
+    if (!ec && !::SSL_set_tlsext_host_name(ssl_sock->native_handle(), host.c_str()))
         ec = {static_cast<int>(::ERR_get_error()), boost::asio::error::get_ssl_category()};
 
+    if (!ec) {
+        if (auto session = ClientSessionCache::instance().get(host)) {
+            ::SSL_set_session(ssl_sock->native_handle(), session.get());
+        }
+    }
+
     if (!ec) {
         auto slot = abort_signal.connect([&] { ssl_sock->next_layer().close(); });
         ssl_sock->async_handshake(ssl::stream_base::client, yield[ec]);
@@ -81,7 +173,10 @@ client_handshake( ouinet::GenericStream&& con
 
     static const auto ssl_shutter = [](ssl::stream<GenericStream>& s) {
         // Just close the underlying connection
-        // (TLS has no message exchange for shutdown).
+        // (TLS has no message exchange for shutdown),
+        // but keep the session resumable for other connections.
+        ::SSL_set_shutdown( s.native_handle()
+                          , SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
         s.next_layer().close();
     };
 
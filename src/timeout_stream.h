@@ -1,14 +1,19 @@
 #pragma once
 
-#include <boost/asio/steady_timer.hpp>
 #include <boost/optional.hpp>
 
+#include "util/handler_slot.h"
+#include "util/timer_wheel.h"
+
 namespace ouinet {
 
 /*
  * A wrapper around any stream (such as the asio::tcp::socket)
  * that adds a timeout ability to reading and writing.
  *
+ * Deadlines are kept in the `util::TimerWheel` of the io_context,
+ * so streams do not need timers of their own.
+ *
  * Usage:
  *
  *     tcp::socket s = my_make_connected_socket(yield);
@@ -26,98 +31,32 @@ public:
     using endpoint_type = typename InnerStream::endpoint_type;
 
 private:
-    using Timer     = boost::asio::steady_timer;
-    using Clock     = typename Timer::clock_type;
-    using Duration  = typename Timer::duration;
-    using TimePoint = typename Timer::time_point;
-    using Handler   = std::function<void(const sys::error_code&, size_t)>;
-    using ConnectHandler = std::function<void(const sys::error_code&)>;
-
-    class Deadline : public std::enable_shared_from_this<Deadline> {
-        using Parent = std::enable_shared_from_this<Deadline>;
-    public:
-        Deadline(asio::io_context& ioc)
-            : _timer(ioc)
-        {}
-
-        void start(Duration d, std::function<void()> h)
-        {
-            _handler = std::move(h);
-
-            _desired_deadline = Clock::now() + d;
-
-            if (_expires_at) {
-                if (*_desired_deadline < _expires_at) {
-                    _timer.cancel();
-                }
-
-                return;
-            }
-
-            _expires_at = _desired_deadline;
-            _timer.expires_at(*_expires_at);
-
-            _timer.async_wait(
-                [this, self = Parent::shared_from_this()]
-                (const sys::error_code&) { on_timer(); });
-        }
-
-        void stop() {
-            _handler = nullptr;
-            _desired_deadline = boost::none;
-
-            if (_expires_at) {
-                _expires_at = Clock::now();
-                _timer.cancel();
-            }
-        }
-
-    private:
-        void on_timer() {
-            _expires_at = boost::none;
-
-            if (!_desired_deadline) {
-                return;
-            }
-
-            auto now = Clock::now();
-
-            if (now < *_desired_deadline) {
-                return start(*_desired_deadline - now, std::move(_handler));
-            }
-
-            auto h = std::move(_handler);
-            h();
-        }
-
-    private:
-        Timer _timer;
-        boost::optional<TimePoint> _expires_at;
-        boost::optional<TimePoint> _desired_deadline;
-        std::function<void()> _handler;
-    };
+    using Deadline  = util::TimerWheel::Deadline;
+    using Duration  = util::TimerWheel::Duration;
+    // Handlers may be move-only (e.g. those of GenericStream),
+    // connect handlers just ignore the size.
+    using Handler   = util::HandlerSlot;
 
     struct State {
         InnerStream inner;
 
-        // XXX: Use shared_ptr's aliasing constructor to avoid
-        // unnecessary allocations.
-        std::shared_ptr<Deadline> read_deadline;
-        std::shared_ptr<Deadline> write_deadline;
-        std::shared_ptr<Deadline> connect_deadline;
+        Deadline read_deadline;
+        Deadline write_deadline;
+        Deadline connect_deadline;
 
         Handler read_handler;
         Handler write_handler;
-        ConnectHandler connect_handler;
+        Handler connect_handler;
 
         State(InnerStream&& in)
             : inner(std::move(in))
-        {
-            auto& ctx = inner.get_executor().context();
+            , read_deadline(context())
+            , write_deadline(context())
+            , connect_deadline(context())
+        {}
 
-            read_deadline    = std::make_shared<Deadline>(ctx);
-            write_deadline   = std::make_shared<Deadline>(ctx);
-            connect_deadline = std::make_shared<Deadline>(ctx);
+        asio::io_context& context() {
+            return static_cast<asio::io_context&>(inner.get_executor().context());
         }
     };
 
@@ -136,6 +75,11 @@ public:
         return _state->inner.get_executor();
     }
 
+    asio::io_service& get_io_service()
+    {
+        return _state->context();
+    }
+
     template<class MutableBufferSequence, class Token>
     auto async_read_some(const MutableBufferSequence&, Token&&);
 
@@ -190,6 +134,12 @@ public:
         }
     }
 
+    void close()
+    {
+        sys::error_code ec;
+        close(ec);
+    }
+
           next_layer_type& next_layer()       { return _state->inner; }
     const next_layer_type& next_layer() const { return _state->inner; }
 
@@ -237,18 +187,17 @@ auto TimeoutStream<InnerStream>::async_read_some
 
     boost::asio::async_completion<Token, Sig> init(token);
 
-    _state->read_handler = std::move(init.completion_handler);
+    _state->read_handler.emplace(std::move(init.completion_handler));
 
-    setup_deadline(_max_read_duration, *_state->read_deadline, [s = _state] {
-        auto h = std::move(s->read_handler);
+    setup_deadline(_max_read_duration, _state->read_deadline, [s = _state] {
         s->inner.close();
-        h(asio::error::timed_out, 0);
+        s->read_handler(asio::error::timed_out, 0);
     });
 
     _state->inner.async_read_some( bs
                                  , [s = _state]
                                    (const sys::error_code& ec, size_t size) {
-                                       s->read_deadline->stop();
+                                       s->read_deadline.stop();
                                        if (s->read_handler)
                                            s->read_handler(ec, size);
                                    });
@@ -266,18 +215,17 @@ auto TimeoutStream<InnerStream>::async_write_some( const ConstBufferSequence& bs
 
     boost::asio::async_completion<Token, Sig> init(token);
 
-    _state->write_handler = std::move(init.completion_handler);
+    _state->write_handler.emplace(std::move(init.completion_handler));
 
-    setup_deadline(_max_write_duration, *_state->write_deadline, [s = _state] {
-        auto h = std::move(s->write_handler);
+    setup_deadline(_max_write_duration, _state->write_deadline, [s = _state] {
         s->inner.close();
-        h(asio::error::timed_out, 0);
+        s->write_handler(asio::error::timed_out, 0);
     });
 
     _state->inner.async_write_some( bs
                                   , [s = _state]
                                     (const sys::error_code& ec, size_t size) {
-                                        s->write_deadline->stop();
+                                        s->write_deadline.stop();
                                         if (s->write_handler)
                                             s->write_handler(ec, size);
                                     });
@@ -295,20 +243,21 @@ auto TimeoutStream<InnerStream>::async_connect
 
     boost::asio::async_completion<Token, Sig> init(token);
 
-    _state->connect_handler = std::move(init.completion_handler);
+    _state->connect_handler.emplace(
+        [h = std::move(init.completion_handler)]
+        (const sys::error_code& ec, size_t) mutable { h(ec); });
 
-    setup_deadline(_max_connect_duration, *_state->connect_deadline, [s = _state] {
-        auto h = std::move(s->connect_handler);
+    setup_deadline(_max_connect_duration, _state->connect_deadline, [s = _state] {
         s->inner.close();
-        h(asio::error::timed_out);
+        s->connect_handler(asio::error::timed_out, 0);
     });
 
     _state->inner.async_connect( ep
                                , [s = _state]
                                  (const sys::error_code& ec) {
-                                     s->connect_deadline->stop();
+                                     s->connect_deadline.stop();
                                      if (s->connect_handler)
-                                         s->connect_handler(ec);
+                                         s->connect_handler(ec, 0);
                                  });
 
     return init.result.get();
@@ -1,8 +1,10 @@
 #include "crypto.h"
 #include "bytes.h"
 
+#include <atomic>
 #include <cassert>
 #include <exception>
+#include <memory>
 #include <vector>
 
 extern "C" {
@@ -28,88 +30,80 @@ std::string random(unsigned int size)
     return std::string(buffer.data(), buffer.size());
 }
 
-Ed25519PublicKey::Ed25519PublicKey(std::array<uint8_t, 32> key):
-    _public_key(nullptr)
+/*
+ * Build an s-expression, wrapped so that it is released along with the last
+ * key referring to it.
+ */
+template<class... Args>
+static std::shared_ptr<::gcry_sexp> build_shared_sexp(const char* format, Args... args)
 {
-    if (::gcry_sexp_build(&_public_key, NULL, "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))", key.size(), key.data())) {
+    ::gcry_sexp_t sexp;
+    if (::gcry_sexp_build(&sexp, NULL, format, args...)) {
         throw std::exception();
     }
+    return std::shared_ptr<::gcry_sexp>(sexp, ::gcry_sexp_release);
 }
 
-Ed25519PublicKey::~Ed25519PublicKey()
+/*
+ * Return what $cache holds, first filling it with build() if it is empty.
+ *
+ * Copies of a key may be used from different threads (e.g. to verify
+ * signatures off the io_service thread). When several of them build at the
+ * same time, the first one to publish wins and the others use its value, so
+ * that nothing a thread got from here is released under its feet as long
+ * as it holds the returned pointer.
+ */
+template<class T, class Build>
+static std::shared_ptr<T> load_or_build(std::shared_ptr<T>& cache, Build build)
 {
-    if (_public_key) {
-        ::gcry_sexp_release(_public_key);
-        _public_key = nullptr;
-    }
-}
+    auto cached = std::atomic_load(&cache);
+    if (cached) return cached;
 
-Ed25519PublicKey::Ed25519PublicKey(const Ed25519PublicKey& other):
-    _public_key(nullptr)
-{
-    (*this) = other;
+    auto built = build();
+
+    // On failure, this loads the winner into `cached`.
+    if (std::atomic_compare_exchange_strong(&cache, &cached, built)) {
+        return built;
+    }
+    return cached;
 }
 
-Ed25519PublicKey::Ed25519PublicKey(Ed25519PublicKey&& other):
-    _public_key(nullptr)
+Ed25519PublicKey::Ed25519PublicKey(std::array<uint8_t, 32> key):
+    _key(key)
 {
-    (*this) = other;
 }
 
-boost::optional<Ed25519PublicKey>
-Ed25519PublicKey::from_hex(boost::string_view hex)
+Ed25519PublicKey::Ed25519PublicKey(const Ed25519PublicKey& other):
+    _key(other._key),
+    _sexp(std::atomic_load(&other._sexp))
 {
-    if (hex.size() != 64 || !util::bytes::is_hex(hex)) {
-        return boost::none;
-    }
-
-    return Ed25519PublicKey(
-            util::bytes::to_array<uint8_t, 32>(util::bytes::from_hex(hex)));
 }
 
 Ed25519PublicKey& Ed25519PublicKey::operator=(const Ed25519PublicKey& other)
 {
-    if (this != &other) {
-        if (_public_key) {
-            ::gcry_sexp_release(_public_key);
-            _public_key = nullptr;
-        }
-
-        if (other._public_key) {
-            if (::gcry_sexp_build(&_public_key, NULL, "%S", other._public_key)) {
-                _public_key = nullptr;
-                throw std::exception();
-            }
-        }
-    }
+    _key = other._key;
+    std::atomic_store(&_sexp, std::atomic_load(&other._sexp));
     return *this;
 }
 
-Ed25519PublicKey& Ed25519PublicKey::operator=(Ed25519PublicKey&& other)
+std::shared_ptr<::gcry_sexp> Ed25519PublicKey::sexp() const
 {
-    if (this != &other) {
-        std::swap(_public_key, other._public_key);
-    }
-    return *this;
+    return load_or_build(_sexp, [&] {
+        return build_shared_sexp(
+            "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))",
+            _key.size(), _key.data());
+    });
 }
 
-std::array<uint8_t, 32> Ed25519PublicKey::serialize() const
+boost::optional<Ed25519PublicKey>
+Ed25519PublicKey::from_hex(boost::string_view hex)
 {
-    ::gcry_sexp_t q = ::gcry_sexp_find_token(_public_key, "q", 0);
-    if (!q) {
-        throw std::exception();
-    }
-    size_t q_size;
-    const char* q_buffer = ::gcry_sexp_nth_data(q, 1, &q_size);
-    if (!q_buffer) {
-        ::gcry_sexp_release(q);
-        throw std::exception();
+    if (hex.size() != 64 || !util::bytes::is_hex(hex)) {
+        return boost::none;
     }
-    std::array<uint8_t, 32> output;
-    assert(q_size == output.size());
-    memcpy(output.data(), q_buffer, output.size());
-    ::gcry_sexp_release(q);
-    return output;
+
+    return Ed25519PublicKey(
+            util::bytes::to_array<uint8_t, 32>(util::bytes::from_hex(hex)));
 }
 
 bool Ed25519PublicKey::verify(const std::string& data, const std::array<uint8_t, 64>& signature) const
@@ -125,7 +119,8 @@ bool Ed25519PublicKey::verify(const std::string& data, const std::array<uint8_t,
         throw std::exception();
     }
 
-    ::gcry_error_t error = gcry_pk_verify(signature_sexp, data_sexp, _public_key);
+    auto key_sexp = sexp();
+    ::gcry_error_t error = gcry_pk_verify(signature_sexp, data_sexp, key_sexp.get());
 
     ::gcry_sexp_release(data_sexp);
     ::gcry_sexp_release(signature_sexp);
@@ -136,76 +131,32 @@ bool Ed25519PublicKey::verify(const std::string& data, const std::array<uint8_t,
 
 
 Ed25519PrivateKey::Ed25519PrivateKey(std::array<uint8_t, 32> key):
-    _private_key(nullptr)
+    _key(key)
 {
-    if (::gcry_sexp_build(&_private_key, NULL, "(private-key (ecc (curve Ed25519) (flags eddsa) (d %b)))", key.size(), key.data())) {
-        throw std::exception();
-    }
-}
-
-Ed25519PrivateKey::~Ed25519PrivateKey()
-{
-    if (_private_key) {
-        ::gcry_sexp_release(_private_key);
-        _private_key = nullptr;
-    }
 }
 
 Ed25519PrivateKey::Ed25519PrivateKey(const Ed25519PrivateKey& other):
-    _private_key(nullptr)
-{
-    (*this) = other;
-}
-
-Ed25519PrivateKey::Ed25519PrivateKey(Ed25519PrivateKey&& other):
-    _private_key(nullptr)
+    _key(other._key),
+    _sexp(std::atomic_load(&other._sexp)),
+    _public_key(std::atomic_load(&other._public_key))
 {
-    (*this) = other;
 }
 
 Ed25519PrivateKey& Ed25519PrivateKey::operator=(const Ed25519PrivateKey& other)
 {
-    if (this != &other) {
-        if (_private_key) {
-            ::gcry_sexp_release(_private_key);
-            _private_key = nullptr;
-        }
-
-        if (other._private_key) {
-            if (::gcry_sexp_build(&_private_key, NULL, "%S", other._private_key)) {
-                _private_key = nullptr;
-                throw std::exception();
-            }
-        }
-    }
+    _key = other._key;
+    std::atomic_store(&_sexp, std::atomic_load(&other._sexp));
+    std::atomic_store(&_public_key, std::atomic_load(&other._public_key));
     return *this;
 }
 
-Ed25519PrivateKey& Ed25519PrivateKey::operator=(Ed25519PrivateKey&& other)
+std::shared_ptr<::gcry_sexp> Ed25519PrivateKey::sexp() const
 {
-    if (this != &other) {
-        std::swap(_private_key, other._private_key);
-    }
-    return *this;
-}
-
-std::array<uint8_t, 32> Ed25519PrivateKey::serialize() const
-{
-    ::gcry_sexp_t d = ::gcry_sexp_find_token(_private_key, "d", 0);
-    if (!d) {
-        throw std::exception();
-    }
-    size_t d_size;
-    const char* d_buffer = ::gcry_sexp_nth_data(d, 1, &d_size);
-    if (!d_buffer) {
-        ::gcry_sexp_release(d);
-        throw std::exception();
-    }
-    std::array<uint8_t, 32> output;
-    assert(d_size == output.size());
-    memcpy(output.data(), d_buffer, output.size());
-    ::gcry_sexp_release(d);
-    return output;
+    return load_or_build(_sexp, [&] {
+        return build_shared_sexp(
+            "(private-key (ecc (curve Ed25519) (flags eddsa) (d %b)))",
+            _key.size(), _key.data());
+    });
 }
 
 boost::optional<Ed25519PrivateKey>
@@ -220,12 +171,20 @@ Ed25519PrivateKey::from_hex(boost::string_view hex)
 }
 
 Ed25519PublicKey Ed25519PrivateKey::public_key() const
+{
+    return *load_or_build(_public_key, [&] {
+        return std::make_shared<const Ed25519PublicKey>(derive_public_key());
+    });
+}
+
+Ed25519PublicKey::key_type Ed25519PrivateKey::derive_public_key() const
 {
     /*
      * This logic is even less well documented than the rest of gcrypt.
      */
+    auto key_sexp = sexp();
     ::gcry_ctx_t public_key_parameters;
-    if (::gcry_mpi_ec_new(&public_key_parameters, _private_key, NULL)) {
+    if (::gcry_mpi_ec_new(&public_key_parameters, key_sexp.get(), NULL)) {
         throw std::exception();
     }
     ::gcry_sexp_t public_key_sexp;
@@ -252,7 +211,7 @@ Ed25519PublicKey Ed25519PrivateKey::public_key() const
     memcpy(public_key.data(), q_buffer, public_key.size());
     ::gcry_sexp_release(q);
 
-    return Ed25519PublicKey(public_key);
+    return public_key;
 }
 
 Ed25519PrivateKey Ed25519PrivateKey::generate()
@@ -296,8 +255,9 @@ std::array<uint8_t, 64> Ed25519PrivateKey::sign(const std::string& data) const
         throw std::exception();
     }
 
+    auto key_sexp = sexp();
     ::gcry_sexp_t signature_sexp;
-    if (::gcry_pk_sign(&signature_sexp, data_sexp, _private_key)) {
+    if (::gcry_pk_sign(&signature_sexp, data_sexp, key_sexp.get())) {
         ::gcry_sexp_release(data_sexp);
         throw std::exception();
     }
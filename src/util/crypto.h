@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/optional.hpp>
+#include <memory>
 #include "sha1.h"
 
 /*
@@ -16,17 +17,27 @@ void crypto_init();
 
 std::string random(unsigned int size);
 
+/*
+ * Keys are kept in their raw 32 byte form, so copying and serializing them is
+ * cheap. The libgcrypt representation is only built the first time it is
+ * needed, and then shared (read only) by every copy of the key.
+ *
+ * Different copies of a key may be used from different threads.
+ */
 class Ed25519PublicKey {
     public:
-    Ed25519PublicKey(std::array<uint8_t, 32> key = {});
-    ~Ed25519PublicKey();
+    using key_type = std::array<uint8_t, 32>;
 
-    Ed25519PublicKey(const Ed25519PublicKey& other);
-    Ed25519PublicKey(Ed25519PublicKey&& other);
-    Ed25519PublicKey& operator=(const Ed25519PublicKey& other);
-    Ed25519PublicKey& operator=(Ed25519PublicKey&& other);
+    Ed25519PublicKey(key_type key = {});
 
-    std::array<uint8_t, 32> serialize() const;
+    Ed25519PublicKey(const Ed25519PublicKey&);
+    Ed25519PublicKey& operator=(const Ed25519PublicKey&);
+    // A key being moved from is not shared with other threads,
+    // so moves need no atomic operations.
+    Ed25519PublicKey(Ed25519PublicKey&&) = default;
+    Ed25519PublicKey& operator=(Ed25519PublicKey&&) = default;
+
+    std::array<uint8_t, 32> serialize() const { return _key; }
 
     bool verify(const std::string& data, const std::array<uint8_t, 64>& signature) const;
 
@@ -34,20 +45,25 @@ class Ed25519PublicKey {
     boost::optional<Ed25519PublicKey> from_hex(boost::string_view);
 
     private:
-    ::gcry_sexp_t _public_key;
+    std::shared_ptr<::gcry_sexp> sexp() const;
+
+    private:
+    key_type _key;
+    mutable std::shared_ptr<::gcry_sexp> _sexp;
 };
 
 class Ed25519PrivateKey {
     public:
-    Ed25519PrivateKey(std::array<uint8_t, 32> key = {});
-    ~Ed25519PrivateKey();
+    using key_type = std::array<uint8_t, 32>;
+
+    Ed25519PrivateKey(key_type key = {});
 
-    Ed25519PrivateKey(const Ed25519PrivateKey& other);
-    Ed25519PrivateKey(Ed25519PrivateKey&& other);
-    Ed25519PrivateKey& operator=(const Ed25519PrivateKey& other);
-    Ed25519PrivateKey& operator=(Ed25519PrivateKey&& other);
+    Ed25519PrivateKey(const Ed25519PrivateKey&);
+    Ed25519PrivateKey& operator=(const Ed25519PrivateKey&);
+    Ed25519PrivateKey(Ed25519PrivateKey&&) = default;
+    Ed25519PrivateKey& operator=(Ed25519PrivateKey&&) = default;
 
-    std::array<uint8_t, 32> serialize() const;
+    std::array<uint8_t, 32> serialize() const { return _key; }
     Ed25519PublicKey public_key() const;
 
     static Ed25519PrivateKey generate();
@@ -58,7 +74,14 @@ class Ed25519PrivateKey {
     boost::optional<Ed25519PrivateKey> from_hex(boost::string_view);
 
     private:
-    ::gcry_sexp_t _private_key;
+    std::shared_ptr<::gcry_sexp> sexp() const;
+    Ed25519PublicKey::key_type derive_public_key() const;
+
+    private:
+    key_type _key;
+    mutable std::shared_ptr<::gcry_sexp> _sexp;
+    // Deriving the public key is expensive, so it is only done once.
+    mutable std::shared_ptr<const Ed25519PublicKey> _public_key;
 };
 
 std::ostream& operator<<(std::ostream&, const Ed25519PublicKey&);
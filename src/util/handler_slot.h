@@ -0,0 +1,124 @@
+#pragma once
+
+#include <boost/system/error_code.hpp>
+#include <cassert>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include "../namespaces.h"
+
+namespace ouinet { namespace util {
+
+// Holds the handler of the one pending read (or write) operation of a
+// stream, along with the memory Asio needs for the operation passed
+// down to the wrapped stream.
+//
+// Memory is not freed when operations complete, the next operation
+// reuses it. Handlers of the usual size (e.g. from a coroutine) and the
+// operations of sockets fit in the inline storage, so once a stream is
+// running no memory is allocated per operation.
+class HandlerSlot {
+public:
+    HandlerSlot() = default;
+    HandlerSlot(const HandlerSlot&) = delete;
+    HandlerSlot& operator=(const HandlerSlot&) = delete;
+
+    template<class Handler>
+    void emplace(Handler&& h) {
+        using H = std::decay_t<Handler>;
+
+        assert(!_handler && "Only one operation may be pending");
+
+        void* p = sizeof(H) <= sizeof(_handler_storage)
+                ? static_cast<void*>(&_handler_storage)
+                : _handler_heap.get(sizeof(H));
+
+        _handler = new (p) H(std::forward<Handler>(h));
+
+        _invoke = [] (HandlerSlot& slot, sys::error_code ec, size_t n) {
+            auto hp = static_cast<H*>(slot._handler);
+            // Free the slot before the call, since the handler may
+            // start another operation right away.
+            H h(std::move(*hp));
+            hp->~H();
+            slot._handler = nullptr;
+            h(ec, n);
+        };
+
+        _destroy = [] (void* hp) { static_cast<H*>(hp)->~H(); };
+    }
+
+    void operator()(sys::error_code ec, size_t n) {
+        assert(_handler);
+        _invoke(*this, ec, n);
+    }
+
+    // Whether there is a handler waiting to be called.
+    explicit operator bool() const { return _handler != nullptr; }
+
+    // Destroy the handler without calling it.
+    void reset() {
+        if (!_handler) return;
+        _destroy(_handler);
+        _handler = nullptr;
+    }
+
+    void* allocate_op(size_t size) {
+        if (!_op_inline_used && size <= sizeof(_op_storage)) {
+            _op_inline_used = true;
+            return &_op_storage;
+        }
+        if (!_op_heap_used) {
+            _op_heap_used = true;
+            return _op_heap.get(size);
+        }
+        // Composed operations may need more blocks at once.
+        return ::operator new(size);
+    }
+
+    void deallocate_op(void* p) {
+        if (p == &_op_storage)           { _op_inline_used = false; }
+        else if (p == _op_heap.data())   { _op_heap_used = false; }
+        else                             { ::operator delete(p); }
+    }
+
+    ~HandlerSlot() { reset(); }
+
+private:
+    // A heap block which is only ever enlarged.
+    class Block {
+    public:
+        void* get(size_t size) {
+            if (size > _size) {
+                _data.reset(static_cast<char*>(::operator new(size)));
+                _size = size;
+            }
+            return _data.get();
+        }
+
+        void* data() const { return _data.get(); }
+
+    private:
+        struct Delete { void operator()(char* p) { ::operator delete(p); } };
+        std::unique_ptr<char, Delete> _data;
+        size_t _size = 0;
+    };
+
+    using Invoke = void(*)(HandlerSlot&, sys::error_code, size_t);
+    using Destroy = void(*)(void*);
+
+    void* _handler = nullptr;
+    Invoke _invoke = nullptr;
+    Destroy _destroy = nullptr;
+
+    std::aligned_storage_t<128> _handler_storage;
+    Block _handler_heap;
+
+    std::aligned_storage_t<256> _op_storage;
+    bool _op_inline_used = false;
+    Block _op_heap;
+    bool _op_heap_used = false;
+};
+
+}} // namespaces
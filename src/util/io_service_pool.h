@@ -0,0 +1,153 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../namespaces.h"
+#include "../or_throw.h"
+#include "condition_variable.h"
+#include "signal.h"
+
+namespace ouinet { namespace util {
+
+/*
+ * A fixed set of io_services, each run by a thread of its own, to spread
+ * independent work (like serving different connections) across cores.
+ *
+ * Handlers posted to one of the io_services always run in the same thread,
+ * so code confined to it needs no locking. Anything shared between them
+ * must be reached by posting to the io_service which owns it.
+ *
+ * The threads keep running until stop() is called (or the pool is
+ * destroyed), even if their io_service runs out of work.
+ */
+class IoServicePool {
+public:
+    IoServicePool(size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            auto ios = std::make_unique<asio::io_service>();
+            _work.push_back(std::make_unique<asio::io_service::work>(*ios));
+            _services.push_back(std::move(ios));
+        }
+
+        for (auto& ios : _services) {
+            _threads.emplace_back([ios = ios.get()] { ios->run(); });
+        }
+    }
+
+    IoServicePool(const IoServicePool&) = delete;
+    IoServicePool& operator=(const IoServicePool&) = delete;
+
+    size_t size() const { return _services.size(); }
+
+    asio::io_service& operator[](size_t i) { return *_services[i]; }
+
+    // Hand out the io_services in turn.
+    asio::io_service& next()
+    {
+        assert(!_services.empty());
+        auto& ios = *_services[_next];
+        _next = (_next + 1) % _services.size();
+        return ios;
+    }
+
+    // Let the threads finish once their io_services run out of work.
+    void stop()
+    {
+        _work.clear();
+    }
+
+    // Stop and wait for the threads.
+    void join()
+    {
+        stop();
+
+        for (auto& thread : _threads) {
+            if (thread.joinable()) thread.join();
+        }
+    }
+
+    ~IoServicePool()
+    {
+        for (auto& ios : _services) ios->stop();
+        join();
+    }
+
+private:
+    std::vector<std::unique_ptr<asio::io_service>> _services;
+    std::vector<std::unique_ptr<asio::io_service::work>> _work;
+    std::vector<std::thread> _threads;
+    size_t _next = 0;
+};
+
+/*
+ * Run `f` in a new coroutine on `target` and wait for its result from a
+ * coroutine running on `ios`. This is how code running in one of the
+ * threads of an IoServicePool reaches state owned by another io_service.
+ *
+ * The wait keeps `ios` running. When `cancel` (a signal of `ios`) is
+ * called, it ends with operation_aborted, so that shutdown does not hang
+ * on a `target` which no longer runs. `f` itself may still run after
+ * that, so it must not refer to anything on the stack of the caller.
+ */
+template<class R, class F>
+inline
+R run_on( asio::io_service& target
+        , asio::io_service& ios
+        , F f
+        , Signal<void()>& cancel
+        , asio::yield_context yield)
+{
+    if (&target == &ios) return f(yield);
+
+    if (cancel.call_count()) {
+        return or_throw<R>(yield, asio::error::operation_aborted);
+    }
+
+    // Shared with `f`, which may outlive this call.
+    struct State {
+        sys::error_code ec;
+        R result;
+        bool done = false;
+        ConditionVariable cv;
+
+        State(asio::io_service& ios) : cv(ios) {}
+    };
+
+    auto state = std::make_shared<State>(ios);
+
+    asio::spawn(target, [state, &ios, f = std::move(f)]
+                        (asio::yield_context target_yield) mutable {
+        sys::error_code ec;
+        R result = f(target_yield[ec]);
+
+        ios.post([state, ec, result = std::move(result)] () mutable {
+            state->ec = ec;
+            state->result = std::move(result);
+            state->done = true;
+            state->cv.notify();
+        });
+    });
+
+    auto cancel_slot = cancel.connect([&state] {
+        state->cv.notify(asio::error::operation_aborted);
+    });
+
+    // Waiting is work too, the thread of `ios` must not go away meanwhile.
+    asio::io_service::work work(ios);
+
+    while (!state->done) {
+        sys::error_code ec;
+        state->cv.wait(yield[ec]);
+        if (ec) return or_throw<R>(yield, ec);
+    }
+
+    return or_throw(yield, state->ec, std::move(state->result));
+}
+
+}} // namespaces
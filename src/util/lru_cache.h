@@ -58,6 +58,11 @@ public:
 	size_t size() const {
 		return _map.size();
 	}
+
+	// Iterate over the (key, value) pairs, most recently used first.
+	// Iterating does not change the order.
+	typename std::list<KeyVal>::const_iterator begin() const { return _list.begin(); }
+	typename std::list<KeyVal>::const_iterator end()   const { return _list.end();   }
 	
 private:
 	std::list<KeyVal> _list;
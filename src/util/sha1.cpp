@@ -43,4 +43,13 @@ std::array<uint8_t, 20> close(Sha1* digest)
     return result;
 }
 
-}}} // namespace
+} // sha1_detail namespace
+
+std::array<uint8_t, 20> sha1_buffer(const void* data, size_t size)
+{
+    std::array<uint8_t, 20> result;
+    ::gcry_md_hash_buffer(::gcry_md_algos::GCRY_MD_SHA1, result.data(), data, size);
+    return result;
+}
+
+}} // namespace
@@ -1,67 +1,53 @@
 #pragma once
 
 #include "signal.h"
+#include "timer_wheel.h"
 
 namespace ouinet { namespace util {
 
+/*
+ * Trigger `abort_signal()` once `duration` passes, or when `signal` is
+ * triggered, whatever comes first. The deadline is kept in the
+ * `TimerWheel` of the io_service, no timer or coroutine is needed.
+ */
 class Timeout {
-    struct State {
-        asio::steady_timer timer;
-        Signal<void()> local_abort_signal;
-        bool finished = false;
-
-        State(asio::io_service& ios)
-            : timer(ios)
-        {}
-    };
-
 public:
     template<class Duration>
     Timeout( asio::io_service& ios
            , Signal<void()>& signal
            , Duration duration)
-        : _state(std::make_shared<State>(ios))
+        : _deadline(ios)
     {
-        _signal_connection = signal.connect([s = _state] {
-                if (s->local_abort_signal.call_count() == 0) {
-                    s->local_abort_signal();
-                }
-            });
-
-        asio::spawn(ios, [s = _state, duration] (asio::yield_context yield) {
-                if (s->finished) return;
-
-                sys::error_code ec;
-
-                s->timer.expires_from_now(duration);
-                s->timer.async_wait(yield[ec]);
-
-                if (s->finished) return;
-
-                if (s->local_abort_signal.call_count() == 0) {
-                    s->local_abort_signal();
-                }
-            });
+        _signal_connection = signal.connect([this] { abort(); });
+        _deadline.start(duration, [this] { abort(); });
     }
 
+    Timeout(const Timeout&) = delete;
+    Timeout& operator=(const Timeout&) = delete;
+
     Signal<void()>& abort_signal()
     {
-        return _state->local_abort_signal;
+        return _local_abort_signal;
     }
 
     bool timed_out() const
     {
-        return _state->local_abort_signal.call_count() != 0;
+        return _local_abort_signal.call_count() != 0;
     }
 
-    ~Timeout()
+private:
+    void abort()
     {
-        _state->finished = true;
-        _state->timer.cancel();
+        _deadline.stop();
+
+        if (_local_abort_signal.call_count() == 0) {
+            _local_abort_signal();
+        }
     }
 
 private:
-    std::shared_ptr<State> _state;
+    Signal<void()> _local_abort_signal;
+    TimerWheel::Deadline _deadline;
     Signal<void()>::Connection _signal_connection;
 };
 
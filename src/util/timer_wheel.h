@@ -0,0 +1,239 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/intrusive/list.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+
+#include "../namespaces.h"
+
+namespace ouinet { namespace util {
+
+/*
+ * Deadlines of an io_context, kept in a timer wheel: a ring of slots, each
+ * holding the deadlines which expire within one tick (of `tick` length).
+ *
+ * All deadlines share a single asio timer, which is only set for the next
+ * slot with any deadline in it (and cancelled when there are none, so that
+ * it does not keep the io_context running). Starting, restarting and stopping a
+ * deadline just moves it between lists, which is much cheaper than
+ * cancelling and waiting again on a timer of its own, and thousands of
+ * connections need not have thousands of timers.
+ *
+ * Deadlines fire up to one tick late, which is fine for timeouts of I/O.
+ *
+ * Usage (from the thread running `ioc` only):
+ *
+ *     TimerWheel::Deadline d(ioc);
+ *     d.start(std::chrono::seconds(10), [&] { socket.close(); });
+ *     ...
+ *     d.stop();  // or let it go out of scope
+ *
+ * (It is a template just so that its static members can be defined
+ * in this header, use `TimerWheel`.)
+ */
+template<class Clock_ = std::chrono::steady_clock>
+class BasicTimerWheel : public asio::execution_context::service {
+public:
+    using Clock     = Clock_;
+    using Duration  = typename Clock::duration;
+    using TimePoint = typename Clock::time_point;
+
+    static const Duration tick;
+    // With 10ms ticks, deadlines within about 10s are in different slots.
+    static const size_t slot_count = 1024;
+
+private:
+    using Hook = boost::intrusive::list_base_hook
+        <boost::intrusive::link_mode<boost::intrusive::auto_unlink>>;
+
+    struct Entry : public Hook {
+        uint64_t expiry_tick;
+        std::function<void()> handler;
+    };
+
+    using List = boost::intrusive::list
+        <Entry, boost::intrusive::constant_time_size<false>>;
+
+public:
+    class Deadline {
+    public:
+        Deadline(asio::io_context& ioc)
+            : _wheel(asio::use_service<BasicTimerWheel>(ioc))
+        {}
+
+        Deadline(const Deadline&) = delete;
+        Deadline& operator=(const Deadline&) = delete;
+
+        // Call `handler` once `duration` has passed, unless stopped or
+        // started again before that.
+        void start(Duration duration, std::function<void()> handler)
+        {
+            _entry.handler = std::move(handler);
+            _wheel.insert(_entry, duration);
+        }
+
+        void stop()
+        {
+            _wheel.remove(_entry);
+            _entry.handler = nullptr;
+        }
+
+        bool is_running() const { return _entry.is_linked(); }
+
+        ~Deadline() { stop(); }
+
+    private:
+        BasicTimerWheel& _wheel;
+        Entry _entry;
+    };
+
+public:
+    static asio::execution_context::id id;
+
+    // Only created through `asio::use_service` with an `io_context`.
+    explicit BasicTimerWheel(asio::execution_context& ctx)
+        : asio::execution_context::service(ctx)
+        , _timer(static_cast<asio::io_context&>(ctx))
+        , _origin(Clock::now())
+    {}
+
+private:
+    void shutdown() override
+    {
+        for (auto& slot : _slots) {
+            while (!slot.empty()) {
+                auto& e = slot.front();
+                e.unlink();
+                e.handler = nullptr;
+            }
+        }
+        _count = 0;
+        _armed = false;
+        _timer.cancel();
+    }
+
+    uint64_t tick_at(TimePoint t) const
+    {
+        return (t - _origin) / tick;
+    }
+
+    void insert(Entry& e, Duration duration)
+    {
+        if (e.is_linked()) e.unlink();
+        else               _count++;
+
+        // Nothing to process after being idle.
+        if (_count == 1) _current_tick = std::max(_current_tick, tick_at(Clock::now()));
+
+        // Round up, so it never fires early.
+        e.expiry_tick = tick_at(Clock::now() + duration + tick - Duration(1));
+        if (e.expiry_tick <= _current_tick) e.expiry_tick = _current_tick + 1;
+
+        _slots[e.expiry_tick % slot_count].push_back(e);
+
+        if (!_armed || e.expiry_tick < _armed_tick) arm(e.expiry_tick);
+    }
+
+    void remove(Entry& e)
+    {
+        if (!e.is_linked()) return;
+
+        e.unlink();
+
+        if (--_count == 0 && _armed) {
+            _armed = false;
+            _timer.cancel();
+        }
+    }
+
+    void arm(uint64_t at_tick)
+    {
+        _armed = true;
+        _armed_tick = at_tick;
+
+        // This cancels any previous wait.
+        _timer.expires_at(_origin + at_tick * tick);
+        _timer.async_wait([this, at_tick] (const sys::error_code& ec) {
+            if (ec == asio::error::operation_aborted) return;
+            if (!_armed || at_tick != _armed_tick) return;
+            _armed = false;
+            on_tick();
+        });
+    }
+
+    void on_tick()
+    {
+        auto now_tick = tick_at(Clock::now());
+
+        // Collect due deadlines first, since handlers may start
+        // or stop others.
+        List due;
+
+        // Each slot needs to be looked at once at most.
+        auto ticks = std::min(now_tick - _current_tick, uint64_t(slot_count));
+
+        for (uint64_t t = _current_tick + 1; t <= _current_tick + ticks; t++) {
+            auto& slot = _slots[t % slot_count];
+
+            for (auto i = slot.begin(); i != slot.end(); ) {
+                auto& e = *i++;
+                if (e.expiry_tick > now_tick) continue;  // a later round
+                e.unlink();
+                due.push_back(e);
+            }
+        }
+
+        _current_tick = std::max(_current_tick, now_tick);
+
+        // Due deadlines are still counted, so that stopping them
+        // from other handlers works as usual.
+        while (!due.empty()) {
+            auto& e = due.front();
+            auto h = std::move(e.handler);
+            e.handler = nullptr;
+            e.unlink();
+            _count--;
+            // `e` may be gone after this.
+            h();
+        }
+
+        if (!_armed && _count) arm_next();
+    }
+
+    void arm_next()
+    {
+        for (uint64_t t = _current_tick + 1; t <= _current_tick + slot_count; t++) {
+            if (!_slots[t % slot_count].empty()) return arm(t);
+        }
+    }
+
+private:
+    asio::basic_waitable_timer<Clock> _timer;
+    TimePoint _origin;
+    // All slots up to this one have been processed.
+    uint64_t _current_tick = 0;
+    bool _armed = false;
+    uint64_t _armed_tick = 0;
+    // Number of deadlines in the slots.
+    size_t _count = 0;
+    std::array<List, slot_count> _slots;
+};
+
+template<class Clock>
+asio::execution_context::id BasicTimerWheel<Clock>::id;
+
+template<class Clock>
+const size_t BasicTimerWheel<Clock>::slot_count;
+
+template<class Clock>
+const typename BasicTimerWheel<Clock>::Duration
+BasicTimerWheel<Clock>::tick = std::chrono::milliseconds(10);
+
+using TimerWheel = BasicTimerWheel<>;
+
+}} // namespaces
@@ -1,48 +1,160 @@
 #pragma once
 
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include "../util.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/string.hpp>
 #include <boost/intrusive/list.hpp>
 
 namespace ouinet {
 
+namespace yield_detail {
+
+/*
+ * Reports the contexts of an io_service which have been working for long.
+ *
+ * Rather than a timer and a coroutine for each context, contexts being
+ * timed are kept in a list which a single timer scans every `scan_period`.
+ * The timer only runs while the list is not empty, so that it does not keep
+ * the io_service running.
+ *
+ * (It is a template just so that its static members can be defined in this
+ * header, it is only used as `Watchdog<Yield>`.)
+ */
+template<class Context>
+class Watchdog : public asio::execution_context::service {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static asio::execution_context::id id;
+
+    // A context is reported after working for this long, and then again
+    // each time this passes.
+    static const Clock::duration report_period;
+    static const Clock::duration scan_period;
+
+    // Only created through `asio::use_service` with an `io_service`.
+    explicit Watchdog(asio::execution_context& ctx)
+        : asio::execution_context::service(ctx)
+        , _timer(static_cast<asio::io_service&>(ctx))
+    {}
+
+    void add(Context& c)
+    {
+        _contexts.push_back(c);
+        if (!_armed) arm();
+    }
+
+    void remove(Context& c)
+    {
+        c._watch_hook.unlink();
+
+        if (_contexts.empty() && _armed) {
+            _armed = false;
+            _timer.cancel();
+        }
+    }
+
+private:
+    using List = boost::intrusive::list
+        < Context
+        , boost::intrusive::member_hook< Context
+                                       , typename Context::WatchHook
+                                       , &Context::_watch_hook>
+        , boost::intrusive::constant_time_size<false>>;
+
+    void shutdown() override
+    {
+        while (!_contexts.empty()) _contexts.front()._watch_hook.unlink();
+        _armed = false;
+        _timer.cancel();
+    }
+
+    void arm()
+    {
+        _armed = true;
+
+        // This cancels any previous wait.
+        _timer.expires_from_now(scan_period);
+        _timer.async_wait([this] (const sys::error_code& ec) {
+            if (ec == asio::error::operation_aborted) return;
+            _armed = false;
+            scan();
+        });
+    }
+
+    void scan()
+    {
+        auto now = Clock::now();
+
+        for (auto& c : _contexts) {
+            if (now < c._next_report) continue;
+
+            std::cerr << c.tag()
+                      << " is still working after "
+                      << Context::duration_secs(now - c._start_time) << " seconds"
+                      << std::endl;
+
+            c._next_report = now + report_period;
+        }
+
+        if (!_contexts.empty()) arm();
+    }
+
+private:
+    asio::steady_timer _timer;
+    bool _armed = false;
+    List _contexts;
+};
+
+template<class Context>
+asio::execution_context::id Watchdog<Context>::id;
+
+template<class Context>
+const typename Watchdog<Context>::Clock::duration
+Watchdog<Context>::report_period = std::chrono::seconds(30);
+
+template<class Context>
+const typename Watchdog<Context>::Clock::duration
+Watchdog<Context>::scan_period = std::chrono::seconds(1);
+
+} // yield_detail namespace
+
 class Yield : public boost::intrusive::list_base_hook
               < boost::intrusive::link_mode<boost::intrusive::auto_unlink>>
 {
     using Clock = std::chrono::steady_clock;
 
+    using Hook = boost::intrusive::list_base_hook
+        <boost::intrusive::link_mode<boost::intrusive::auto_unlink>>;
+
     using List = boost::intrusive::list
         <Yield, boost::intrusive::constant_time_size<false>>;
 
-    struct TimeoutState {
-        Yield* self;
-        asio::steady_timer timer;
+    using WatchHook = boost::intrusive::list_member_hook
+        <boost::intrusive::link_mode<boost::intrusive::auto_unlink>>;
 
-        TimeoutState(asio::io_service& ios, Yield* self)
-            : self(self)
-            , timer(ios)
-        {}
-
-        void stop() {
-            self = nullptr;
-            timer.cancel();
-        }
-    };
+    using Watchdog = yield_detail::Watchdog<Yield>;
+    friend Watchdog;
 
 public:
     Yield(asio::io_service& ios
          , asio::yield_context asio_yield
          , std::string con_id = "")
-        : _ios(ios)
+        : _watchdog(&asio::use_service<Watchdog>(ios))
         , _asio_yield(asio_yield)
         , _ignored_error(std::make_shared<sys::error_code>())
-        , _tag(util::str("R", generate_context_id()))
+        , _tag(std::move(con_id))
         , _parent(nullptr)
         , _start_time(Clock::now())
     {
-        if (!con_id.empty()) {
-            _tag = con_id + "/" + _tag;
-        }
+        if (!_tag.empty()) _tag += '/';
+        _tag += 'R';
+        _tag += std::to_string(generate_context_id());
 
         start_timing();
     }
@@ -54,10 +166,9 @@ public:
 
 private:
     Yield(Yield& parent, asio::yield_context asio_yield)
-        : _ios(parent._ios)
+        : _watchdog(parent._watchdog)
         , _asio_yield(asio_yield)
         , _ignored_error(parent._ignored_error)
-        , _tag(parent.tag())
         , _parent(&parent)
         , _start_time(Clock::now())
     {
@@ -66,18 +177,19 @@ private:
 
 public:
     Yield(Yield&& y)
-        : _ios(y._ios)
+        : _watchdog(y._watchdog)
         , _asio_yield(y._asio_yield)
         , _ignored_error(std::move(y._ignored_error))
         , _tag(std::move(y._tag))
+        , _name(y._name)
         , _parent(y._parent)
-        , _timeout_state(std::move(y._timeout_state))
         , _children(std::move(y._children))
         , _start_time(y._start_time)
+        , _next_report(y._next_report)
     {
-        if (_timeout_state) {
-            _timeout_state->self = this;
-        }
+        // Take the place of `y` in its parent and in the watchdog.
+        Hook::swap_nodes(y);
+        _watch_hook.swap_nodes(y._watch_hook);
 
         for (auto& ch : _children) {
             ch._parent = this;
@@ -86,21 +198,28 @@ public:
         y._parent = nullptr;
     }
 
-    Yield tag(std::string t)
+    // `t` is interned, so tags do not get copied around.
+    Yield tag(beast::string_view t)
     {
         Yield ret(*this);
-        ret._tag = tag() + "/" + t;
+        ret._name = intern(t);
         ret.start_timing();
         return ret;
     }
 
-    const std::string& tag() const
+    // Only built when asked for, e.g. to be logged.
+    std::string tag() const
     {
-        if (_tag.empty()) {
-            assert(_parent);
-            return _parent->tag();
+        if (!_parent) return _tag;
+
+        auto ret = _parent->tag();
+
+        if (_name) {
+            ret += '/';
+            ret += *_name;
         }
-        return _tag;
+
+        return ret;
     }
 
     Yield operator[](sys::error_code& ec)
@@ -142,10 +261,24 @@ private:
 
     static size_t generate_context_id()
     {
-        static size_t next_id = 0;
+        static std::atomic<size_t> next_id(0);
         return next_id++;
     }
 
+    // Tags are string literals in practice, so there are few of them.
+    static const std::string* intern(beast::string_view t)
+    {
+        static std::mutex mutex;
+        // Never destroyed, since contexts may outlive static objects.
+        static auto& names = *new std::set<std::string, std::less<>>();
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto i = names.find(t);
+        if (i == names.end()) i = names.emplace(t.data(), t.size()).first;
+        return &*i;
+    }
+
     void start_timing();
     void stop_timing();
 
@@ -154,69 +287,46 @@ private:
     }
 
 private:
-    asio::io_service& _ios;
+    Watchdog* _watchdog;
     asio::yield_context _asio_yield;
     std::shared_ptr<sys::error_code> _ignored_error;
+    // The whole tag of a root context, empty otherwise.
     std::string _tag;
+    // What `tag(t)` added to the parent's tag, if anything.
+    const std::string* _name = nullptr;
     Yield* _parent;
-    std::shared_ptr<TimeoutState> _timeout_state;
     List _children;
     Clock::time_point _start_time;
+    // Linked while being timed.
+    WatchHook _watch_hook;
+    Clock::time_point _next_report;
 };
 
 inline
 void Yield::stop_timing()
 {
-    if (!_timeout_state) {
+    if (!_watch_hook.is_linked()) {
         if (_parent) _parent->stop_timing();
         return;
     }
 
-    _timeout_state->stop();
-    _timeout_state = nullptr;
+    _watchdog->remove(*this);
 }
 
 inline
 void Yield::start_timing()
 {
-    Clock::duration timeout = std::chrono::seconds(30);
-
     stop_timing();
 
-    _timeout_state = std::make_shared<TimeoutState>(_ios, this);
-
-    asio::spawn(_ios
-               , [ ts = _timeout_state, timeout]
-                 (asio::yield_context yield) {
-
-            if (!ts->self) return;
-
-            auto notify = [&](Clock::duration d) {
-                std::cerr << ts->self->tag()
-                          << " is still working after "
-                          << Yield::duration_secs(d) << " seconds"
-                          << std::endl;
-            };
-
-            boost::optional<Clock::duration> first_duration
-                = Clock::now() - ts->self->_start_time;
+    auto now = Clock::now();
 
-            if (*first_duration >= timeout) {
-                notify(*first_duration);
-            }
-
-            while (ts->self) {
-                sys::error_code ec; // ignored
-
-                ts->timer.expires_from_now(timeout);
-
-                ts->timer.async_wait(yield[ec]);
+    // Contexts timed again after their children are done
+    // get reported right away if they have already been long.
+    _next_report = now - _start_time >= Watchdog::report_period
+                 ? now
+                 : now + Watchdog::report_period;
 
-                if (!ts->self) break;
-
-                notify(Clock::now() - ts->self->_start_time);
-            }
-        });
+    _watchdog->add(*this);
 }
 
 template<class... Args>
@@ -231,10 +341,12 @@ void Yield::log(beast::string_view str)
 {
     using beast::string_view;
 
+    auto tag = this->tag();
+
     while (str.size()) {
         auto endl = str.find('\n');
 
-        std::cerr << tag() << " " << str.substr(0, endl) << std::endl;
+        std::cerr << tag << " " << str.substr(0, endl) << std::endl;
 
         if (endl == std::string::npos) {
             break;
@@ -0,0 +1,295 @@
+/*
+ * Benchmark of the DHT lookup algorithm (bittorrent::collect) over the
+ * SimulatedNetwork: each node answers queries with the closest nodes it
+ * knows of, datagrams arrive after a random delay, and some are lost.
+ *
+ * Usage: bench-collect [node-count] [lookup-count]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <namespaces.h>
+#include <bittorrent/node_id.h>
+#include <bittorrent/routing_table.h>
+#include <bittorrent/contact.h>
+#include <bittorrent/code.h>
+#include <bittorrent/proximity_map.h>
+#include <bittorrent/collect.h>
+
+#include "simulated_network.h"
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::bittorrent;
+using udp = asio::ip::udp;
+using Clock = chrono::steady_clock;
+
+static const size_t K = 8;
+
+// Queries not answered within this time count as lost.
+static const chrono::milliseconds timeout{200};
+
+struct SimNode {
+    NodeID id;
+    udp::endpoint endpoint;
+    // Known nodes, at most K per common prefix length, as in a routing table.
+    vector<size_t> known;
+};
+
+struct Topology {
+    vector<SimNode> nodes;
+    mt19937 rng;
+
+    Topology(size_t node_count, unsigned seed) : rng(seed) {
+        for (size_t i = 0; i < node_count; i++) {
+            SimNode n;
+            for (auto& b : n.id.buffer) b = rng() & 0xff;
+            n.endpoint = udp::endpoint(asio::ip::address_v4(0x0a000000 + i), 6881);
+            nodes.push_back(n);
+        }
+
+        for (size_t i = 0; i < node_count; i++) {
+            vector<size_t> per_bucket(NodeID::bit_size + 1, 0);
+            vector<size_t> order(node_count);
+            for (size_t j = 0; j < node_count; j++) order[j] = j;
+            shuffle(order.begin(), order.end(), rng);
+
+            for (size_t j : order) {
+                if (j == i) continue;
+                size_t bucket = common_prefix(nodes[i].id, nodes[j].id);
+                if (per_bucket[bucket]++ < K) nodes[i].known.push_back(j);
+            }
+        }
+    }
+
+    static size_t common_prefix(const NodeID& a, const NodeID& b) {
+        for (size_t n = 0; n < NodeID::bit_size; n++) {
+            if (a.bit(n) != b.bit(n)) return n;
+        }
+        return NodeID::bit_size;
+    }
+
+    vector<dht::NodeContact> closest_known(size_t node, const NodeID& target) {
+        vector<size_t> known = nodes[node].known;
+        sort(known.begin(), known.end(), [&] (size_t l, size_t r) {
+            return target.closer_to(nodes[l].id, nodes[r].id);
+        });
+        if (known.size() > K) known.resize(K);
+
+        vector<dht::NodeContact> ret;
+        for (size_t j : known) ret.push_back({ nodes[j].id, nodes[j].endpoint });
+        return ret;
+    }
+
+    set<NodeID> true_closest(const NodeID& target) {
+        vector<size_t> all(nodes.size());
+        for (size_t i = 0; i < all.size(); i++) all[i] = i;
+        partial_sort(all.begin(), all.begin() + K, all.end(), [&] (size_t l, size_t r) {
+            return target.closer_to(nodes[l].id, nodes[r].id);
+        });
+        set<NodeID> ret;
+        for (size_t i = 0; i < K; i++) ret.insert(nodes[all[i]].id);
+        return ret;
+    }
+};
+
+/*
+ * Answer the queries sent to node $i. A query is just the target ID, and
+ * its reply the closest nodes known to $i, in compact node info format.
+ */
+static void serve( Topology& topology
+                 , size_t i
+                 , DatagramSocket& socket
+                 , asio::yield_context yield)
+{
+    array<char, NodeID::size> buf;
+
+    while (true) {
+        sys::error_code ec;
+        udp::endpoint from;
+
+        size_t size = socket.receive_from(asio::buffer(buf), from, yield[ec]);
+
+        if (ec) break;
+        if (size != NodeID::size) continue;
+
+        auto target = NodeID::from_bytestring(string(buf.data(), size));
+
+        string reply;
+        for (auto& c : topology.closest_known(i, target)) {
+            reply += c.id.to_bytestring() + encode_endpoint(c.endpoint);
+        }
+
+        socket.send_to(asio::buffer(reply), from, yield[ec]);
+    }
+}
+
+/*
+ * Ask the node at $c for the nodes it knows closest to $target, from a new
+ * socket bound to $local. Returns boost::none if the query or its reply is
+ * lost.
+ */
+static boost::optional<vector<dht::NodeContact>>
+query( SimulatedNetwork& network
+     , udp::endpoint local
+     , const Contact& c
+     , const NodeID& target
+     , asio::yield_context yield)
+{
+    shared_ptr<DatagramSocket> socket = network.bind(local);
+
+    asio::steady_timer timer(socket->get_io_service());
+    timer.expires_from_now(timeout);
+    timer.async_wait([socket] (const sys::error_code& ec) {
+        if (!ec) socket->close();
+    });
+
+    sys::error_code ec;
+
+    auto payload = target.to_bytestring();
+    socket->send_to(asio::buffer(payload), c.endpoint, yield[ec]);
+
+    array<char, 1024> buf;
+    udp::endpoint from;
+    size_t size = socket->receive_from(asio::buffer(buf), from, yield[ec]);
+
+    timer.cancel();
+
+    if (ec) return boost::none;
+
+    vector<dht::NodeContact> contacts;
+    if (!decode_contacts_v4(string(buf.data(), size), contacts)) {
+        return boost::none;
+    }
+    return contacts;
+}
+
+struct Compare {
+    NodeID target_id;
+
+    bool operator()(const Contact& l, const Contact& r) const {
+        if (!l.id && !r.id) return l.endpoint < r.endpoint;
+        if ( l.id && !r.id) return true;
+        if (!l.id &&  r.id) return false;
+        return target_id.closer_to(*l.id, *r.id);
+    }
+};
+
+struct Result {
+    double millis = 0;
+    double queries = 0;
+    double success = 0;
+};
+
+static Result run(Topology& topology, CollectConfig config, size_t lookups)
+{
+    asio::io_service ios;
+
+    SimulatedNetwork::Config network_config;
+    network_config.min_latency = chrono::milliseconds(5);
+    network_config.max_latency = chrono::milliseconds(50);
+    // About 5% of the queries, counting those whose reply is lost.
+    network_config.loss = 0.025;
+
+    SimulatedNetwork network(ios, network_config);
+    Result result;
+
+    vector<unique_ptr<DatagramSocket>> sockets;
+
+    for (size_t i = 0; i < topology.nodes.size(); i++) {
+        sockets.push_back(network.bind(topology.nodes[i].endpoint));
+
+        asio::spawn(ios, [&, i] (asio::yield_context yield) {
+            serve(topology, i, *sockets[i], yield);
+        });
+    }
+
+    // Each query is sent from its own address.
+    uint32_t next_address = 0x0c000000;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        for (size_t l = 0; l < lookups; l++) {
+            size_t origin = topology.rng() % topology.nodes.size();
+            NodeID target;
+            for (auto& b : target.buffer) b = topology.rng() & 0xff;
+
+            set<Contact, Compare> seeds(Compare{target});
+            for (auto& c : topology.closest_known(origin, target)) seeds.insert(c);
+
+            ProximityMap<udp::endpoint> out(target, K);
+            size_t queries = 0;
+
+            auto start = Clock::now();
+
+            collect(ios, move(seeds), [&] (const Contact& candidate, asio::yield_context yield)
+                                          -> boost::optional<vector<dht::NodeContact>> {
+                    if (candidate.id && !out.would_insert(*candidate.id)) {
+                        return boost::none;
+                    }
+                    queries++;
+                    udp::endpoint local(asio::ip::address_v4(next_address++), 6881);
+                    auto reply = query(network, local, candidate, target, yield);
+                    if (!reply) return vector<dht::NodeContact>();
+                    if (candidate.id) out.insert({ *candidate.id, candidate.endpoint });
+                    return reply;
+                }
+                , config
+                , yield);
+
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(Clock::now() - start);
+
+            set<NodeID> found;
+            for (auto& i : out) found.insert(i.first);
+
+            result.millis  += elapsed.count() / 1000.0;
+            result.queries += queries;
+            result.success += (found == topology.true_closest(target)) ? 1 : 0;
+        }
+
+        for (auto& socket : sockets) socket->close();
+    });
+
+    ios.run();
+
+    result.millis  /= lookups;
+    result.queries /= lookups;
+    result.success /= lookups;
+    return result;
+}
+
+int main(int argc, const char** argv)
+{
+    size_t node_count = argc > 1 ? stoul(argv[1]) : 2000;
+    size_t lookups    = argc > 2 ? stoul(argv[2]) : 50;
+
+    Topology topology(node_count, 1);
+
+    cout << "nodes: " << node_count << ", lookups: " << lookups << endl;
+    cout << "parallelism max_candidates  ms/lookup  queries/lookup  success" << endl;
+
+    for (size_t parallelism : { 3, 8, 16, 64 }) {
+        for (size_t max_candidates : { K * 4, size_t(256) }) {
+            CollectConfig config;
+            config.parallelism = parallelism;
+            config.max_candidates = max_candidates;
+
+            auto r = run(topology, config, lookups);
+
+            cout << parallelism << "\t    " << max_candidates
+                 << "\t\t" << r.millis
+                 << "\t    " << r.queries
+                 << "\t    " << r.success << endl;
+        }
+    }
+}
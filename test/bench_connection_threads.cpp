@@ -0,0 +1,172 @@
+/*
+ * Benchmark of serving HTTP connections with an IoServicePool, the way the
+ * injector does with --threads. Connections are accepted by a TCP
+ * OuiServiceServer running in the main io_service and distributed across
+ * the pool. Each request costs some CPU (generating an ID and hashing the
+ * response body) before the response is sent back. Reports requests per
+ * second for pools of 1, 2, 4... threads, up to the number of cores.
+ *
+ * Usage: bench-connection-threads [connections] [requests-per-connection]
+ *                                 [body-size] [max-threads]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/uuid/random_generator.hpp>
+#include <boost/uuid/uuid_io.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <namespaces.h>
+#include <ouiservice.h>
+#include <ouiservice/tcp.h>
+#include <util/io_service_pool.h>
+#include <util/wait_condition.h>
+
+using namespace std;
+using namespace ouinet;
+using tcp = asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+static uint64_t fnv1a(const string& data)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (unsigned char c : data) { h ^= c; h *= 0x100000001b3; }
+    return h;
+}
+
+static void serve(GenericStream con, size_t body_size, asio::yield_context yield)
+{
+    boost::uuids::random_generator_mt19937 genuuid;
+    beast::flat_buffer buffer;
+
+    for (;;) {
+        sys::error_code ec;
+
+        http::request<http::string_body> rq;
+        http::async_read(con, buffer, rq, yield[ec]);
+        if (ec) break;
+
+        http::response<http::string_body> rs{http::status::ok, rq.version()};
+        rs.set("X-Id", to_string(genuuid()));
+        rs.body().assign(body_size, 'x');
+        rs.set("X-Hash", to_string(fnv1a(rs.body())));
+        rs.keep_alive(true);
+        rs.prepare_payload();
+
+        http::async_write(con, rs, yield[ec]);
+        if (ec) break;
+    }
+}
+
+/*
+ * Serve `connections` clients doing `requests` each with a pool of
+ * `threads` io_services. Return the requests per second.
+ */
+static double run( size_t threads
+                 , size_t connections
+                 , size_t requests
+                 , size_t body_size)
+{
+    asio::io_service ios;
+    util::IoServicePool pool(threads);
+    // Clients get threads of their own, not to compete with the main one.
+    util::IoServicePool client_pool(threads);
+
+    // Pick a free port ourselves, so the clients know where to connect.
+    tcp::endpoint endpoint;
+    {
+        tcp::acceptor probe(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        endpoint = probe.local_endpoint();
+    }
+
+    OuiServiceServer server(ios);
+    server.add(make_unique<ouiservice::TcpOuiServiceServer>(ios, endpoint));
+    server.distribute_connections([&] () -> asio::io_service& {
+        return pool.next();
+    });
+
+    atomic<size_t> done(0);
+    atomic<size_t> failed(0);
+    Clock::time_point start, end;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        sys::error_code ec;
+        server.start_listen(yield[ec]);
+        if (ec) {
+            cerr << "Failed to listen: " << ec.message() << endl;
+            return;
+        }
+
+        start = Clock::now();
+
+        for (size_t i = 0; i < connections; i++) {
+            auto& client_ios = client_pool.next();
+
+            asio::spawn(client_ios, [&] (asio::yield_context yield) {
+                sys::error_code ec;
+                tcp::socket s(client_ios);
+                s.async_connect(endpoint, yield[ec]);
+
+                beast::flat_buffer buffer;
+
+                for (size_t j = 0; !ec && j < requests; j++) {
+                    http::request<http::empty_body> rq{http::verb::get, "/", 11};
+                    rq.set(http::field::host, "localhost");
+                    http::async_write(s, rq, yield[ec]);
+
+                    http::response<http::string_body> rs;
+                    if (!ec) http::async_read(s, buffer, rs, yield[ec]);
+                }
+
+                if (ec) failed++;
+
+                if (++done == connections) {
+                    end = Clock::now();
+                    ios.post([&] { server.stop_listen(); });
+                }
+            });
+        }
+
+        for (;;) {
+            auto con = server.accept(yield[ec]);
+            if (ec) break;
+
+            auto& con_ios = con.get_io_service();
+            asio::spawn(con_ios, [con = move(con), body_size]
+                                 (asio::yield_context yield) mutable {
+                serve(move(con), body_size, yield);
+            });
+        }
+    });
+
+    ios.run();
+    client_pool.join();
+    pool.join();
+
+    if (failed) cerr << failed << " connections failed" << endl;
+
+    return connections * requests / chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char** argv)
+{
+    size_t connections = argc > 1 ? stoul(argv[1]) : 64;
+    size_t requests    = argc > 2 ? stoul(argv[2]) : 200;
+    size_t body_size   = argc > 3 ? stoul(argv[3]) : 64 * 1024;
+    size_t max_threads = argc > 4 ? stoul(argv[4])
+                                  : max(1u, thread::hardware_concurrency());
+
+    cout << "connections: " << connections
+         << ", requests per connection: " << requests
+         << ", body: " << body_size << " bytes" << endl;
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = run(threads, connections, requests, body_size);
+        cout << "threads " << threads << "\t" << size_t(rate) << " requests/s" << endl;
+    }
+}
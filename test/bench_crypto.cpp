@@ -0,0 +1,82 @@
+/*
+ * Benchmark of the Ed25519 key operations used for BEP44 mutable items.
+ *
+ * Usage: bench-crypto [seconds-per-operation]
+ */
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <namespaces.h>
+#include <util/crypto.h>
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::util;
+using Clock = chrono::steady_clock;
+
+/*
+ * Run $f repeatedly for about $seconds, return the number of runs per second.
+ */
+template<class F>
+static double rate(double seconds, F&& f)
+{
+    size_t count = 0;
+    auto start = Clock::now();
+    auto end = start + chrono::duration<double>(seconds);
+    auto now = start;
+
+    while (now < end) {
+        for (size_t i = 0; i < 16; i++) f();
+        count += 16;
+        now = Clock::now();
+    }
+
+    return count / chrono::duration<double>(now - start).count();
+}
+
+int main(int argc, const char** argv)
+{
+    double seconds = argc > 1 ? stod(argv[1]) : 1;
+
+    crypto_init();
+
+    auto private_key = Ed25519PrivateKey::generate();
+    auto public_key = private_key.public_key();
+
+    string data(1000, 'x');
+    auto signature = private_key.sign(data);
+
+    volatile size_t sink = 0;
+
+    auto report = [] (const char* name, double r) {
+        cout << name << "\t" << size_t(r) << "/s" << endl;
+    };
+
+    report("sign", rate(seconds, [&] {
+        sink += private_key.sign(data)[0];
+    }));
+
+    report("verify", rate(seconds, [&] {
+        sink += public_key.verify(data, signature);
+    }));
+
+    report("verify (fresh key)", rate(seconds, [&] {
+        Ed25519PublicKey key(public_key.serialize());
+        sink += key.verify(data, signature);
+    }));
+
+    report("public_key", rate(seconds, [&] {
+        sink += private_key.public_key().serialize()[0];
+    }));
+
+    report("copy public", rate(seconds, [&] {
+        Ed25519PublicKey copy(public_key);
+        sink += copy.serialize()[0];
+    }));
+
+    report("copy private", rate(seconds, [&] {
+        Ed25519PrivateKey copy(private_key);
+        sink += copy.serialize()[0];
+    }));
+}
@@ -0,0 +1,222 @@
+/*
+ * Benchmark of DHT operations on a network of DhtNodes running in this
+ * process over a SimulatedNetwork. Reports latency, datagrams sent and
+ * success rate of node lookups, mutable puts and mutable gets.
+ *
+ * Usage: bench-dht [node-count] [operation-count] [min-latency-ms]
+ *                  [max-latency-ms] [loss]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <namespaces.h>
+#include <bittorrent/dht.h>
+#include <util/crypto.h>
+#include <util/wait_condition.h>
+
+#include "simulated_network.h"
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::bittorrent;
+using namespace ouinet::bittorrent::dht;
+using udp = asio::ip::udp;
+using Clock = chrono::steady_clock;
+
+/*
+ * Number of nodes bootstrapping at the same time, each off a random node
+ * which already finished.
+ */
+static const size_t BOOTSTRAP_BATCH = 64;
+
+struct Result {
+    size_t count = 0;
+    size_t successes = 0;
+    double total_ms = 0;
+    size_t datagrams = 0;
+
+    void report(const char* name) const {
+        cout << name
+             << "\tlatency " << total_ms / count << " ms"
+             << ", datagrams " << double(datagrams) / count
+             << ", success " << 100.0 * successes / count << "%" << endl;
+    }
+};
+
+/*
+ * Run $f, adding its duration and the datagrams sent meanwhile to $result.
+ */
+template<class F>
+static void measure(const SimulatedNetwork& network, Result& result, F&& f)
+{
+    auto sent = network.stats().sent;
+    auto start = Clock::now();
+
+    bool success = f();
+
+    result.count++;
+    result.successes += success;
+    result.total_ms += chrono::duration<double, milli>(Clock::now() - start).count();
+    result.datagrams += network.stats().sent - sent;
+}
+
+static udp::endpoint endpoint_of(size_t i)
+{
+    return udp::endpoint(asio::ip::address_v4(0x0b000000 + i), 6881);
+}
+
+int main(int argc, const char** argv)
+{
+    size_t node_count      = argc > 1 ? stoul(argv[1]) : 200;
+    size_t operation_count = argc > 2 ? stoul(argv[2]) : 50;
+
+    SimulatedNetwork::Config config;
+    if (argc > 3) config.min_latency = chrono::milliseconds(stoul(argv[3]));
+    if (argc > 4) config.max_latency = chrono::milliseconds(stoul(argv[4]));
+    if (argc > 5) config.loss = stod(argv[5]);
+
+    // Node IDs are picked with rand().
+    srand(config.seed);
+    mt19937 rng(config.seed);
+
+    util::crypto_init();
+
+    asio::io_service ios;
+    SimulatedNetwork network(ios, config);
+
+    vector<unique_ptr<DhtNode>> nodes;
+    for (size_t i = 0; i < node_count; i++) {
+        nodes.push_back(make_unique<DhtNode>(ios, endpoint_of(i).address()));
+    }
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto start = [&] (size_t i, size_t bootstrap, asio::yield_context yield) {
+            sys::error_code ec;
+            nodes[i]->start( network.bind(endpoint_of(i))
+                           , endpoint_of(bootstrap)
+                           , yield[ec]);
+        };
+
+        /*
+         * Bootstrap
+         */
+        auto bootstrap_start = Clock::now();
+        size_t started = min<size_t>(2, node_count);
+
+        {
+            // The first two nodes bootstrap off each other.
+            WaitCondition wc(ios);
+            for (size_t i = 0; i < started; i++) {
+                asio::spawn(ios, [&, i, lock = wc.lock()] (asio::yield_context yield) {
+                    start(i, (i + 1) % started, yield);
+                });
+            }
+            wc.wait(yield);
+        }
+
+        while (started < node_count) {
+            size_t end = min(node_count, started + BOOTSTRAP_BATCH);
+            WaitCondition wc(ios);
+
+            for (size_t i = started; i < end; i++) {
+                size_t bootstrap = rng() % started;
+                asio::spawn(ios, [&, i, bootstrap, lock = wc.lock()]
+                                 (asio::yield_context yield) {
+                    start(i, bootstrap, yield);
+                });
+            }
+
+            wc.wait(yield);
+            started = end;
+        }
+
+        // Nodes which failed to bootstrap take no further part.
+        vector<DhtNode*> ready;
+        for (auto& node : nodes) {
+            if (node->initialized()) ready.push_back(node.get());
+        }
+
+        cout << "nodes: " << node_count
+             << " (" << ready.size() << " bootstrapped in "
+             << chrono::duration<double>(Clock::now() - bootstrap_start).count()
+             << " s, " << network.stats().sent << " datagrams)" << endl;
+
+        if (ready.empty()) {
+            ios.stop();
+            return;
+        }
+
+        auto random_node = [&] () -> DhtNode& { return *ready[rng() % ready.size()]; };
+
+        auto random_id = [&] {
+            NodeID id;
+            for (auto& b : id.buffer) b = rng() & 0xff;
+            return id;
+        };
+
+        /*
+         * Node lookups: success means the closest node of the whole network
+         * was found.
+         */
+        Result lookups;
+
+        for (size_t i = 0; i < operation_count; i++) {
+            NodeID target = random_id();
+
+            auto closest = min_element(ready.begin(), ready.end(),
+                [&] (const DhtNode* l, const DhtNode* r) {
+                    return target.closer_to(l->node_id(), r->node_id());
+                });
+
+            measure(network, lookups, [&] {
+                sys::error_code ec;
+                auto found = random_node().find_closest_nodes(target, yield[ec]);
+                return !ec && any_of(found.begin(), found.end(),
+                    [&] (const NodeContact& c) { return c.id == (*closest)->node_id(); });
+            });
+        }
+
+        /*
+         * Mutable puts and gets, each item read back from another node.
+         */
+        auto private_key = util::Ed25519PrivateKey::generate();
+        Result puts, gets;
+
+        for (size_t i = 0; i < operation_count; i++) {
+            string salt = "bench-" + to_string(i);
+            string value = to_string(rng());
+
+            auto item = MutableDataItem::sign(value, 1, salt, private_key);
+
+            measure(network, puts, [&] {
+                sys::error_code ec;
+                random_node().data_put_mutable(item, yield[ec]);
+                return !ec;
+            });
+
+            measure(network, gets, [&] {
+                sys::error_code ec;
+                auto found = random_node().data_get_mutable
+                    (private_key.public_key(), salt, yield[ec]);
+                return !ec && found && found->value == value;
+            });
+        }
+
+        lookups.report("find_closest_nodes");
+        puts.report("mutable_put");
+        gets.report("mutable_get");
+
+        for (auto& node : nodes) node->stop();
+        ios.stop();
+    });
+
+    ios.run();
+}
@@ -0,0 +1,117 @@
+/*
+ * Benchmark of relaying a bulk transfer with full_duplex, the way CONNECT
+ * tunnels are relayed by the client and the injector. A sender writes
+ * data to the relay over loopback TCP, which forwards it to a receiver
+ * over another connection. Reports throughput when relaying with splice
+ * (both ends are plain TCP sockets) and through user space buffers.
+ *
+ * Usage: bench-full-duplex [megabytes] [write-size]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+
+#include <chrono>
+#include <iostream>
+
+#include <full_duplex_forward.h>
+#include <generic_stream.h>
+#include <namespaces.h>
+
+using namespace std;
+using namespace ouinet;
+using tcp = asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+static pair<tcp::socket, tcp::socket>
+connected_pair(asio::io_service& ios, asio::yield_context yield)
+{
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket s1(ios), s2(ios);
+    s1.async_connect(acceptor.local_endpoint(), yield);
+    acceptor.async_accept(s2, yield);
+    return make_pair(move(s1), move(s2));
+}
+
+/*
+ * Relay `total` bytes written `write_size` at a time. With `splice`
+ * false, the buffered relay is used even between TCP sockets.
+ * Return megabytes per second.
+ */
+static double run(size_t total, size_t write_size, bool splice)
+{
+    asio::io_service ios;
+    Clock::time_point start, end;
+    size_t relayed = 0;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p1 = connected_pair(ios, yield);
+        auto p2 = connected_pair(ios, yield);
+
+        tcp::socket sender  (move(p1.first));
+        tcp::socket receiver(move(p2.second));
+        GenericStream c1(move(p1.second));
+        GenericStream c2(move(p2.first));
+
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            string data(write_size, 'x');
+            start = Clock::now();
+            for (size_t sent = 0; sent < total; sent += data.size()) {
+                asio::async_write(sender, asio::buffer(data), yield);
+            }
+            sender.shutdown(tcp::socket::shutdown_send);
+        });
+
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            vector<char> data(64 * 1024);
+            sys::error_code ec;
+            size_t received = 0;
+            while (!ec && received < total) {
+                received += receiver.async_read_some(asio::buffer(data), yield[ec]);
+            }
+            end = Clock::now();
+            if (received != total) cerr << "Received " << received << " bytes only" << endl;
+            // The relay does not end while the other direction is open.
+            c1.close();
+            c2.close();
+        });
+
+        if (splice) {
+            relayed = full_duplex(c1, c2, yield).from_c1;
+        }
+        else {
+            size_t back = 0;
+            WaitCondition wc(ios);
+            asio::spawn(ios, [&, lock = wc.lock()] (asio::yield_context yield) {
+                full_duplex_detail::half_duplex(c1, c2, relayed, yield);
+            });
+            asio::spawn(ios, [&, lock = wc.lock()] (asio::yield_context yield) {
+                full_duplex_detail::half_duplex(c2, c1, back, yield);
+            });
+            wc.wait(yield);
+        }
+    });
+
+    ios.run();
+
+    if (relayed != total) cerr << "Relayed " << relayed << " bytes only" << endl;
+
+    return total / 1e6 / chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char** argv)
+{
+    size_t megabytes  = argc > 1 ? stoul(argv[1]) : 1000;
+    size_t write_size = argc > 2 ? stoul(argv[2]) : 64 * 1024;
+
+    size_t total = megabytes * 1000 * 1000 / write_size * write_size;
+
+    cout << "transfer: " << total << " bytes"
+         << ", write size: " << write_size << " bytes" << endl;
+
+    cout << "buffered\t" << size_t(run(total, write_size, false)) << " MB/s" << endl;
+#ifdef __linux__
+    cout << "splice  \t" << size_t(run(total, write_size, true)) << " MB/s" << endl;
+#endif
+}
@@ -0,0 +1,138 @@
+/*
+ * Benchmark of small message ping-pong through GenericStream. A client
+ * sends a message over a loopback TCP connection and the server sends it
+ * back, both running as coroutines in the same io_service. Reports round
+ * trips per second and heap allocations per round trip, for plain sockets
+ * and for sockets wrapped in GenericStream, so that the cost of the type
+ * erasure can be told apart.
+ *
+ * Usage: bench-generic-stream [round-trips] [message-size]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+
+#include <generic_stream.h>
+#include <namespaces.h>
+
+using namespace std;
+using namespace ouinet;
+using tcp = asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+static atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations++;
+    if (auto p = malloc(size)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+template<class Stream>
+static void ping_pong(Stream& s, size_t round_trips, string& msg, asio::yield_context yield)
+{
+    for (size_t i = 0; i < round_trips; i++) {
+        asio::async_write(s, asio::buffer(msg), yield);
+        asio::async_read(s, asio::buffer(&msg[0], msg.size()), yield);
+    }
+}
+
+template<class Stream>
+static void echo(Stream& s, string& msg, asio::yield_context yield)
+{
+    sys::error_code ec;
+
+    for (;;) {
+        asio::async_read(s, asio::buffer(&msg[0], msg.size()), yield[ec]);
+        if (ec) return;
+        asio::async_write(s, asio::buffer(msg), yield[ec]);
+        if (ec) return;
+    }
+}
+
+struct Result {
+    double rate;
+    double allocations;
+};
+
+/*
+ * Do `round_trips` of `size` byte messages, after a few to warm up.
+ * `wrap` makes the stream to use out of a connected socket.
+ */
+template<class Wrap>
+static Result run(size_t round_trips, size_t size, Wrap wrap)
+{
+    asio::io_service ios;
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+
+    Result result;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        tcp::socket s(ios);
+        acceptor.async_accept(s, yield);
+
+        auto stream = wrap(move(s));
+        string msg(size, '\0');
+        echo(stream, msg, yield);
+    });
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        tcp::socket s(ios);
+        s.async_connect(acceptor.local_endpoint(), yield);
+
+        auto stream = wrap(move(s));
+        string msg(size, 'x');
+
+        ping_pong(stream, 1000, msg, yield);
+
+        size_t allocations_start = allocations;
+        auto start = Clock::now();
+
+        ping_pong(stream, round_trips, msg, yield);
+
+        auto duration = chrono::duration<double>(Clock::now() - start).count();
+
+        result.rate = round_trips / duration;
+        result.allocations = double(allocations - allocations_start) / round_trips;
+
+        stream.close();
+    });
+
+    ios.run();
+
+    return result;
+}
+
+static void report(const char* name, Result r)
+{
+    cout << name << "\t" << size_t(r.rate) << " round trips/s\t"
+         << r.allocations << " allocations/round trip" << endl;
+}
+
+int main(int argc, const char** argv)
+{
+    size_t round_trips = argc > 1 ? stoul(argv[1]) : 100000;
+    size_t size        = argc > 2 ? stoul(argv[2]) : 64;
+
+    cout << "round trips: " << round_trips
+         << ", message: " << size << " bytes" << endl;
+
+    report("tcp::socket", run(round_trips, size, [] (tcp::socket s) {
+        return s;
+    }));
+
+    report("GenericStream", run(round_trips, size, [] (tcp::socket s) {
+        return GenericStream(move(s));
+    }));
+}
@@ -0,0 +1,403 @@
+/*
+ * Benchmark of the DHT routing table and NodeID distance comparisons against
+ * the previous implementation (a binary tree of buckets, and a byte by byte
+ * closer_to), a copy of which is kept below. Also times BEP42 node ID
+ * generation and checks. Fails if the tables end up holding different
+ * nodes.
+ *
+ * Usage: bench-routing-table [node-count] [query-count]
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <namespaces.h>
+#include <bittorrent/node_id.h>
+#include <bittorrent/routing_table.h>
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::bittorrent;
+using namespace ouinet::bittorrent::dht;
+using udp = asio::ip::udp;
+using Clock = chrono::steady_clock;
+
+static const size_t K = RoutingBucket::BUCKET_SIZE;
+
+namespace legacy {
+
+static bool closer_to(const NodeID& t, const NodeID& left, const NodeID& right)
+{
+    for (size_t i = 0; i < NodeID::size; i++) {
+        uint8_t l = left .buffer[i] ^ t.buffer[i];
+        uint8_t r = right.buffer[i] ^ t.buffer[i];
+        if (l < r) return true;
+        if (r < l) return false;
+    }
+    return false;
+}
+
+class RoutingTable {
+    struct TreeNode {
+        NodeID::Range range;
+
+        TreeNode(NodeID::Range r) : range(move(r)) {}
+
+        size_t depth() const { return range.mask; }
+
+        void split() {
+            left_child = make_unique<TreeNode>(range.reduce(0));
+            left_child->bucket = make_unique<RoutingBucket>();
+            right_child = make_unique<TreeNode>(range.reduce(1));
+            right_child->bucket = make_unique<RoutingBucket>();
+
+            for (const auto& node : bucket->nodes) {
+                if (node.contact.id.bit(depth())) {
+                    right_child->bucket->nodes.push_back(node);
+                } else {
+                    left_child->bucket->nodes.push_back(node);
+                }
+            }
+            bucket = nullptr;
+        }
+
+        size_t count_routing_nodes() const {
+            if (bucket) return bucket->nodes.size();
+            return left_child->count_routing_nodes()
+                 + right_child->count_routing_nodes();
+        }
+
+        void closest_routing_nodes( NodeID target, size_t max_output
+                                  , vector<NodeContact>& output) {
+            if (output.size() >= max_output) return;
+            if (bucket) {
+                for (auto it = bucket->nodes.rbegin(); it != bucket->nodes.rend(); ++it) {
+                    if (it->is_bad()) continue;
+                    output.push_back(it->contact);
+                    if (output.size() >= max_output) break;
+                }
+            } else if (target.bit(depth())) {
+                right_child->closest_routing_nodes(target, max_output, output);
+                left_child ->closest_routing_nodes(target, max_output, output);
+            } else {
+                left_child ->closest_routing_nodes(target, max_output, output);
+                right_child->closest_routing_nodes(target, max_output, output);
+            }
+        }
+
+        unique_ptr<TreeNode> left_child;
+        unique_ptr<TreeNode> right_child;
+        unique_ptr<RoutingBucket> bucket;
+    };
+
+    public:
+    RoutingTable(NodeID node_id) : _node_id(node_id) {
+        _root_node = make_unique<TreeNode>(NodeID::Range::max());
+        _root_node->bucket = make_unique<RoutingBucket>();
+    }
+
+    RoutingBucket* find_bucket(NodeID id, bool split_buckets) {
+        TreeNode* tree_node = _root_node.get();
+        set<TreeNode*> ancestors;
+        ancestors.insert(tree_node);
+        bool node_contains_self = true;
+        while (!tree_node->bucket) {
+            // (The original compared the bit after this one, an off-by-one.)
+            if (id.bit(tree_node->depth()) != _node_id.bit(tree_node->depth())) {
+                node_contains_self = false;
+            }
+            tree_node = id.bit(tree_node->depth()) ? tree_node->right_child.get()
+                                                   : tree_node->left_child.get();
+            ancestors.insert(tree_node);
+        }
+
+        if (!split_buckets) return tree_node->bucket.get();
+
+        for (auto& node : tree_node->bucket->nodes) {
+            if (node.contact.id == id) return tree_node->bucket.get();
+        }
+
+        const int TREE_BASE = 5;
+        TreeNode* exhaustive_root = exhaustive_routing_subtable_fragment_root();
+
+        while (tree_node->bucket->nodes.size() == RoutingBucket::BUCKET_SIZE
+                && tree_node->depth() < NodeID::bit_size) {
+            if (!node_contains_self
+                && (tree_node->depth() % TREE_BASE) == 0
+                && !ancestors.count(exhaustive_root)) {
+                break;
+            }
+
+            tree_node->split();
+            if (_node_id.bit(tree_node->depth()) != id.bit(tree_node->depth())) {
+                node_contains_self = false;
+            }
+            tree_node = id.bit(tree_node->depth()) ? tree_node->right_child.get()
+                                                   : tree_node->left_child.get();
+            ancestors.insert(tree_node);
+        }
+
+        return tree_node->bucket.get();
+    }
+
+    vector<NodeContact> find_closest_routing_nodes(NodeID target, size_t count) {
+        TreeNode* tree_node = _root_node.get();
+        vector<TreeNode*> ancestors;
+        ancestors.push_back(tree_node);
+
+        while (!tree_node->bucket) {
+            tree_node = target.bit(tree_node->depth()) ? tree_node->right_child.get()
+                                                       : tree_node->left_child.get();
+            ancestors.push_back(tree_node);
+        }
+
+        vector<NodeContact> output;
+        for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+            (*it)->closest_routing_nodes(target, count, output);
+            if (output.size() >= count) break;
+        }
+        return output;
+    }
+
+    private:
+    TreeNode* exhaustive_routing_subtable_fragment_root() const {
+        vector<TreeNode*> path;
+        TreeNode* tree_node = _root_node.get();
+
+        while (!tree_node->bucket) {
+            path.push_back(tree_node);
+            // (The original used the bit after this one, an off-by-one.)
+            tree_node = _node_id.bit(tree_node->depth()) ? tree_node->right_child.get()
+                                                         : tree_node->left_child.get();
+        }
+
+        size_t size = tree_node->bucket->nodes.size();
+
+        while (size < RoutingBucket::BUCKET_SIZE && !path.empty()) {
+            tree_node = path.back();
+            path.pop_back();
+            size += _node_id.bit(path.size())
+                  ? tree_node->left_child->count_routing_nodes()
+                  : tree_node->right_child->count_routing_nodes();
+        }
+
+        return tree_node;
+    }
+
+    NodeID _node_id;
+    unique_ptr<TreeNode> _root_node;
+};
+
+} // legacy namespace
+
+static NodeID random_id(mt19937& rng)
+{
+    NodeID id;
+    for (auto& b : id.buffer) b = rng() & 0xff;
+    return id;
+}
+
+template<class F>
+static double measure(F&& f)
+{
+    auto start = Clock::now();
+    f();
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+template<class Table>
+static size_t insert_all(Table& table, const vector<NodeID>& ids)
+{
+    size_t inserted = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+        RoutingBucket* bucket = table.find_bucket(ids[i], true);
+        if (bucket->nodes.size() >= K) continue;
+
+        RoutingNode node;
+        node.contact = { ids[i], udp::endpoint(asio::ip::address_v4(0x0a000000 + i), 6881) };
+        node.last_activity = Clock::now();
+        node.queries_failed = 0;
+        node.questionable_ping_ongoing = false;
+        bucket->nodes.push_back(node);
+        inserted++;
+    }
+    return inserted;
+}
+
+/*
+ * Average number of the K contacts returned which are among the K closest
+ * ones in the table.
+ */
+template<class Table>
+static double query_all( Table& table
+                       , const vector<NodeID>& in_table
+                       , const vector<NodeID>& targets)
+{
+    size_t hits = 0;
+    for (auto& target : targets) {
+        auto found = table.find_closest_routing_nodes(target, K);
+
+        vector<NodeID> best(in_table);
+        partial_sort(best.begin(), best.begin() + K, best.end(),
+            [&] (const NodeID& l, const NodeID& r) { return target.closer_to(l, r); });
+
+        set<NodeID> best_set(best.begin(), best.begin() + K);
+        for (auto& c : found) hits += best_set.count(c.id);
+    }
+    return double(hits) / targets.size();
+}
+
+template<class Table>
+static double time_queries(Table& table, const vector<NodeID>& targets, size_t rounds)
+{
+    volatile size_t sink = 0;
+    double ms = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            for (auto& target : targets) {
+                sink += table.find_closest_routing_nodes(target, K).size();
+            }
+        }
+    });
+    return ms;
+}
+
+template<class Table>
+static vector<NodeID> contents(Table& table, const vector<NodeID>& ids)
+{
+    vector<NodeID> ret;
+    for (auto& id : ids) {
+        for (auto& node : table.find_bucket(id, false)->nodes) {
+            if (node.contact.id == id) { ret.push_back(id); break; }
+        }
+    }
+    return ret;
+}
+
+int main(int argc, const char** argv)
+{
+    size_t node_count  = argc > 1 ? stoul(argv[1]) : 100000;
+    size_t query_count = argc > 2 ? stoul(argv[2]) : 10000;
+
+    mt19937 rng(1);
+
+    NodeID self = random_id(rng);
+
+    vector<NodeID> ids;
+    for (size_t i = 0; i < node_count; i++) ids.push_back(random_id(rng));
+
+    vector<NodeID> targets;
+    for (size_t i = 0; i < query_count; i++) targets.push_back(random_id(rng));
+
+    cout << "nodes: " << node_count << ", queries: " << query_count << endl;
+
+    /*
+     * Insertion
+     */
+    legacy::RoutingTable old_table(self);
+    RoutingTable new_table(self);
+    size_t old_inserted = 0, new_inserted = 0;
+
+    double old_insert = measure([&] { old_inserted = insert_all(old_table, ids); });
+    double new_insert = measure([&] { new_inserted = insert_all(new_table, ids); });
+
+    cout << "insert:  legacy " << old_insert << " ms (" << old_inserted << " nodes)"
+         << ", flat " << new_insert << " ms (" << new_inserted << " nodes)" << endl;
+
+    // Both layouts must keep the same nodes.
+    if (contents(old_table, ids) != contents(new_table, ids)) {
+        cerr << "routing tables hold different nodes" << endl;
+        return 1;
+    }
+
+    /*
+     * Closest nodes lookups
+     */
+    size_t rounds = 10;
+    double old_query = time_queries(old_table, targets, rounds);
+    double new_query = time_queries(new_table, targets, rounds);
+
+    cout << "closest: legacy " << old_query * 1000 / (rounds * query_count) << " us/query"
+         << ", flat " << new_query * 1000 / (rounds * query_count) << " us/query" << endl;
+
+    vector<NodeID> sample(targets.begin(), targets.begin() + min<size_t>(200, targets.size()));
+
+    cout << "exact closest out of " << K << ": legacy "
+         << query_all(old_table, contents(old_table, ids), sample)
+         << ", flat "
+         << query_all(new_table, contents(new_table, ids), sample) << endl;
+
+    /*
+     * Sorting by distance
+     */
+    double old_sort = 0, new_sort = 0, key_sort = 0;
+    size_t sort_rounds = min<size_t>(20, targets.size());
+
+    for (size_t r = 0; r < sort_rounds; r++) {
+        const NodeID& target = targets[r];
+        vector<NodeID> old_sorted(ids), new_sorted(ids);
+
+        old_sort += measure([&] {
+            sort(old_sorted.begin(), old_sorted.end(), [&] (const NodeID& l, const NodeID& r) {
+                return legacy::closer_to(target, l, r);
+            });
+        });
+        new_sort += measure([&] {
+            sort(new_sorted.begin(), new_sorted.end(), [&] (const NodeID& l, const NodeID& r) {
+                return target.closer_to(l, r);
+            });
+        });
+
+        vector<pair<NodeID::Distance, NodeID>> keyed;
+        keyed.reserve(ids.size());
+
+        key_sort += measure([&] {
+            for (auto& id : ids) keyed.push_back({ target.distance(id), id });
+            sort(keyed.begin(), keyed.end(), [] (const auto& l, const auto& r) {
+                return l.first < r.first;
+            });
+        });
+
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (!(new_sorted[i] == old_sorted[i]) || !(keyed[i].second == old_sorted[i])) {
+                cerr << "distance ordering mismatch" << endl;
+                return 1;
+            }
+        }
+    }
+
+    cout << "sort:    legacy " << old_sort / sort_rounds << " ms"
+         << ", closer_to " << new_sort / sort_rounds << " ms"
+         << ", distance() " << key_sort / sort_rounds << " ms" << endl;
+
+    /*
+     * BEP42 node IDs
+     */
+    vector<asio::ip::address> addresses;
+    for (size_t i = 0; i < query_count; i++) {
+        addresses.push_back(asio::ip::address_v4(rng()));
+    }
+
+    vector<NodeID> bep42_ids;
+    double generate = measure([&] {
+        for (auto& a : addresses) bep42_ids.push_back(NodeID::generate(a));
+    });
+
+    size_t compliant = 0;
+    double check = measure([&] {
+        for (size_t i = 0; i < addresses.size(); i++) {
+            compliant += bep42_ids[i].is_bep42_compliant(addresses[i]);
+        }
+    });
+
+    if (compliant != addresses.size()) {
+        cerr << "generated ID not BEP42 compliant" << endl;
+        return 1;
+    }
+
+    cout << "bep42:   generate " << generate * 1000 / query_count << " us/id"
+         << ", check " << check * 1000 / query_count << " us/id" << endl;
+}
@@ -0,0 +1,166 @@
+/*
+ * Benchmark of I/O timeouts at connection scale. Many coroutines (one per
+ * simulated connection) run in one io_service, each doing operations
+ * which are given a timeout that never expires, the way TimeoutStream and
+ * with_timeout are used. Reports operations per second when timeouts use:
+ *
+ *   - an asio timer per connection, waited on for every operation,
+ *   - a coroutine and a timer per operation (what with_timeout used to do),
+ *   - util::Timeout (what with_timeout does now),
+ *   - a util::TimerWheel::Deadline per connection (what TimeoutStream does).
+ *
+ * Usage: bench-timeouts [connections] [operations-per-connection]
+ */
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <iostream>
+
+#include <namespaces.h>
+#include <util/signal.h>
+#include <util/timeout.h>
+#include <util/timer_wheel.h>
+
+using namespace std;
+using namespace ouinet;
+using Clock = chrono::steady_clock;
+
+static const auto timeout = chrono::seconds(30);
+
+// What `util::Timeout` was before using the timer wheel.
+class CoroutineTimeout {
+    struct State {
+        asio::steady_timer timer;
+        Signal<void()> local_abort_signal;
+        bool finished = false;
+
+        State(asio::io_service& ios) : timer(ios) {}
+    };
+
+public:
+    template<class Duration>
+    CoroutineTimeout(asio::io_service& ios, Duration duration)
+        : _state(make_shared<State>(ios))
+    {
+        asio::spawn(ios, [s = _state, duration] (asio::yield_context yield) {
+            if (s->finished) return;
+            sys::error_code ec;
+            s->timer.expires_from_now(duration);
+            s->timer.async_wait(yield[ec]);
+            if (s->finished) return;
+            s->local_abort_signal();
+        });
+    }
+
+    ~CoroutineTimeout()
+    {
+        _state->finished = true;
+        _state->timer.cancel();
+    }
+
+private:
+    shared_ptr<State> _state;
+};
+
+/*
+ * Run `connections` coroutines doing `operations` each.
+ * `Conn` is constructed once per connection and called around
+ * each operation. Return operations per second.
+ */
+template<class Conn>
+static double run(size_t connections, size_t operations)
+{
+    asio::io_service ios;
+
+    auto start = Clock::now();
+
+    for (size_t i = 0; i < connections; i++) {
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            Conn conn(ios);
+            for (size_t j = 0; j < operations; j++) {
+                conn.operation(yield);
+            }
+        });
+    }
+
+    ios.run();
+
+    auto duration = chrono::duration<double>(Clock::now() - start).count();
+    return connections * operations / duration;
+}
+
+// The operation itself, an I/O which completes right away.
+static void io(asio::io_service& ios, asio::yield_context yield)
+{
+    ios.post(yield);
+}
+
+struct TimerPerConnection {
+    asio::io_service& ios;
+    asio::steady_timer timer;
+
+    TimerPerConnection(asio::io_service& ios) : ios(ios), timer(ios) {}
+
+    void operation(asio::yield_context yield) {
+        timer.expires_from_now(timeout);
+        timer.async_wait([] (const sys::error_code&) {});
+        io(ios, yield);
+        timer.cancel();
+    }
+};
+
+struct CoroutinePerOperation {
+    asio::io_service& ios;
+
+    CoroutinePerOperation(asio::io_service& ios) : ios(ios) {}
+
+    void operation(asio::yield_context yield) {
+        CoroutineTimeout t(ios, timeout);
+        io(ios, yield);
+    }
+};
+
+struct WheelTimeout {
+    asio::io_service& ios;
+    Signal<void()> abort_signal;
+
+    WheelTimeout(asio::io_service& ios) : ios(ios) {}
+
+    void operation(asio::yield_context yield) {
+        util::Timeout t(ios, abort_signal, timeout);
+        io(ios, yield);
+    }
+};
+
+struct WheelDeadline {
+    asio::io_service& ios;
+    util::TimerWheel::Deadline deadline;
+
+    WheelDeadline(asio::io_service& ios) : ios(ios), deadline(ios) {}
+
+    void operation(asio::yield_context yield) {
+        deadline.start(timeout, [] {});
+        io(ios, yield);
+        deadline.stop();
+    }
+};
+
+int main(int argc, const char** argv)
+{
+    size_t connections = argc > 1 ? stoul(argv[1]) : 10000;
+    size_t operations  = argc > 2 ? stoul(argv[2]) : 100;
+
+    cout << "connections: " << connections
+         << ", operations per connection: " << operations << endl;
+
+    auto report = [] (const char* name, double rate) {
+        cout << name << "\t" << size_t(rate) << " operations/s" << endl;
+    };
+
+    report("timer per connection   ", run<TimerPerConnection>(connections, operations));
+    report("coroutine per operation", run<CoroutinePerOperation>(connections, operations));
+    report("util::Timeout          ", run<WheelTimeout>(connections, operations));
+    report("wheel deadline         ", run<WheelDeadline>(connections, operations));
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+
+#include <bittorrent/datagram_socket.h>
+#include <util/condition_variable.h>
+
+namespace ouinet { namespace bittorrent {
+
+/*
+ * An in-process datagram network, to run many DHT nodes in a single
+ * io_service without touching the real network.
+ *
+ * Every datagram is delivered after a latency picked uniformly between
+ * min_latency and max_latency, unless it is lost (with probability $loss)
+ * or there is no socket bound to its destination. All the randomness comes
+ * from a generator seeded with $seed, so runs can be repeated.
+ *
+ * Only meant for tests and benchmarks.
+ */
+class SimulatedNetwork {
+    using udp = asio::ip::udp;
+    using Clock = std::chrono::steady_clock;
+
+public:
+    struct Config {
+        Clock::duration min_latency = std::chrono::milliseconds(5);
+        Clock::duration max_latency = std::chrono::milliseconds(50);
+        double loss = 0;
+        unsigned seed = 1;
+    };
+
+    struct Stats {
+        size_t sent = 0;
+        size_t delivered = 0;
+        size_t lost = 0;
+        size_t unreachable = 0;
+    };
+
+private:
+    class Socket : public DatagramSocket {
+    public:
+        Socket(SimulatedNetwork& network, udp::endpoint endpoint)
+            : _network(network)
+            , _endpoint(endpoint)
+            , _received_cv(network._ios)
+        {}
+
+        asio::io_service& get_io_service() override
+        {
+            return _network._ios;
+        }
+
+        void send_to( asio::const_buffer buffer
+                    , const udp::endpoint& to
+                    , asio::yield_context yield) override
+        {
+            if (_closed) {
+                return or_throw(yield, asio::error::bad_descriptor);
+            }
+
+            _network.deliver(
+                std::string( asio::buffer_cast<const char*>(buffer)
+                           , asio::buffer_size(buffer))
+                , _endpoint, to);
+        }
+
+        size_t receive_from( asio::mutable_buffer buffer
+                           , udp::endpoint& from
+                           , asio::yield_context yield) override
+        {
+            while (true) {
+                // Like a real socket, a closed one drops what it received.
+                if (_closed) {
+                    return or_throw<size_t>(yield, asio::error::operation_aborted);
+                }
+
+                if (!_received.empty()) break;
+
+                sys::error_code ec;
+                _received_cv.wait(yield[ec]);
+
+                if (ec) return or_throw<size_t>(yield, ec);
+            }
+
+            auto datagram = std::move(_received.front());
+            _received.pop_front();
+
+            from = datagram.second;
+
+            size_t size = std::min(datagram.first.size(), asio::buffer_size(buffer));
+            memcpy(asio::buffer_cast<char*>(buffer), datagram.first.data(), size);
+            return size;
+        }
+
+        void close() override
+        {
+            if (_closed) return;
+            _closed = true;
+            _network._sockets.erase(_endpoint);
+            _received_cv.notify();
+        }
+
+        ~Socket()
+        {
+            close();
+        }
+
+    private:
+        friend class SimulatedNetwork;
+
+        SimulatedNetwork& _network;
+        udp::endpoint _endpoint;
+        bool _closed = false;
+        std::deque<std::pair<std::string, udp::endpoint>> _received;
+        ConditionVariable _received_cv;
+    };
+
+public:
+    SimulatedNetwork(asio::io_service& ios)
+        : SimulatedNetwork(ios, Config())
+    {}
+
+    SimulatedNetwork(asio::io_service& ios, Config config)
+        : _ios(ios)
+        , _config(config)
+        , _random(config.seed)
+        , _was_destroyed(std::make_shared<bool>(false))
+    {}
+
+    SimulatedNetwork(const SimulatedNetwork&) = delete;
+    SimulatedNetwork& operator=(const SimulatedNetwork&) = delete;
+
+    /*
+     * A socket receiving the datagrams sent to $endpoint. It must be
+     * destroyed before the network.
+     */
+    std::unique_ptr<DatagramSocket> bind(udp::endpoint endpoint)
+    {
+        assert(!_sockets.count(endpoint));
+        auto socket = std::make_unique<Socket>(*this, endpoint);
+        _sockets[endpoint] = socket.get();
+        return std::move(socket);
+    }
+
+    const Stats& stats() const { return _stats; }
+
+    ~SimulatedNetwork()
+    {
+        *_was_destroyed = true;
+    }
+
+private:
+    void deliver(std::string payload, udp::endpoint from, udp::endpoint to)
+    {
+        _stats.sent++;
+
+        if (std::bernoulli_distribution(_config.loss)(_random)) {
+            _stats.lost++;
+            return;
+        }
+
+        std::uniform_int_distribution<Clock::rep> latency
+            ( _config.min_latency.count()
+            , std::max(_config.min_latency, _config.max_latency).count());
+
+        auto timer = std::make_shared<asio::steady_timer>(_ios);
+        timer->expires_from_now(Clock::duration(latency(_random)));
+
+        timer->async_wait([ this
+                          , timer
+                          , wd = _was_destroyed
+                          , payload = std::move(payload)
+                          , from
+                          , to
+                          ] (const sys::error_code&) mutable {
+            if (*wd) return;
+
+            auto i = _sockets.find(to);
+
+            if (i == _sockets.end()) {
+                _stats.unreachable++;
+                return;
+            }
+
+            _stats.delivered++;
+            i->second->_received.emplace_back(std::move(payload), from);
+            i->second->_received_cv.notify();
+        });
+    }
+
+private:
+    asio::io_service& _ios;
+    Config _config;
+    std::mt19937 _random;
+    std::map<udp::endpoint, Socket*> _sockets;
+    Stats _stats;
+    std::shared_ptr<bool> _was_destroyed;
+};
+
+}} // namespaces
@@ -4,12 +4,15 @@
 #include <boost/asio.hpp>
 
 #include <namespaces.h>
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 #define private public
 #include <bittorrent/node_id.h>
 #include <bittorrent/dht.h>
 #include <bittorrent/code.h>
+#include "simulated_network.h"
 
 BOOST_AUTO_TEST_SUITE(bittorrent)
 
@@ -34,6 +37,77 @@ BOOST_AUTO_TEST_CASE(test_generate_node_id)
     BOOST_REQUIRE_EQUAL(id.substr(38), "01");
 }
 
+BOOST_AUTO_TEST_CASE(test_bep42_compliance)
+{
+    // The test vectors from
+    // http://bittorrent.org/beps/bep_0042.html#node-id-restriction
+    vector<pair<string, string>> vectors = {
+        { "124.31.75.21", "5fbfbff10c5d6a4ec8a88e4c6ab4c28b95eee401" },
+        { "21.75.31.124", "5a3ce9c14e7a08645677bbd1cfe7d8f956d53256" },
+        { "65.23.51.170", "a5d43220bc8f112a3d426c84764f8c2a1150e616" },
+        { "84.124.73.14", "1b0321dd1bb1fe518101ceef99462b947a01ff41" },
+        { "43.213.53.83", "e56f6cbf5b7c4be0237986d5243b87aa6d51305a" },
+    };
+
+    for (auto& v : vectors) {
+        auto ip = asio::ip::address::from_string(v.first);
+        BOOST_REQUIRE(NodeID::from_hex(v.second).is_bep42_compliant(ip));
+        BOOST_REQUIRE(NodeID::generate(ip).is_bep42_compliant(ip));
+    }
+
+    auto ip = asio::ip::address::from_string("124.31.75.21");
+    auto other = asio::ip::address::from_string("124.31.75.22");
+    BOOST_REQUIRE(!NodeID::generate(other).is_bep42_compliant(ip));
+
+    // Local addresses are exempt.
+    auto local = asio::ip::address::from_string("192.168.1.1");
+    BOOST_REQUIRE(NodeID::generate(ip).is_bep42_compliant(local));
+}
+
+BOOST_AUTO_TEST_CASE(test_node_id_bits)
+{
+    auto a = NodeID::from_hex("f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0");
+    auto b = a;
+
+    BOOST_REQUIRE_EQUAL(a.common_prefix_length(b), size_t(NodeID::bit_size));
+
+    for (size_t i : { 0, 7, 63, 64, 100, 128, 159 }) {
+        b = a;
+        b.set_bit(i, !a.bit(i));
+        BOOST_REQUIRE_EQUAL(a.common_prefix_length(b), i);
+    }
+
+
+    // The word at a time distance comparisons agree with comparing the
+    // XOR of the IDs byte by byte.
+    auto xor_less = [] (const NodeID& t, const NodeID& l, const NodeID& r) {
+        for (size_t i = 0; i < NodeID::size; i++) {
+            uint8_t dl = t.buffer[i] ^ l.buffer[i];
+            uint8_t dr = t.buffer[i] ^ r.buffer[i];
+            if (dl != dr) return dl < dr;
+        }
+        return false;
+    };
+
+    auto random_id = [] {
+        return NodeID::Range::max().random_id();
+    };
+
+    for (size_t n = 0; n < 1000; n++) {
+        NodeID t = random_id();
+        NodeID l = random_id();
+        NodeID r = random_id();
+
+        // Also compare IDs differing only in their later words.
+        if (n % 3 == 1) std::copy_n(t.buffer.begin(), 8, l.buffer.begin());
+        if (n % 3 == 2) std::copy_n(l.buffer.begin(), 16, r.buffer.begin());
+
+        bool expected = xor_less(t, l, r);
+        BOOST_REQUIRE_EQUAL(t.closer_to(l, r), expected);
+        BOOST_REQUIRE_EQUAL(t.distance(l) < t.distance(r), expected);
+    }
+}
+
 static tcp::endpoint as_tcp(udp::endpoint ep) {
     return { ep.address(), ep.port() };
 }
@@ -68,4 +142,430 @@ BOOST_AUTO_TEST_CASE(test_bep_5)
     ios.run();
 }
 
+BOOST_AUTO_TEST_CASE(test_mutable_data_verify)
+{
+    util::crypto_init();
+
+    auto private_key = util::Ed25519PrivateKey::generate();
+
+    auto item = MutableDataItem::sign("value", 1, "salt", private_key);
+
+    // The second time around, the result comes from the cache.
+    BOOST_REQUIRE(item.verify());
+    BOOST_REQUIRE(item.verify());
+
+    auto forged = item;
+    forged.value = "other value";
+    BOOST_REQUIRE(!forged.verify());
+
+    forged = item;
+    forged.sequence_number = 2;
+    BOOST_REQUIRE(!forged.verify());
+
+    forged = item;
+    forged.salt = "other salt";
+    BOOST_REQUIRE(!forged.verify());
+
+    asio::io_service ios;
+
+    auto verifier = make_unique<MutableDataVerifier>(ios, 2);
+
+    asio::spawn(ios, [&] (auto yield) {
+        auto other = MutableDataItem::sign("value", 2, "salt", private_key);
+
+        BOOST_REQUIRE(verifier->verify(other, yield));
+        BOOST_REQUIRE(verifier->verify(other, yield));
+
+        other.salt = "other salt";
+        BOOST_REQUIRE(!verifier->verify(other, yield));
+
+        // The verifier goes away while this waits for the result.
+        other = MutableDataItem::sign("value", 3, "salt", private_key);
+        ios.post([&] { verifier = nullptr; });
+        BOOST_REQUIRE(verifier->verify(other, yield));
+        BOOST_REQUIRE(!verifier);
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_bounded_storage)
+{
+    using namespace ouinet::bittorrent::dht;
+
+    asio::io_service ios;
+
+    // Both start a background expiry coroutine, let them get to it before
+    // the objects go away.
+    {
+        DataStore store(ios, 1000);
+        ios.poll();
+
+        for (int i = 0; i < 20; i++) {
+            store.put_immutable(string(100, 'a' + i));
+        }
+
+        auto stats = store.stats();
+        BOOST_REQUIRE(stats.bytes <= 1000);
+        BOOST_REQUIRE(stats.immutable_items > 0);
+        BOOST_REQUIRE_EQUAL(stats.immutable_items + stats.evicted_items, 20u);
+
+        // The most recent item is kept, the oldest one is not.
+        BOOST_REQUIRE(store.get_immutable(DataStore::immutable_get_id(string(100, 'a' + 19))));
+        BOOST_REQUIRE(!store.get_immutable(DataStore::immutable_get_id(string(100, 'a'))));
+
+        util::crypto_init();
+        auto private_key = util::Ed25519PrivateKey::generate();
+        auto item = MutableDataItem::sign(BencodedList{1, "two"}, 3, "salt", private_key);
+
+        store.put_mutable(item);
+
+        auto stored = store.get_mutable(DataStore::mutable_get_id(item.public_key, item.salt));
+        BOOST_REQUIRE(stored);
+        BOOST_REQUIRE(bencoding_encode(stored->value) == bencoding_encode(item.value));
+        BOOST_REQUIRE_EQUAL(stored->sequence_number, 3);
+        BOOST_REQUIRE(stored->verify());
+    }
+
+    {
+        Tracker tracker(ios, 2);
+        ios.poll();
+
+        NodeID swarm = util::sha1(string("swarm"));
+        tcp::endpoint a(asio::ip::make_address("10.0.0.1"), 1);
+        tcp::endpoint b(asio::ip::make_address("10.0.0.2"), 2);
+        tcp::endpoint c(asio::ip::make_address("10.0.0.3"), 3);
+
+        tracker.add_peer(swarm, a);
+        tracker.add_peer(swarm, b);
+        tracker.add_peer(swarm, a);
+        tracker.add_peer(swarm, c);
+
+        auto peers = tracker.list_peers(swarm, 10);
+        BOOST_REQUIRE_EQUAL(peers.size(), 2u);
+        BOOST_REQUIRE(find(peers.begin(), peers.end(), b) == peers.end());
+
+        BOOST_REQUIRE_EQUAL(tracker.stats().swarms, 1u);
+        BOOST_REQUIRE_EQUAL(tracker.stats().peers, 2u);
+        BOOST_REQUIRE_EQUAL(tracker.stats().evicted_peers, 1u);
+    }
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_write_tokens)
+{
+    using namespace ouinet::bittorrent::dht;
+
+    util::crypto_init();
+
+    dht::detail::DhtWriteTokenStorage tokens;
+
+    NodeID id = util::sha1(string("target"));
+    NodeID other_id = util::sha1(string("other target"));
+    auto v4 = asio::ip::make_address("192.0.2.1");
+    auto other_v4 = asio::ip::make_address("192.0.2.2");
+    auto v4_mapped = asio::ip::make_address("::ffff:192.0.2.1");
+    auto v6 = asio::ip::make_address("2001:db8::1");
+
+    string token = tokens.generate_token(v4, id);
+
+    BOOST_REQUIRE(tokens.verify_token(v4, id, token));
+    BOOST_REQUIRE(!tokens.verify_token(v4, other_id, token));
+    BOOST_REQUIRE(!tokens.verify_token(other_v4, id, token));
+    BOOST_REQUIRE(!tokens.verify_token(v6, id, token));
+    BOOST_REQUIRE(!tokens.verify_token(v4, id, token.substr(1)));
+
+    auto forged = token;
+    forged.back() ^= 1;
+    BOOST_REQUIRE(!tokens.verify_token(v4, id, forged));
+
+    // An IPv4 address and its v6 mapped form are the same node,
+    // whichever way it reaches us.
+    BOOST_REQUIRE(tokens.verify_token(v4_mapped, id, token));
+    BOOST_REQUIRE(tokens.verify_token(v4, id, tokens.generate_token(v4_mapped, id)));
+
+    string v6_token = tokens.generate_token(v6, id);
+    BOOST_REQUIRE(tokens.verify_token(v6, id, v6_token));
+    BOOST_REQUIRE(!tokens.verify_token(v4, id, v6_token));
+}
+
+BOOST_AUTO_TEST_CASE(test_rate_limiter)
+{
+    auto a = asio::ip::make_address("192.0.2.1");
+    auto b = asio::ip::make_address("192.0.2.2");
+    auto c = asio::ip::make_address("192.0.2.3");
+
+    {
+        // Buckets refill far slower than this test runs.
+        RateLimiter limiter(0.001, 2, 2);
+
+        BOOST_REQUIRE(limiter.consume(a, 1));
+        BOOST_REQUIRE(limiter.consume(a, 1));
+        BOOST_REQUIRE(!limiter.consume(a, 1));
+        BOOST_REQUIRE(limiter.consume(b, 1));
+
+        // No bucket is full again, so there is no room for c.
+        BOOST_REQUIRE(!limiter.consume(c, 1));
+        BOOST_REQUIRE(!limiter.consume(a, 1));
+    }
+
+    {
+        // Buckets refill right away.
+        RateLimiter limiter(1e9, 2, 2);
+
+        BOOST_REQUIRE(limiter.consume(a, 2));
+        BOOST_REQUIRE(limiter.consume(b, 2));
+        std::this_thread::sleep_for(chrono::milliseconds(1));
+
+        // Full buckets are forgotten to make room.
+        BOOST_REQUIRE(limiter.consume(c, 2));
+        BOOST_REQUIRE_EQUAL(limiter._buckets.size(), 1u);
+        BOOST_REQUIRE_EQUAL(limiter._order.size(), 1u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_simulated_network)
+{
+    util::crypto_init();
+
+    asio::io_service ios;
+
+    SimulatedNetwork::Config config;
+    config.min_latency = chrono::milliseconds(1);
+    config.max_latency = chrono::milliseconds(5);
+
+    SimulatedNetwork network(ios, config);
+
+    auto endpoint = [] (size_t i) {
+        return udp::endpoint(asio::ip::address_v4(0x0b000000 + i), 6881);
+    };
+
+    vector<unique_ptr<dht::DhtNode>> nodes;
+    for (size_t i = 0; i < 20; i++) {
+        nodes.push_back(make_unique<dht::DhtNode>(ios, endpoint(i).address()));
+    }
+
+    asio::spawn(ios, [&] (auto yield) {
+        sys::error_code ec;
+
+        // The first two nodes bootstrap off each other, the rest off
+        // the first one.
+        WaitCondition wc(ios);
+        for (size_t i = 0; i < 2; i++) {
+            asio::spawn(ios, [&, i, lock = wc.lock()] (auto yield) {
+                sys::error_code ec;
+                nodes[i]->start(network.bind(endpoint(i)), endpoint(1 - i), yield[ec]);
+            });
+        }
+        wc.wait(yield);
+
+        for (size_t i = 2; i < nodes.size(); i++) {
+            nodes[i]->start(network.bind(endpoint(i)), endpoint(0), yield[ec]);
+            BOOST_REQUIRE(nodes[i]->initialized());
+        }
+
+        auto private_key = util::Ed25519PrivateKey::generate();
+        auto item = MutableDataItem::sign("value", 1, "salt", private_key);
+
+        nodes.front()->data_put_mutable(item, yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        auto found = nodes.back()->data_get_mutable( private_key.public_key()
+                                                   , "salt"
+                                                   , yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE(found);
+        BOOST_REQUIRE(found->value == "value");
+
+        // With a quorum, the search goes on in the background after
+        // returning, and must be safe to leave running when the node goes.
+        MutableGetPolicy policy;
+        policy.quorum = 1;
+
+        found = nodes[10]->data_get_mutable( private_key.public_key()
+                                           , "salt"
+                                           , policy
+                                           , yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE(found);
+
+        nodes.erase(nodes.begin() + 10);
+
+        BOOST_REQUIRE(network.stats().delivered > 0);
+
+        for (auto& node : nodes) node->stop();
+    });
+
+    ios.run();
+}
+
+/*
+ * A routing table for $node with its own ID generated for $wan, and 3 nodes
+ * at each of the first 16 levels (so that every level has a bucket of its
+ * own but none of them gets full).
+ */
+static void fill_routing_table(dht::DhtNode& node, udp::endpoint wan)
+{
+    node._node_id = NodeID::generate(wan.address());
+    node._wan_endpoint = wan;
+    node._routing_table = make_unique<dht::RoutingTable>(node._node_id);
+
+    uint32_t address = 0x0b000100;
+
+    for (size_t level = 0; level < 16; level++) {
+        for (size_t i = 0; i < 3; i++) {
+            NodeID id = NodeID::Range::max().random_id();
+            for (size_t b = 0; b < level; b++) {
+                id.set_bit(b, node._node_id.bit(b));
+            }
+            id.set_bit(level, !node._node_id.bit(level));
+
+            dht::RoutingNode n;
+            n.contact = { id, udp::endpoint(asio::ip::address_v4(address++), 6881) };
+            n.last_activity = chrono::steady_clock::now();
+            n.queries_failed = 0;
+            n.questionable_ping_ongoing = false;
+
+            node._routing_table->find_bucket(id, true)->nodes.push_back(n);
+        }
+    }
+}
+
+// The ranges of the buckets, each with the (sorted) contacts in it.
+static vector<pair<string, vector<string>>> routing_table_layout(dht::DhtNode& node)
+{
+    vector<pair<string, vector<string>>> layout;
+
+    node._routing_table->for_each_bucket(
+        [&] (const NodeID::Range& range, dht::RoutingBucket& bucket) {
+            vector<string> contacts;
+            for (auto& n : bucket.nodes) contacts.push_back(n.contact.to_string());
+            sort(contacts.begin(), contacts.end());
+
+            layout.push_back({ util::bytes::to_hex(range.stencil)
+                             + "/" + to_string(range.mask)
+                             , move(contacts) });
+        });
+
+    return layout;
+}
+
+BOOST_AUTO_TEST_CASE(test_routing_table_snapshot)
+{
+    util::crypto_init();
+
+    asio::io_service ios;
+
+    auto dir = fs::temp_directory_path() / fs::unique_path();
+    auto interface = asio::ip::make_address("11.0.0.1");
+    udp::endpoint wan(asio::ip::make_address("203.0.113.7"), 6881);
+
+    {
+        dht::DhtNode saved(ios, interface, dir);
+        fill_routing_table(saved, wan);
+        saved.save_routing_table();
+
+        dht::DhtNode loaded(ios, interface, dir);
+        BOOST_REQUIRE(loaded.load_routing_table());
+
+        BOOST_REQUIRE(loaded._node_id == saved._node_id);
+        BOOST_REQUIRE(loaded._wan_endpoint == wan);
+
+        auto layout = routing_table_layout(saved);
+        BOOST_REQUIRE_GT(layout.size(), 1u);
+        BOOST_REQUIRE(routing_table_layout(loaded) == layout);
+
+        // Snapshots belong to the interface they were taken on.
+        dht::DhtNode other(ios, asio::ip::make_address("11.0.0.2"), dir);
+        BOOST_REQUIRE(!other.load_routing_table());
+    }
+
+    {
+        // The snapshot of a node whose ID does not go with its address
+        // (e.g. because it was changed by hand) is discarded.
+        dht::DhtNode saved(ios, interface, dir);
+        fill_routing_table(saved, wan);
+        saved._wan_endpoint = udp::endpoint(asio::ip::make_address("198.51.100.1"), 6881);
+        saved.save_routing_table();
+
+        dht::DhtNode loaded(ios, interface, dir);
+        BOOST_REQUIRE(!loaded.load_routing_table());
+    }
+
+    fs::remove_all(dir);
+}
+
+// When a node restored from a snapshot finds out that its address changed,
+// it takes a new ID and rebuilds its routing table for it.
+BOOST_AUTO_TEST_CASE(test_routing_table_snapshot_address_change)
+{
+    util::crypto_init();
+
+    asio::io_service ios;
+
+    SimulatedNetwork::Config config;
+    config.min_latency = chrono::milliseconds(1);
+    config.max_latency = chrono::milliseconds(5);
+
+    SimulatedNetwork network(ios, config);
+
+    auto endpoint = [] (size_t i) {
+        return udp::endpoint(asio::ip::address_v4(0x0b000000 + i), 6881);
+    };
+
+    auto dir = fs::temp_directory_path() / fs::unique_path();
+    udp::endpoint old_wan(asio::ip::make_address("203.0.113.7"), 6881);
+
+    // Not destroyed before running `ios`, as it has work queued on it.
+    dht::DhtNode saved(ios, endpoint(2).address(), dir);
+    fill_routing_table(saved, old_wan);
+    saved.save_routing_table();
+    NodeID old_id = saved._node_id;
+
+    vector<unique_ptr<dht::DhtNode>> nodes;
+    for (size_t i = 0; i < 2; i++) {
+        nodes.push_back(make_unique<dht::DhtNode>(ios, endpoint(i).address()));
+    }
+    nodes.push_back(make_unique<dht::DhtNode>(ios, endpoint(2).address(), dir));
+
+    auto& restored = *nodes.back();
+
+    asio::spawn(ios, [&] (auto yield) {
+        sys::error_code ec;
+
+        WaitCondition wc(ios);
+        for (size_t i = 0; i < 2; i++) {
+            asio::spawn(ios, [&, i, lock = wc.lock()] (auto yield) {
+                sys::error_code ec;
+                nodes[i]->start(network.bind(endpoint(i)), endpoint(1 - i), yield[ec]);
+            });
+        }
+        wc.wait(yield);
+
+        // Usable right away with the restored ID, bootstraps in the background.
+        restored.start(network.bind(endpoint(2)), endpoint(0), yield[ec]);
+        BOOST_REQUIRE(restored.initialized());
+        BOOST_REQUIRE(restored._node_id == old_id);
+
+        asio::steady_timer timer(ios);
+        for (size_t i = 0; i < 100 && restored._node_id == old_id; i++) {
+            timer.expires_from_now(chrono::milliseconds(10));
+            timer.async_wait(yield[ec]);
+        }
+
+        BOOST_REQUIRE(!(restored._node_id == old_id));
+        BOOST_REQUIRE(restored._wan_endpoint == endpoint(2));
+        BOOST_REQUIRE(restored._node_id.is_bep42_compliant(endpoint(2).address()));
+        BOOST_REQUIRE(restored._routing_table->_node_id == restored._node_id);
+
+        saved.stop();
+        for (auto& node : nodes) node->stop();
+    });
+
+    ios.run();
+
+    fs::remove_all(dir);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
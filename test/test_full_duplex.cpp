@@ -0,0 +1,125 @@
+#define BOOST_TEST_MODULE full_duplex
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+#include <full_duplex_forward.h>
+#include <generic_stream.h>
+#include <namespaces.h>
+#include <util/wait_condition.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_full_duplex)
+
+using namespace std;
+using namespace ouinet;
+using tcp = asio::ip::tcp;
+
+static pair<tcp::socket, tcp::socket>
+connected_pair(asio::io_service& ios, asio::yield_context yield)
+{
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket s1(ios), s2(ios);
+    s1.async_connect(acceptor.local_endpoint(), yield);
+    acceptor.async_accept(s2, yield);
+    return make_pair(move(s1), move(s2));
+}
+
+BOOST_AUTO_TEST_CASE(test_relay) {
+    asio::io_service ios;
+    FullDuplexStats stats;
+    string received;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p1 = connected_pair(ios, yield);
+        auto p2 = connected_pair(ios, yield);
+
+        tcp::socket sender  (move(p1.first));
+        tcp::socket receiver(move(p2.second));
+        GenericStream c1(move(p1.second));
+        GenericStream c2(move(p2.first));
+
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            sys::error_code ec;
+            asio::async_write(sender, asio::buffer(string(100000, 'x')), yield[ec]);
+            sender.close();
+        });
+
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            sys::error_code ec;
+            char buf[4096];
+            while (!ec && received.size() < 100000) {
+                size_t n = receiver.async_read_some(asio::buffer(buf), yield[ec]);
+                received.append(buf, n);
+            }
+            // The relay does not end while the other direction is open.
+            receiver.close();
+        });
+
+        stats = full_duplex(c1, c2, yield);
+    });
+
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(received.size(), 100000u);
+    BOOST_REQUIRE_EQUAL(stats.from_c1, 100000u);
+    BOOST_REQUIRE_EQUAL(stats.from_c2, 0u);
+}
+
+// The receiver goes away while data is still being relayed to it.
+// With `splice`, this must not kill the process with SIGPIPE.
+BOOST_AUTO_TEST_CASE(test_peer_closed) {
+    asio::io_service ios;
+    bool relay_done = false;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p1 = connected_pair(ios, yield);
+        auto p2 = connected_pair(ios, yield);
+
+        tcp::socket sender  (move(p1.first));
+        tcp::socket receiver(move(p2.second));
+        GenericStream c1(move(p1.second));
+        GenericStream c2(move(p2.first));
+
+        WaitCondition wc(ios);
+
+        auto sleep = [&] (chrono::milliseconds d, asio::yield_context yield) {
+            asio::steady_timer timer(ios);
+            timer.expires_from_now(d);
+            sys::error_code ec;
+            timer.async_wait(yield[ec]);
+        };
+
+        // Data keeps coming after the receiver is gone.
+        asio::spawn(ios, [&, lock = wc.lock()] (asio::yield_context yield) {
+            sys::error_code ec;
+            string data(1024, 'x');
+            asio::async_write(sender, asio::buffer(data), yield[ec]);
+            sleep(chrono::milliseconds(200), yield);
+            while (!ec) asio::async_write(sender, asio::buffer(data), yield[ec]);
+        });
+
+        // Closing with data left unread resets the connection. The relay
+        // sees that while reading, so the next write fails with EPIPE.
+        asio::spawn(ios, [&, lock = wc.lock()] (asio::yield_context yield) {
+            sleep(chrono::milliseconds(100), yield);
+            receiver.close();
+        });
+
+        full_duplex(c1, c2, yield);
+        relay_done = true;
+
+        // Lets the sender stop.
+        c1.close();
+        wc.wait(yield);
+    });
+
+    ios.run();
+
+    BOOST_REQUIRE(relay_done);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
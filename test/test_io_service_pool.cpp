@@ -0,0 +1,137 @@
+#define BOOST_TEST_MODULE io_service_pool
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <namespaces.h>
+#include <util/io_service_pool.h>
+
+#include <future>
+#include <set>
+#include <thread>
+
+BOOST_AUTO_TEST_SUITE(ouinet_io_service_pool)
+
+using namespace std;
+using namespace ouinet;
+
+// The id of the thread running `ios`.
+static thread::id thread_of(asio::io_service& ios)
+{
+    promise<thread::id> id;
+    ios.post([&] { id.set_value(this_thread::get_id()); });
+    return id.get_future().get();
+}
+
+BOOST_AUTO_TEST_CASE(test_pool_threads) {
+    util::IoServicePool pool(3);
+
+    BOOST_REQUIRE_EQUAL(pool.size(), 3u);
+
+    set<thread::id> threads;
+    for (size_t i = 0; i < pool.size(); i++) {
+        threads.insert(thread_of(pool[i]));
+    }
+
+    BOOST_REQUIRE_EQUAL(threads.size(), 3u);
+    BOOST_REQUIRE(threads.count(this_thread::get_id()) == 0);
+
+    // The same io_service always runs in the same thread.
+    BOOST_REQUIRE(thread_of(pool[1]) == thread_of(pool[1]));
+
+    BOOST_REQUIRE(&pool.next() == &pool[0]);
+    BOOST_REQUIRE(&pool.next() == &pool[1]);
+    BOOST_REQUIRE(&pool.next() == &pool[2]);
+    BOOST_REQUIRE(&pool.next() == &pool[0]);
+
+    pool.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_run_on) {
+    util::IoServicePool pool(2);
+
+    auto target_thread = thread_of(pool[1]);
+
+    // Checked from this thread once the pool is done.
+    thread::id ran_on, ran_here_on, here;
+    int r1 = 0, r2 = 0;
+    sys::error_code ec1, ec2, ec3;
+    promise<void> done;
+
+    asio::spawn(pool[0], [&] (asio::yield_context yield) {
+        Signal<void()> cancel;
+
+        r1 = util::run_on<int>(pool[1], pool[0], [&] (asio::yield_context) {
+            ran_on = this_thread::get_id();
+            return 42;
+        }, cancel, yield[ec1]);
+
+        // Errors make it back too.
+        util::run_on<int>(pool[1], pool[0], [] (asio::yield_context yield) {
+            return or_throw<int>(yield, asio::error::not_found);
+        }, cancel, yield[ec2]);
+
+        // With the same io_service, `f` just runs here.
+        here = this_thread::get_id();
+        r2 = util::run_on<int>(pool[0], pool[0], [&] (asio::yield_context) {
+            ran_here_on = this_thread::get_id();
+            return 7;
+        }, cancel, yield[ec3]);
+
+        done.set_value();
+    });
+
+    // Joining right away could stop `pool[1]` before `f` gets there.
+    done.get_future().get();
+    pool.join();
+
+    BOOST_REQUIRE(!ec1);
+    BOOST_REQUIRE_EQUAL(r1, 42);
+    BOOST_REQUIRE(ran_on == target_thread);
+
+    BOOST_REQUIRE(ec2 == asio::error::not_found);
+
+    BOOST_REQUIRE(!ec3);
+    BOOST_REQUIRE_EQUAL(r2, 7);
+    BOOST_REQUIRE(ran_here_on == here);
+}
+
+BOOST_AUTO_TEST_CASE(test_run_on_cancel) {
+    util::IoServicePool pool(1);
+
+    // Nobody runs this one, so results from it never arrive.
+    asio::io_service stopped;
+
+    Signal<void()> cancel;
+    sys::error_code ec, ec_after;
+
+    asio::spawn(pool[0], [&] (asio::yield_context yield) {
+        asio::steady_timer timer(pool[0]);
+        timer.expires_from_now(chrono::milliseconds(50));
+
+        asio::spawn(pool[0], [&] (asio::yield_context yield) {
+            sys::error_code ec_;
+            timer.async_wait(yield[ec_]);
+            cancel();
+        });
+
+        util::run_on<int>(stopped, pool[0], [] (asio::yield_context) {
+            return 0;
+        }, cancel, yield[ec]);
+
+        // Once cancelled, further calls do not wait at all.
+        util::run_on<int>(stopped, pool[0], [] (asio::yield_context) {
+            return 0;
+        }, cancel, yield[ec_after]);
+    });
+
+    // This would hang if the wait was not cancelled.
+    pool.join();
+
+    BOOST_REQUIRE(ec == asio::error::operation_aborted);
+    BOOST_REQUIRE(ec_after == asio::error::operation_aborted);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,202 @@
+#define BOOST_TEST_MODULE resolver_loop
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+
+#include <chrono>
+#include <thread>
+
+#include <cache/resolver_loop.h>
+#include <namespaces.h>
+#include <or_throw.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_resolver_loop)
+
+using namespace std;
+using namespace ouinet;
+using boost::optional;
+using Clock = ResolverLoop::Clock;
+using chrono::milliseconds;
+
+static ResolverLoop::Config config()
+{
+    ResolverLoop::Config config;
+    config.min_interval = milliseconds(50);
+    config.max_interval = milliseconds(200);
+    config.stall_factor = 2;
+    config.min_stall_timeout = milliseconds(20);
+    config.max_stall_timeout = milliseconds(100);
+    return config;
+}
+
+static void sleep(asio::io_service& ios, Clock::duration d, asio::yield_context yield)
+{
+    asio::steady_timer timer(ios);
+    timer.expires_from_now(d);
+    sys::error_code ec;
+    timer.async_wait(yield[ec]);
+}
+
+/*
+ * Answers with $value (or fails if there is none) after $delay,
+ * and records its name in $calls.
+ */
+static ResolverLoop::Resolve fake_backend( asio::io_service& ios
+                                         , vector<string>& calls
+                                         , string name
+                                         , Clock::duration delay
+                                         , optional<string> value)
+{
+    return [&ios, &calls, name, delay, value] (asio::yield_context yield) {
+        calls.push_back(name);
+        sleep(ios, delay, yield);
+        if (!value) return or_throw<string>(yield, asio::error::not_found);
+        return *value;
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_fallback_on_failure) {
+    asio::io_service ios;
+    vector<string> calls;
+    vector<string> values;
+
+    auto loop = make_shared<ResolverLoop>(ios, [&] (string v, asio::yield_context) {
+            values.push_back(move(v));
+        }, config());
+
+    loop->add_backend("failing", fake_backend(ios, calls, "failing", milliseconds(5), boost::none));
+    loop->add_backend("fast",    fake_backend(ios, calls, "fast",    milliseconds(5), string("v")));
+
+    loop->start();
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+            while (calls.size() < 3) sleep(ios, milliseconds(10), yield);
+            loop->stop();
+        });
+
+    ios.run();
+
+    // Never tried backends go first, in the order they were added. Then the
+    // one which answered goes first, and the failing one is not needed (the
+    // loop is stopped during that second round).
+    BOOST_REQUIRE_EQUAL(calls.size(), 3u);
+    BOOST_REQUIRE_EQUAL(calls[0], "failing");
+    BOOST_REQUIRE_EQUAL(calls[1], "fast");
+    BOOST_REQUIRE_EQUAL(calls[2], "fast");
+
+    BOOST_REQUIRE_EQUAL(values.size(), 1u);
+    BOOST_REQUIRE_EQUAL(values[0], "v");
+}
+
+BOOST_AUTO_TEST_CASE(test_fallback_on_stall) {
+    asio::io_service ios;
+    vector<string> calls;
+    optional<Clock::duration> resolved_after;
+
+    auto start = Clock::now();
+    shared_ptr<ResolverLoop> loop;
+
+    loop = make_shared<ResolverLoop>(ios, [&] (string v, asio::yield_context) {
+            BOOST_REQUIRE_EQUAL(v, "fast");
+            resolved_after = Clock::now() - start;
+            loop->stop();
+        }, config());
+
+    loop->add_backend("stalling", fake_backend(ios, calls, "stalling", milliseconds(500), string("slow")));
+    loop->add_backend("fast",     fake_backend(ios, calls, "fast",     milliseconds(5),   string("fast")));
+
+    loop->start();
+    ios.run();
+
+    // The stalling backend was given the maximum stall timeout, as it never
+    // answered before, and was left running.
+    BOOST_REQUIRE_EQUAL(calls.size(), 2u);
+    BOOST_REQUIRE(resolved_after);
+    BOOST_REQUIRE(*resolved_after >= milliseconds(100));
+    BOOST_REQUIRE(*resolved_after < milliseconds(500));
+}
+
+// A backend failing right as its stall timer fires must not get the next
+// backend taken for stalled.
+BOOST_AUTO_TEST_CASE(test_stale_stall_timer) {
+    asio::io_service ios;
+    vector<string> calls;
+    vector<string> values;
+
+    auto loop = make_shared<ResolverLoop>(ios, [&] (string v, asio::yield_context) {
+            values.push_back(move(v));
+        }, config());
+
+    // Fails after blocking the thread past its stall timeout, so that the
+    // stall timer is done, but its handler only runs after the failure has
+    // been seen and the next backend started.
+    loop->add_backend("failing", [&] (asio::yield_context yield) {
+            calls.push_back("failing");
+            sleep(ios, milliseconds(90), yield);
+            this_thread::sleep_for(milliseconds(30));
+            return or_throw<string>(yield, asio::error::not_found);
+        });
+    loop->add_backend("second", fake_backend(ios, calls, "second", milliseconds(50), string("v")));
+    loop->add_backend("third",  fake_backend(ios, calls, "third",  milliseconds(0),  string("w")));
+
+    loop->start();
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+            while (values.empty()) sleep(ios, milliseconds(10), yield);
+            loop->stop();
+        });
+
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(calls.size(), 2u);
+    BOOST_REQUIRE_EQUAL(calls[1], "second");
+    BOOST_REQUIRE_EQUAL(values.size(), 1u);
+    BOOST_REQUIRE_EQUAL(values[0], "v");
+}
+
+BOOST_AUTO_TEST_CASE(test_interval_backoff) {
+    asio::io_service ios;
+    vector<Clock::time_point> times;
+    vector<string> values;
+
+    // The interval doubles while the value stays the same,
+    // up to the maximum, and drops back when it changes.
+    vector<string> answers = { "a", "a", "a", "a", "b", "b" };
+
+    shared_ptr<ResolverLoop> loop;
+
+    loop = make_shared<ResolverLoop>(ios, [&] (string v, asio::yield_context) {
+            values.push_back(move(v));
+        }, config());
+
+    loop->add_backend("backend", [&] (asio::yield_context yield) {
+            times.push_back(Clock::now());
+            auto answer = answers[times.size() - 1];
+            if (times.size() == answers.size()) loop->stop();
+            return answer;
+        });
+
+    loop->start();
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(times.size(), answers.size());
+
+    vector<Clock::duration> expected = { milliseconds(50)
+                                       , milliseconds(100)
+                                       , milliseconds(200)
+                                       , milliseconds(200)
+                                       , milliseconds(50) };
+
+    for (size_t i = 0; i < expected.size(); i++) {
+        auto gap = times[i + 1] - times[i];
+        BOOST_REQUIRE(gap >= expected[i]);
+        BOOST_REQUIRE(gap < expected[i] + milliseconds(50));
+    }
+
+    BOOST_REQUIRE_EQUAL(values.size(), 2u);
+    BOOST_REQUIRE_EQUAL(values[0], "a");
+    BOOST_REQUIRE_EQUAL(values[1], "b");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include <namespaces.h>
 #include <iostream>
 
+#include <generic_stream.h>
 #include <timeout_stream.h>
 
 BOOST_AUTO_TEST_SUITE(ouinet_timeout_stream)
@@ -126,5 +127,62 @@ BOOST_AUTO_TEST_CASE(test_read_timeout_2) {
     ioc.run();
 }
 
+// GenericStream passes move-only handlers down to the stream it wraps.
+BOOST_AUTO_TEST_CASE(test_in_generic_stream) {
+    asio::io_context ioc;
+
+    tcp::acceptor acceptor(ioc, tcp::endpoint(tcp::v4(), 0));
+
+    asio::spawn(ioc, [&](auto yield) {
+        tcp::socket s(ioc);
+        acceptor.async_accept(s, yield);
+
+        auto timeout_duration = 500ms;
+
+        TimeoutStream<tcp::socket> t(move(s));
+        t.set_read_timeout(timeout_duration);
+
+        GenericStream g(move(t));
+
+        std::string rx_buf(1, '\0');
+        sys::error_code ec;
+
+        asio::async_read(g, asio::buffer(rx_buf), yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE_EQUAL(rx_buf[0], 'a');
+
+        asio::async_write(g, asio::buffer(rx_buf), yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        auto start = now();
+        asio::async_read(g, asio::buffer(rx_buf), yield[ec]);
+        BOOST_REQUIRE(about_equal(start + timeout_duration, now()));
+        BOOST_REQUIRE_EQUAL(ec, asio::error::timed_out);
+    });
+
+    spawn(ioc, [&](auto yield) {
+        tcp::socket s(ioc);
+        TimeoutStream<tcp::socket> t(move(s));
+        t.set_connect_timeout(1s);
+        t.async_connect(acceptor.local_endpoint(), yield);
+
+        GenericStream g(move(t));
+
+        sys::error_code ec;
+        string buf("a");
+        asio::async_write(g, asio::buffer(buf), yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        buf = "_";
+        asio::async_read(g, asio::buffer(buf), yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE_EQUAL(buf, "a");
+
+        async_sleep(ioc, 1s, yield);
+    });
+
+    ioc.run();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
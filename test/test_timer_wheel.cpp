@@ -0,0 +1,95 @@
+#define BOOST_TEST_MODULE timer_wheel
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <namespaces.h>
+#include <util/timer_wheel.h>
+#include <string>
+
+BOOST_AUTO_TEST_SUITE(ouinet_timer_wheel)
+
+using namespace std;
+using namespace ouinet;
+using namespace chrono;
+using Clock = chrono::steady_clock;
+using Deadline = util::TimerWheel::Deadline;
+
+int millis_since(Clock::time_point start) {
+    auto end = Clock::now();
+    return duration_cast<milliseconds>(end - start).count();
+}
+
+BOOST_AUTO_TEST_CASE(test_fire_in_order) {
+    asio::io_service ios;
+
+    auto start = Clock::now();
+    string order;
+    int a_ms = 0, b_ms = 0;
+
+    Deadline a(ios), b(ios);
+    a.start(200ms, [&] { order += "a"; a_ms = millis_since(start); });
+    b.start(100ms, [&] { order += "b"; b_ms = millis_since(start); });
+
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(order, "ba");
+    BOOST_REQUIRE(100 <= b_ms && b_ms < 130);
+    BOOST_REQUIRE(200 <= a_ms && a_ms < 230);
+    BOOST_REQUIRE(!a.is_running() && !b.is_running());
+}
+
+BOOST_AUTO_TEST_CASE(test_stop_and_restart) {
+    asio::io_service ios;
+
+    auto start = Clock::now();
+    string order;
+
+    Deadline a(ios), b(ios), c(ios);
+    a.start(100ms, [&] { order += "a"; });
+    b.start(50ms, [&] {
+        order += "b";
+        // Stop a deadline due later and restart another one.
+        a.stop();
+        c.start(100ms, [&] { order += "c"; });
+    });
+    c.start(60ms, [&] { order += "x"; });
+
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(order, "bc");
+    BOOST_REQUIRE(millis_since(start) >= 150);
+}
+
+BOOST_AUTO_TEST_CASE(test_beyond_one_round) {
+    asio::io_service ios;
+
+    auto start = Clock::now();
+    auto round = util::TimerWheel::tick * util::TimerWheel::slot_count;
+    int ms = 0;
+
+    Deadline far(ios), near(ios);
+    // Both in the same slot, but `far` a round later.
+    far.start(round + 50ms, [&] { ms = millis_since(start); });
+    near.start(50ms, [] {});
+
+    ios.run();
+
+    BOOST_REQUIRE(ms >= duration_cast<milliseconds>(round).count() + 50);
+}
+
+BOOST_AUTO_TEST_CASE(test_stopped_wheel_does_not_block) {
+    asio::io_service ios;
+
+    auto start = Clock::now();
+
+    {
+        Deadline a(ios);
+        a.start(10s, [] {});
+    }  // destroyed before expiring
+
+    ios.run();
+
+    BOOST_REQUIRE(millis_since(start) < 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()